@@ -9,54 +9,100 @@
 #include "loader.h"
 
 #include <glm/gtx/matrix_decompose.hpp>
+#include <glm/gtc/packing.hpp>
 
 #include <imgui.h>
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIdx, const Program& program)
-{
-    Submesh& submesh = mesh.submeshes[submeshIdx];
-
-    // Try finding existing VAO
-    for (u32 i = 0; i < (u32)submesh.vaos.size(); ++i)
-        if (submesh.vaos[i].programHandle == program.handle)
-            return submesh.vaos[i].handle;
+#include <chrono>
 
-    GLuint vaoHandle = 0;
-
-    // Create new VAO
-    glGenVertexArrays(1, &vaoHandle);
-    glBindVertexArray(vaoHandle);
+u32 GetVertexLayoutLocationMask(VertexLayoutId layoutId)
+{
+    switch (layoutId)
+    {
+    case VertexLayoutId::SCREEN: return ScreenSourceVertex::locationMask;
+    case VertexLayoutId::FLOAT_POSITION: return FloatPositionVertex::locationMask;
+    case VertexLayoutId::PACKED_POSITION: return PackedPositionVertex::locationMask;
+    case VertexLayoutId::FLOAT_SURFACE: return FloatSurfaceVertex::locationMask;
+    case VertexLayoutId::PACKED_SURFACE: return PackedSurfaceVertex::locationMask;
+    default: return 0u;
+    }
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
+// Attribute formats of the bound VAO, all read from vertex buffer binding 0
+void SetupVertexLayout(VertexLayoutId layoutId)
+{
+    switch (layoutId)
+    {
+    case VertexLayoutId::SCREEN: ScreenSourceVertex::SetupAttributes(0, 0); break;
+    case VertexLayoutId::FLOAT_POSITION: FloatPositionVertex::SetupAttributes(0, 0); break;
+    case VertexLayoutId::PACKED_POSITION: PackedPositionVertex::SetupAttributes(0, 0); break;
+    case VertexLayoutId::FLOAT_SURFACE: FloatSurfaceVertex::SetupAttributes(0, 0); break;
+    case VertexLayoutId::PACKED_SURFACE: PackedSurfaceVertex::SetupAttributes(0, 0); break;
+    default: break;
+    }
+}
 
-    for (u32 i = 0; i < program.vetexInputLayout.attributes.size(); ++i)
+void CreateVertexLayoutVaos(App* app)
+{
+    for (u32 i = 0; i < (u32)VertexLayoutId::COUNT; ++i)
     {
-        bool attributeWasLinked = false;
+        for (u32 instanced = 0; instanced < 2; ++instanced)
+        {
+            glGenVertexArrays(1, &app->vertexLayoutVaos[i][instanced]);
+            glBindVertexArray(app->vertexLayoutVaos[i][instanced]);
+            SetupVertexLayout((VertexLayoutId)i);
 
-        for (u32 j = 0; j < submesh.vertexBufferLayout.attributes.size(); ++j)
-            if (program.vetexInputLayout.attributes[i].location == submesh.vertexBufferLayout.attributes[j].location)
+            // One object index per instance from binding 1, offset by the baseInstance of each indirect command
+            if (instanced)
             {
-                const u32 index = submesh.vertexBufferLayout.attributes[j].location;
-                const u32 ncomp = submesh.vertexBufferLayout.attributes[j].componentCount;
-                const u32 offset = submesh.vertexBufferLayout.attributes[j].offset + submesh.vertexOffset;
-                const u32 stride = submesh.vertexBufferLayout.stride;
-                glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
-                glEnableVertexAttribArray(index);
-
-                attributeWasLinked = true;
-                break;
+                glEnableVertexAttribArray(OBJECT_INDEX_LOCATION);
+                glVertexAttribIFormat(OBJECT_INDEX_LOCATION, 1, GL_UNSIGNED_INT, 0);
+                glVertexAttribBinding(OBJECT_INDEX_LOCATION, 1);
+                glVertexBindingDivisor(1, 1);
             }
-
-        assert(attributeWasLinked);
+        }
     }
     glBindVertexArray(0);
+}
+
+// The layouts were only checked against the declared inputs, so the linked program must not read others
+void CheckProgramInputs(const Program& program, u32 declaredLocationMask)
+{
+    const u32 undeclaredMask = program.inputLocationMask & ~(declaredLocationMask | (1u << OBJECT_INDEX_LOCATION));
+    if (undeclaredMask != 0)
+        ELOG("Program %s (%s) reads vertex inputs not declared for its layouts, location mask 0x%x", program.programName.c_str(), program.defines.c_str(), undeclaredMask);
+}
+
+/**
+ * Binds the VAO of the layout the program reads from the submesh and attaches the mesh buffers to it.
+ * Layouts and program inputs were matched when they were declared, so a draw only switches buffers.
+ */
+void BindSubmeshVertices(App* app, Mesh& mesh, u32 submeshIdx, const Program& program, GLuint instanceBufferHandle = 0)
+{
+    const Submesh& submesh = mesh.submeshes[submeshIdx];
+    const u32 objectIndexBit = 1u << OBJECT_INDEX_LOCATION;
+    const bool instanced = (program.inputLocationMask & objectIndexBit) != 0;
 
-    // Store new VAO in the submesh
-    VAO vao = { vaoHandle, program.handle };
-    submesh.vaos.push_back(vao);
+    // Depth only programs fetch the position stream instead of the interleaved vertices
+    const bool readsOnlyPositions = mesh.vertexFormat != VertexFormat::RAW && (program.inputLocationMask & ~(PositionShaderInputs::locationMask | objectIndexBit)) == 0;
 
-    return vaoHandle;
+    const VertexLayoutId layoutId = readsOnlyPositions ? submesh.positionStreamLayoutId : submesh.layoutId;
+    assert((program.inputLocationMask & ~(GetVertexLayoutLocationMask(layoutId) | objectIndexBit)) == 0);
+
+    SetVertexArray(app->glState, app->vertexLayoutVaos[(u32)layoutId][instanced ? 1 : 0]);
+    if (readsOnlyPositions)
+        glBindVertexBuffer(0, mesh.vertexBufferHandle, submesh.positionStreamOffset, submesh.positionStreamLayout.stride);
+    else if (mesh.vertexFormat == VertexFormat::RAW)
+        glBindVertexBuffer(0, mesh.vertexBufferHandle, submesh.vertexOffset, submesh.vertexBufferLayout.stride);
+    else
+        glBindVertexBuffer(0, mesh.vertexBufferHandle, submesh.vertexOffset, submesh.gpuVertexBufferLayout.stride);
+    SetElementArrayBuffer(app->glState, mesh.indexBufferHandle);
+
+    if (instanced)
+    {
+        assert(instanceBufferHandle != 0);
+        glBindVertexBuffer(1, instanceBufferHandle, 0, sizeof(u32));
+    }
 }
 
 bool IsPowerOf2(u32 value)
@@ -69,11 +115,27 @@ u32 Align(u32 value, u32 alignment)
     return (value + alignment - 1) & ~(alignment - 1);
 }
 
+u32 CounterRandom(u32 key, u32 counter)
+{
+    // Two rounds of the lowbias32 integer hash over the key mixed with the counter
+    u32 x = key * 0x9E3779B9u ^ (counter + 0x7F4A7C15u);
+    for (u32 round = 0; round < 2; ++round)
+    {
+        x ^= x >> 16;
+        x *= 0x7FEB352Du;
+        x ^= x >> 15;
+        x *= 0x846CA68Bu;
+        x ^= x >> 16;
+    }
+    return x;
+}
+
 Buffer CreateBuffer(u32 size, GLenum type, GLenum usage)
 {
     Buffer buffer = {};
     buffer.size = size;
     buffer.type = type;
+    buffer.usage = usage;
 
     glGenBuffers(1, &buffer.handle);
     glBindBuffer(type, buffer.handle);
@@ -83,6 +145,23 @@ Buffer CreateBuffer(u32 size, GLenum type, GLenum usage)
     return buffer;
 }
 
+Buffer CreateRingBuffer(u32 regionSize, GLenum type)
+{
+    Buffer buffer = CreateBuffer(regionSize * BUFFER_RING_REGIONS, type, GL_STREAM_DRAW);
+    buffer.regionSize = regionSize;
+    buffer.regionIdx = BUFFER_RING_REGIONS - 1; // The first map takes region 0
+    return buffer;
+}
+
+// Ring the GPU copies results to and the CPU maps for reading once their fence has signaled
+Buffer CreateReadbackRing(u32 regionSize)
+{
+    Buffer buffer = CreateBuffer(regionSize * BUFFER_RING_REGIONS, GL_COPY_WRITE_BUFFER, GL_STREAM_READ);
+    buffer.regionSize = regionSize;
+    buffer.regionIdx = BUFFER_RING_REGIONS - 1;
+    return buffer;
+}
+
 void BindBuffer(const Buffer& buffer)
 {
     glBindBuffer(buffer.type, buffer.handle);
@@ -92,6 +171,7 @@ void MapBuffer(Buffer& buffer, GLenum access)
 {
     glBindBuffer(buffer.type, buffer.handle);
     buffer.data = (u8*)glMapBuffer(buffer.type, access);
+    buffer.dataOffset = 0;
     buffer.head = 0;
 }
 
@@ -101,6 +181,53 @@ void UnmapBuffer(Buffer& buffer)
     glBindBuffer(buffer.type, 0);
 }
 
+void MapNextRegion(Buffer& buffer)
+{
+    ASSERT(buffer.regionSize > 0, "Only ring buffers have regions");
+    buffer.regionIdx = (buffer.regionIdx + 1) % BUFFER_RING_REGIONS;
+
+    // Fenced BUFFER_RING_REGIONS - 1 frames ago, so it has almost always signaled already
+    GLsync& fence = buffer.regionFences[buffer.regionIdx];
+    if (fence)
+    {
+        GLenum result = glClientWaitSync(fence, 0, 0);
+        if (result == GL_TIMEOUT_EXPIRED)
+        {
+            buffer.fenceWaits++;
+            do
+                result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+            while (result == GL_TIMEOUT_EXPIRED);
+        }
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    const u32 offset = buffer.regionIdx * buffer.regionSize;
+    glBindBuffer(buffer.type, buffer.handle);
+    buffer.data = glMapBufferRange(buffer.type, offset, buffer.regionSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    buffer.dataOffset = offset;
+    buffer.head = offset;
+}
+
+void FenceRegion(Buffer& buffer)
+{
+    GLsync& fence = buffer.regionFences[buffer.regionIdx];
+    if (fence)
+        glDeleteSync(fence);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void UploadBufferData(Buffer& buffer, const void* data, u32 size)
+{
+    glBindBuffer(buffer.type, buffer.handle);
+    if (size > buffer.size)
+        buffer.size = size;
+    glBufferData(buffer.type, buffer.size, NULL, buffer.usage);
+    if (size > 0u)
+        glBufferSubData(buffer.type, 0, size, data);
+    glBindBuffer(buffer.type, 0);
+}
+
 void AlignHead(Buffer& buffer, u32 alignment)
 {
     ASSERT(IsPowerOf2(alignment), "The alignment must be a power of 2");
@@ -111,7 +238,7 @@ void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment)
 {
     ASSERT(buffer.data != NULL, "The buffer must be mapped first");
     AlignHead(buffer, alignment);
-    memcpy((u8*)buffer.data + buffer.head, data, size);
+    memcpy((u8*)buffer.data + (buffer.head - buffer.dataOffset), data, size);
     buffer.head += size;
 }
 
@@ -160,11 +287,8 @@ u32 BuildScreen(App* app)
     submesh.indices.insert(submesh.indices.end(), { 0, 1, 2, 0, 2, 3 });
 
     // Save attributes to be read
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0 });
-    submesh.vertexBufferLayout.stride = 3 * sizeof(float);
-
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 1, 2, submesh.vertexBufferLayout.stride });
-    submesh.vertexBufferLayout.stride += 2 * sizeof(float);
+    submesh.vertexBufferLayout = ScreenSourceVertex::MakeBufferLayout();
+    submesh.layoutId = VertexLayoutId::SCREEN;
 
     // Create buffers
     u32 vertexBufferSize = 0;
@@ -275,51 +399,12 @@ u32 BuildPlane(App* app)
     submesh.indices.insert(submesh.indices.end(), { 0, 2, 1, 3, 5, 4 });
 
     // Save attributes to be read
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0 });
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 1, 3, 3 * sizeof(float) });
-    submesh.vertexBufferLayout.stride = 6 * sizeof(float);
-
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 2, 2, submesh.vertexBufferLayout.stride });
-    submesh.vertexBufferLayout.stride += 2 * sizeof(float);
-
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 3, 3, submesh.vertexBufferLayout.stride });
-    submesh.vertexBufferLayout.stride += 3 * sizeof(float);
-
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 4, 3, submesh.vertexBufferLayout.stride });
-    submesh.vertexBufferLayout.stride += 3 * sizeof(float);
+    submesh.vertexBufferLayout = SurfaceSourceVertex::MakeBufferLayout();
 
     // Create buffers
-    u32 vertexBufferSize = 0;
-    u32 indexBufferSize = 0;
-
-    vertexBufferSize += submesh.vertices.size() * sizeof(float);
-    indexBufferSize += submesh.indices.size() * sizeof(u32);
-
-    glGenBuffers(1, &mesh.vertexBufferHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
-
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
-
-    u32 indicesOffset = 0;
-    u32 verticesOffset = 0;
+    UploadMeshVertices(mesh, app->usePackedVertices ? VertexFormat::PACKED : VertexFormat::FLOAT);
 
-    const void* verticesData = mesh.submeshes[0].vertices.data();
-    const u32   verticesSize = mesh.submeshes[0].vertices.size() * sizeof(float);
-    glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-    mesh.submeshes[0].vertexOffset = verticesOffset;
-    verticesOffset += verticesSize;
-
-    const void* indicesData = mesh.submeshes[0].indices.data();
-    const u32   indicesSize = mesh.submeshes[0].indices.size() * sizeof(u32);
-    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-    mesh.submeshes[0].indexOffset = indicesOffset;
-    indicesOffset += indicesSize;
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    UploadMeshIndices(mesh);
 
     return modelIdx;
 }
@@ -383,18 +468,100 @@ u32 BuildSphere(App* app)
     }
 
     // Save attributes to be read
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0 });
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 1, 3, 3 * sizeof(float) });
-    submesh.vertexBufferLayout.stride = 6 * sizeof(float);
+    submesh.vertexBufferLayout = SurfaceSourceVertex::MakeBufferLayout();
+
+    // Create buffers
+    UploadMeshVertices(mesh, app->usePackedVertices ? VertexFormat::PACKED : VertexFormat::FLOAT);
 
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 2, 2, submesh.vertexBufferLayout.stride });
-    submesh.vertexBufferLayout.stride += 2 * sizeof(float);
+    UploadMeshIndices(mesh);
+
+    return modelIdx;
+}
+
+u32 BuildIcosphere(App* app, u32 subdivisions)
+{
+    app->models.push_back(Model());
+    Model& model = app->models.back();
+    u32 modelIdx = (u32)app->models.size() - 1u;
+
+    app->meshes.push_back(Mesh());
+    Mesh& mesh = app->meshes.back();
+    model.meshIdx = (u32)app->meshes.size() - 1u;
+
+    mesh.submeshes.push_back(Submesh());
+    Submesh& submesh = mesh.submeshes.back();
+
+    // Icosahedron
+    const f32 t = (1.0f + sqrtf(5.0f)) / 2.0f;
+    std::vector<glm::vec3> positions =
+    {
+        { -1,  t,  0 }, {  1,  t,  0 }, { -1, -t,  0 }, {  1, -t,  0 },
+        {  0, -1,  t }, {  0,  1,  t }, {  0, -1, -t }, {  0,  1, -t },
+        {  t,  0, -1 }, {  t,  0,  1 }, { -t,  0, -1 }, { -t,  0,  1 }
+    };
+    std::vector<u32> indices =
+    {
+        0, 11, 5,   0, 5, 1,    0, 1, 7,    0, 7, 10,   0, 10, 11,
+        1, 5, 9,    5, 11, 4,   11, 10, 2,  10, 7, 6,   7, 1, 8,
+        3, 9, 4,    3, 4, 2,    3, 2, 6,    3, 6, 8,    3, 8, 9,
+        4, 9, 5,    2, 4, 11,   6, 2, 10,   8, 6, 7,    9, 8, 1
+    };
+    for (u32 i = 0; i < positions.size(); ++i)
+        positions[i] = glm::normalize(positions[i]);
+
+    // Split every triangle in four, sharing the new midpoints between neighbours
+    for (u32 s = 0; s < subdivisions; ++s)
+    {
+        std::vector<u32> subdividedIndices;
+        std::vector<std::pair<u64, u32>> midpoints;
+
+        auto GetMidpoint = [&](u32 a, u32 b)
+        {
+            u64 key = a < b ? ((u64)a << 32) | b : ((u64)b << 32) | a;
+            for (u32 i = 0; i < midpoints.size(); ++i)
+                if (midpoints[i].first == key)
+                    return midpoints[i].second;
+
+            positions.push_back(glm::normalize(positions[a] + positions[b]));
+            midpoints.push_back({ key, (u32)positions.size() - 1u });
+            return (u32)positions.size() - 1u;
+        };
+
+        for (u32 i = 0; i < indices.size(); i += 3)
+        {
+            u32 a = indices[i], b = indices[i + 1], c = indices[i + 2];
+            u32 ab = GetMidpoint(a, b);
+            u32 bc = GetMidpoint(b, c);
+            u32 ca = GetMidpoint(c, a);
+            subdividedIndices.insert(subdividedIndices.end(), { a, ab, ca,  b, bc, ab,  c, ca, bc,  ab, bc, ca });
+        }
+        indices.swap(subdividedIndices);
+    }
+
+    // The faces sit inside the unit sphere, push them out so the proxy covers the whole light range
+    f32 minFaceDistance = 1.0f;
+    for (u32 i = 0; i < indices.size(); i += 3)
+    {
+        const glm::vec3& a = positions[indices[i]];
+        const glm::vec3& b = positions[indices[i + 1]];
+        const glm::vec3& c = positions[indices[i + 2]];
+        minFaceDistance = glm::min(minFaceDistance, fabsf(glm::dot(glm::normalize(glm::cross(b - a, c - a)), a)));
+    }
+
+    // Save vertex data
+    submesh.vertexOffset = 0;
+    for (u32 i = 0; i < positions.size(); ++i)
+    {
+        glm::vec3 pos = positions[i] / minFaceDistance;
+        submesh.vertices.insert(submesh.vertices.end(), { /*V*/pos.x, pos.y, pos.z });
+    }
 
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 3, 3, submesh.vertexBufferLayout.stride });
-    submesh.vertexBufferLayout.stride += 3 * sizeof(float);
+    submesh.indexOffset = 0;
+    submesh.indices.swap(indices);
 
-    submesh.vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 4, 3, submesh.vertexBufferLayout.stride });
-    submesh.vertexBufferLayout.stride += 3 * sizeof(float);
+    // Save attributes to be read
+    submesh.vertexBufferLayout = PositionSourceVertex::MakeBufferLayout();
+    submesh.layoutId = VertexLayoutId::FLOAT_POSITION;
 
     // Create buffers
     u32 vertexBufferSize = 0;
@@ -437,6 +604,8 @@ void BuildPrimitives(App* app)
     app->screenIdx = BuildScreen(app);
     app->planeIdx = BuildPlane(app);
     app->sphereIdx = BuildSphere(app);
+    for (u32 i = 0; i < ICOSPHERE_LODS; ++i)
+        app->icosphereIdx[i] = BuildIcosphere(app, i);
 }
 
 u32 CreateEntity(App* const app, u32 modelIdx, u32 programIdx, const glm::vec3& position, const glm::vec3& scaleFactor, const glm::vec3& rotation)
@@ -447,10 +616,11 @@ u32 CreateEntity(App* const app, u32 modelIdx, u32 programIdx, const glm::vec3&
     entity.modelIdx = modelIdx;
     entity.programIdx = programIdx;
 
-    entity.transform = Rotate(Scale(Translate(IDENTITY4, position), scaleFactor), (rotation / 360.0f) * 2.0f * PI);
-    entity.position = position;
-    entity.scale = scaleFactor;
-    entity.rotation = rotation;
+    // Composed with the other new or edited entities in the next Update
+    entity.transform = IDENTITY4;
+    AddTransform(app->entityTransforms, position, EulerDegreesToQuat(rotation), scaleFactor);
+
+    app->gpuSceneDirty = true;
 
     return app->entities.size() - 1u;
 }
@@ -480,11 +650,111 @@ u32 CreateLight(App* const app, const Light::Type& type, const glm::vec3& color,
     return app->lights.size() - 1u;
 }
 
-void CreateColorAttachment(GLuint& handle, const glm::ivec2& displaySize)
+void MarkObjectDataDirty(App* app)
+{
+    for (Entity& entity : app->entities)
+    {
+        entity.dataDirty = true;
+        entity.gpuObjectDirty = true;
+    }
+    for (Light& light : app->lights)
+        light.dataDirty = true;
+}
+
+// Runs of consecutive dirty elements, as first element and count
+std::vector<glm::uvec2> GetDirtyRuns(const std::vector<bool>& dirty)
+{
+    std::vector<glm::uvec2> runs;
+    for (u32 i = 0; i < dirty.size(); ++i)
+    {
+        if (!dirty[i])
+            continue;
+        if (!runs.empty() && runs.back().x + runs.back().y == i)
+            runs.back().y++;
+        else
+            runs.push_back(glm::uvec2(i, 1u));
+    }
+    return runs;
+}
+
+void ComputeModelFeatures(App* app, Model& model)
+{
+    model.hasNormalsTexture = model.hasBumpTexture = model.hasConeTexture = false;
+    for (u32 m = 0u; m < model.materialIdx.size(); ++m)
+    {
+        const Material& material = app->materials[model.materialIdx[m]];
+        model.hasNormalsTexture |= material.normalsTextureIdx > 0;
+        model.hasBumpTexture |= material.bumpTextureIdx > 0;
+        model.hasConeTexture |= material.coneTextureIdx > 0;
+    }
+}
+
+bool ModelHasNormalMapping(const App* app, u32 modelIdx)
+{
+    return app->useNormalMap && app->models[modelIdx].hasNormalsTexture;
+}
+
+bool ModelHasReliefMapping(const App* app, u32 modelIdx)
+{
+    return app->useReliefMap && app->models[modelIdx].hasBumpTexture;
+}
+
+bool ModelHasConeStepMapping(const App* app, u32 modelIdx)
+{
+    return app->useConeStepMapping && ModelHasReliefMapping(app, modelIdx) && app->models[modelIdx].hasConeTexture;
+}
+
+void BindSubmeshMaterial(App* app, const Model& model, u32 submeshIdx)
+{
+    GLuint albedoHandle = app->textures[app->defaultTextureIdx].handle;
+    GLuint normalHandle = 0u;
+    GLuint reliefHandle = 0u;
+    GLuint coneHandle = 0u;
+    if (model.materialIdx.size() > 0u)
+    {
+        u32 submeshMaterialIdx = model.materialIdx[submeshIdx];
+        Material& submeshMaterial = app->materials[submeshMaterialIdx];
+        albedoHandle = app->textures[submeshMaterial.albedoTextureIdx].handle;
+        normalHandle = app->textures[submeshMaterial.normalsTextureIdx].handle;
+        reliefHandle = app->textures[submeshMaterial.bumpTextureIdx].handle;
+        if (submeshMaterial.coneTextureIdx > 0)
+            coneHandle = app->textures[submeshMaterial.coneTextureIdx].handle;
+    }
+
+    SetTexture(app->glState, 0, albedoHandle);
+    SetTexture(app->glState, 1, normalHandle);
+    SetTexture(app->glState, 2, reliefHandle);
+    SetTexture(app->glState, 3, coneHandle);
+}
+
+// Picks the variant of the entity program for the current geometry pass
+u32 GetGeometryProgramIdx(const App* app, const Entity& entity, bool earlyZ)
+{
+    if (entity.programIdx != app->texturedMeshProgramIdx)
+        return entity.programIdx;
+
+    if (earlyZ)
+        return app->useVertexPulling ? app->texturedMeshPullingEarlyZProgramIdx : app->texturedMeshEarlyZProgramIdx;
+    if (ModelHasConeStepMapping(app, entity.modelIdx))
+        return app->useVertexPulling ? app->texturedMeshPullingConeProgramIdx : app->texturedMeshConeProgramIdx;
+    return app->useVertexPulling ? app->texturedMeshPullingProgramIdx : entity.programIdx;
+}
+
+// Same choice for the INDIRECT variants, which only exist for the textured mesh programs
+u32 GetIndirectProgramIdx(const App* app, u32 modelIdx, bool earlyZ)
+{
+    if (earlyZ)
+        return app->texturedMeshIndirectEarlyZProgramIdx;
+    if (ModelHasConeStepMapping(app, modelIdx))
+        return app->texturedMeshIndirectConeProgramIdx;
+    return app->texturedMeshIndirectProgramIdx;
+}
+
+void CreateColorAttachment(GLuint& handle, const glm::ivec2& displaySize, GLint internalFormat, GLenum format, GLenum type)
 {
     glGenTextures(1, &handle);
     glBindTexture(GL_TEXTURE_2D, handle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, displaySize.x, displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, displaySize.x, displaySize.y, 0, format, type, NULL);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -493,85 +763,1125 @@ void CreateColorAttachment(GLuint& handle, const glm::ivec2& displaySize)
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+void CreateDepthStencilAttachment(GLuint& handle, const glm::ivec2& displaySize)
+{
+    CreateColorAttachment(handle, displaySize, GL_DEPTH24_STENCIL8, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8);
+}
+
+void CheckFrameBufferStatus()
+{
+    GLenum frameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (frameBufferStatus != GL_FRAMEBUFFER_COMPLETE)
+    {
+        switch (frameBufferStatus)
+        {
+        case GL_FRAMEBUFFER_UNDEFINED:                     ELOG("GL_FRAMEBUFFER_UNDEFINED"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:         ELOG("GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT: ELOG("GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:        ELOG("GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:        ELOG("GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
+        case GL_FRAMEBUFFER_UNSUPPORTED:                   ELOG("GL_FRAMEBUFFER_UNSUPPORTED"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE:        ELOG("GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
+        case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS:      ELOG("GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
+        default: ELOG("Unknown frame buffer status error!");
+        }
+    }
+}
+
+// Sampler units are program state, so they are assigned once here instead of before every draw.
+// Locations left at -1 are ignored by glProgramUniform1i.
+void SetProgramTextureUnits(const Program& program)
+{
+    glProgramUniform1i(program.handle, program.albedoLocation, 0);
+    glProgramUniform1i(program.handle, program.normalsLocation, 1);
+    glProgramUniform1i(program.handle, program.depthLocation, 2);
+    glProgramUniform1i(program.handle, program.coneLocation, 3);
+}
+
 void SetLightProgramTextureLocations(App* app, u32 programIdx)
 {
     Program& program = app->programs[programIdx];
 
     program.albedoLocation = glGetUniformLocation(program.handle, "uAlbedo");
     program.normalsLocation = glGetUniformLocation(program.handle, "uNormals");
-    program.positionLocation = glGetUniformLocation(program.handle, "uPosition");
     program.depthLocation = glGetUniformLocation(program.handle, "uDepth");
+    SetProgramTextureUnits(program);
 }
 
-void Init(App* app)
+void SetTexturedMeshTextureLocations(App* app, u32 programIdx)
 {
-    app->mode = Mode::COLOR;
-    
-    app->aspectRatio = (float)app->displaySize.x / (float)app->displaySize.y;
-    app->znear = 0.1f;
-    app->zfar = 100.0f;
-    app->projection = glm::perspective(glm::radians(60.0f), app->aspectRatio, app->znear, app->zfar);
-    
-    app->cameraPosition = glm::vec3(0, 0, 20);
-    app->cameraDirection = glm::normalize(glm::vec3(0) - app->cameraPosition);
-    app->view = glm::lookAt(app->cameraPosition, app->cameraDirection, glm::vec3(0,1,0));
-    
-    // Saving openGL details
-    memcpy(app->openGlVersion, glGetString(GL_VERSION), 64);
-    memcpy(app->gpuName, glGetString(GL_RENDERER), 64);
-    memcpy(app->openGlVendor, glGetString(GL_VENDOR), 64);
-    memcpy(app->GLSLVersion, glGetString(GL_SHADING_LANGUAGE_VERSION), 64);
+    Program& program = app->programs[programIdx];
 
-    GLint extensionNum;
-    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionNum);
-    for (int i = 0; i < extensionNum; ++i)
-    {
-        GLubyte* extension = new GLubyte[64];
-        memcpy(extension, glGetStringi(GL_EXTENSIONS, GLuint(i)), 64);
-        app->openGLExtensions.push_back(extension);
-    }
+    program.albedoLocation = glGetUniformLocation(program.handle, "uAlbedo");
+    program.normalsLocation = glGetUniformLocation(program.handle, "uNormal");
+    program.depthLocation = glGetUniformLocation(program.handle, "uRelief");
+    program.coneLocation = glGetUniformLocation(program.handle, "uCone");
+    SetProgramTextureUnits(program);
+}
 
-    // Fill vertex input layout with required attributes
-    app->texturedMeshProgramIdx = LoadProgram(app, "Assets/Shaders/shaders.glsl", "TEXTURED_MESH");
-    Program& texturedMeshProgram = app->programs[app->texturedMeshProgramIdx];
+void SetVertexPullingLocations(App* app, u32 programIdx)
+{
+    Program& program = app->programs[programIdx];
 
-    texturedMeshProgram.albedoLocation = glGetUniformLocation(texturedMeshProgram.handle, "uAlbedo");
-    texturedMeshProgram.normalsLocation = glGetUniformLocation(texturedMeshProgram.handle, "uNormal");
-    texturedMeshProgram.depthLocation = glGetUniformLocation(texturedMeshProgram.handle, "uRelief");
-    
-    // Create entities
-    app->defaultTextureIdx = LoadTexture2D(app, "Assets/Textures/color_white.png");
+    program.vertexLayoutLocation = glGetUniformLocation(program.handle, "uVertexLayout");
+    program.attributeOffsetsLocation = glGetUniformLocation(program.handle, "uAttributeOffsets");
+}
 
-    BuildPrimitives(app);
+/**
+ * Describes the vertices of the submesh to a VERTEX_PULLING program, in 32-bit words of the vertex
+ * buffer bound as a storage buffer. Programs without attribute offsets read the position stream.
+ */
+void SetVertexPullingFormat(const Program& program, const Mesh& mesh, const Submesh& submesh)
+{
+    assert(mesh.vertexFormat != VertexFormat::RAW);
+
+    const bool readsOnlyPositions = program.attributeOffsetsLocation == -1;
+    const VertexBufferLayout& layout = readsOnlyPositions ? submesh.positionStreamLayout : submesh.gpuVertexBufferLayout;
+    const u32 firstByte = readsOnlyPositions ? submesh.positionStreamOffset : submesh.vertexOffset;
+    glUniform4ui(program.vertexLayoutLocation, firstByte / sizeof(u32), layout.stride / sizeof(u32), mesh.vertexFormat == VertexFormat::PACKED ? 1u : 0u, 0u);
+
+    if (readsOnlyPositions)
+        return;
+
+    // Position, normal, texture coordinates and tangent, missing ones get the shader defaults
+    u32 offsets[4] = { UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX };
+    for (const VertexBufferAttribute& attribute : layout.attributes)
+        if (attribute.location < ARRAY_COUNT(offsets))
+            offsets[attribute.location] = attribute.offset / sizeof(u32);
+    glUniform4ui(program.attributeOffsetsLocation, offsets[0], offsets[1], offsets[2], offsets[3]);
+}
 
-    CreateEntity(app, app->planeIdx, app->texturedMeshProgramIdx, glm::vec3(0, -3.4, 0), glm::vec3(20), glm::vec3(0, 0, 0));
-    CreateEntity(app, app->sphereIdx, app->texturedMeshProgramIdx, glm::vec3(0, 3.2, 0), glm::vec3(1.4f), glm::vec3(220, 234, 43));
-    
-    app->patrickIdx = LoadModel(app, "Assets/Models/Patrick/Patrick.obj");
-    app->cyborgIdx = LoadModel(app, "Assets/Models/Cyborg/cyborg.obj");
-    CreateEntity(app, app->patrickIdx, app->texturedMeshProgramIdx, glm::vec3(0, 0, 0), glm::vec3(1.0f), glm::vec3(0, 0, 0));
-    CreateEntity(app, app->patrickIdx, app->texturedMeshProgramIdx, glm::vec3(0, 0, -20), glm::vec3(1, 1, 1), glm::vec3(0, 0, 0));
-    CreateEntity(app, app->cyborgIdx, app->texturedMeshProgramIdx, glm::vec3(10, -15, 6), glm::vec3(5), glm::vec3(0, 0, 0));
-    CreateEntity(app, app->cyborgIdx, app->texturedMeshProgramIdx, glm::vec3(-10, -15, 6), glm::vec3(5), glm::vec3(0, 0, 0));
-    CreateEntity(app, app->patrickIdx, app->texturedMeshProgramIdx, glm::vec3(5, 0, 3), glm::vec3(1, 1, 1), glm::vec3(0, 0, 0));
-    CreateEntity(app, app->patrickIdx, app->texturedMeshProgramIdx, glm::vec3(-5, 0, 3), glm::vec3(1, 1, 1), glm::vec3(0, 0, 0));
+void BindGBufferTextures(App* app)
+{
+    SetTexture(app->glState, 0, GetFrameGraphTexture(app->frameGraph, app->albedoTarget));
+    SetTexture(app->glState, 1, GetFrameGraphTexture(app->frameGraph, app->normalsTarget));
+    SetTexture(app->glState, 2, GetFrameGraphTexture(app->frameGraph, app->depthTarget));
+}
 
-    // Relief Stuff
+f32 GetClusterSliceDepth(const App* app, u32 slice)
+{
+    // Exponential slices keep clusters roughly cubic no matter how far zfar is
+    return app->znear * powf(app->zfar / app->znear, (f32)slice / (f32)CLUSTER_SLICES);
+}
 
-    app->materials.emplace_back(Material());
-    Material& material = app->materials.back();
-    material.albedoTextureIdx = LoadTexture2D(app, "Assets/Textures/diffuse.png");
-    material.normalsTextureIdx = LoadTexture2D(app, "Assets/Textures/normal.png");
-    material.bumpTextureIdx = LoadTexture2D(app, "Assets/Textures/displacement.png");
-    
-    u32 reliefwallIdx = CreateEntity(app, app->planeIdx, app->texturedMeshProgramIdx, glm::vec3(0, 0, 0), glm::vec3(5), glm::vec3(90, 0, 0));
+void ComputeClusterBounds(App* app)
+{
+    app->clusterBounds.resize(CLUSTER_COUNT);
+
+    const glm::mat4 inverseProjection = glm::inverse(app->projection);
+
+    for (u32 z = 0u; z < CLUSTER_SLICES; ++z)
+    {
+        const f32 nearDepth = GetClusterSliceDepth(app, z);
+        const f32 farDepth = GetClusterSliceDepth(app, z + 1u);
+
+        for (u32 y = 0u; y < CLUSTER_TILES_Y; ++y)
+            for (u32 x = 0u; x < CLUSTER_TILES_X; ++x)
+            {
+                ClusterBounds& bounds = app->clusterBounds[x + y * CLUSTER_TILES_X + z * CLUSTER_TILES_X * CLUSTER_TILES_Y];
+                bounds.min = glm::vec3(FLT_MAX);
+                bounds.max = glm::vec3(-FLT_MAX);
+
+                for (u32 corner = 0u; corner < 4u; ++corner)
+                {
+                    glm::vec2 ndc;
+                    ndc.x = ((f32)(x + (corner & 1u)) / CLUSTER_TILES_X) * 2.0f - 1.0f;
+                    ndc.y = ((f32)(y + (corner >> 1u)) / CLUSTER_TILES_Y) * 2.0f - 1.0f;
+
+                    // Point on the near plane, then slide it along the view ray to both slice depths
+                    glm::vec4 point = inverseProjection * glm::vec4(ndc, -1.0f, 1.0f);
+                    glm::vec3 ray = glm::vec3(point) / point.w;
+                    ray /= -ray.z;
+
+                    bounds.min = glm::min(bounds.min, glm::min(ray * nearDepth, ray * farDepth));
+                    bounds.max = glm::max(bounds.max, glm::max(ray * nearDepth, ray * farDepth));
+                }
+            }
+    }
+}
+
+u32 GetClusterSlice(const App* app, f32 depth)
+{
+    if (depth <= app->znear)
+        return 0u;
+    i32 slice = (i32)(logf(depth / app->znear) / logf(app->zfar / app->znear) * CLUSTER_SLICES);
+    return (u32)glm::clamp(slice, 0, CLUSTER_SLICES - 1);
+}
+
+void AssignLightsToClusters(App* app)
+{
+    app->pointLights.clear();
+    app->clusterIndices.clear();
+    app->clusterRanges.assign(CLUSTER_COUNT, glm::uvec2(0u));
+
+    // First pass: find the candidate cluster range of every point light
+    struct LightClusterRange
+    {
+        glm::vec3 viewCenter;
+        f32 range;
+        glm::ivec3 min;
+        glm::ivec3 max;
+    };
+    std::vector<LightClusterRange> lightRanges;
+
+    for (u32 i = 0u; i < app->lights.size(); ++i)
+    {
+        const Light& light = app->lights[i];
+        if (light.type != Light::Type::POINT)
+            continue;
+
+        LightClusterRange lightRange = {};
+        lightRange.viewCenter = glm::vec3(app->view * glm::vec4(light.center, 1.0f));
+        lightRange.range = light.range;
+
+        const f32 nearDepth = -lightRange.viewCenter.z - light.range;
+        const f32 farDepth = -lightRange.viewCenter.z + light.range;
+        if (farDepth < app->znear || nearDepth > app->zfar)
+            continue;
+
+        lightRange.min = glm::ivec3(0, 0, GetClusterSlice(app, nearDepth));
+        lightRange.max = glm::ivec3(CLUSTER_TILES_X - 1, CLUSTER_TILES_Y - 1, GetClusterSlice(app, farDepth));
+
+        // Spheres touching the near plane can't be projected safely, keep every tile for them
+        if (nearDepth > app->znear)
+        {
+            glm::vec2 ndcMin = glm::vec2(FLT_MAX);
+            glm::vec2 ndcMax = glm::vec2(-FLT_MAX);
+            for (u32 corner = 0u; corner < 8u; ++corner)
+            {
+                glm::vec3 offset = glm::vec3((corner & 1u) ? 1.0f : -1.0f, (corner & 2u) ? 1.0f : -1.0f, (corner & 4u) ? 1.0f : -1.0f);
+                glm::vec4 clip = app->projection * glm::vec4(lightRange.viewCenter + offset * light.range, 1.0f);
+                glm::vec2 ndc = glm::vec2(clip) / clip.w;
+                ndcMin = glm::min(ndcMin, ndc);
+                ndcMax = glm::max(ndcMax, ndc);
+            }
+
+            if (ndcMax.x < -1.0f || ndcMax.y < -1.0f || ndcMin.x > 1.0f || ndcMin.y > 1.0f)
+                continue;
+
+            glm::vec2 tiles = glm::vec2(CLUSTER_TILES_X, CLUSTER_TILES_Y);
+            glm::ivec2 tileMin = glm::ivec2(glm::floor((ndcMin * 0.5f + 0.5f) * tiles));
+            glm::ivec2 tileMax = glm::ivec2(glm::floor((ndcMax * 0.5f + 0.5f) * tiles));
+            lightRange.min.x = glm::clamp(tileMin.x, 0, CLUSTER_TILES_X - 1);
+            lightRange.min.y = glm::clamp(tileMin.y, 0, CLUSTER_TILES_Y - 1);
+            lightRange.max.x = glm::clamp(tileMax.x, 0, CLUSTER_TILES_X - 1);
+            lightRange.max.y = glm::clamp(tileMax.y, 0, CLUSTER_TILES_Y - 1);
+        }
+
+        lightRanges.push_back(lightRange);
+        app->pointLights.push_back({ glm::vec4(light.color, 1.0f), glm::vec4(light.center, light.range) });
+    }
+
+    // Second pass: count the lights that really touch every cluster
+    std::vector<u32> candidateClusters;
+
+    for (u32 l = 0u; l < lightRanges.size(); ++l)
+    {
+        const LightClusterRange& lightRange = lightRanges[l];
+        for (i32 z = lightRange.min.z; z <= lightRange.max.z; ++z)
+            for (i32 y = lightRange.min.y; y <= lightRange.max.y; ++y)
+                for (i32 x = lightRange.min.x; x <= lightRange.max.x; ++x)
+                {
+                    u32 clusterIdx = x + y * CLUSTER_TILES_X + z * CLUSTER_TILES_X * CLUSTER_TILES_Y;
+                    const ClusterBounds& bounds = app->clusterBounds[clusterIdx];
+
+                    glm::vec3 closest = glm::clamp(lightRange.viewCenter, bounds.min, bounds.max);
+                    glm::vec3 delta = closest - lightRange.viewCenter;
+                    if (glm::dot(delta, delta) > lightRange.range * lightRange.range)
+                        continue;
+
+                    app->clusterRanges[clusterIdx].y++;
+                    candidateClusters.push_back(clusterIdx);
+                }
+        candidateClusters.push_back(UINT32_MAX); // Separates the lights
+    }
+
+    // Third pass: prefix sum and compact the index lists
+    u32 offset = 0u;
+    for (u32 i = 0u; i < CLUSTER_COUNT; ++i)
+    {
+        app->clusterRanges[i].x = offset;
+        offset += app->clusterRanges[i].y;
+        app->clusterRanges[i].y = 0u;
+    }
+
+    app->clusterIndices.resize(offset);
+    u32 lightIdx = 0u;
+    for (u32 i = 0u; i < candidateClusters.size(); ++i)
+    {
+        if (candidateClusters[i] == UINT32_MAX)
+        {
+            ++lightIdx;
+            continue;
+        }
+        glm::uvec2& range = app->clusterRanges[candidateClusters[i]];
+        app->clusterIndices[range.x + range.y++] = lightIdx;
+    }
+    app->clusterLightAssignments = offset;
+
+    UploadBufferData(app->pointLightsBuffer, app->pointLights.data(), app->pointLights.size() * sizeof(PointLightData));
+    UploadBufferData(app->clusterRangesBuffer, app->clusterRanges.data(), app->clusterRanges.size() * sizeof(glm::uvec2));
+    UploadBufferData(app->clusterIndicesBuffer, app->clusterIndices.data(), app->clusterIndices.size() * sizeof(u32));
+}
+
+bool IsLightVisible(const App* app, u32 lightIdx)
+{
+    // The GPU-driven path only culls entities, lights have no readback to rely on
+    if (!app->useHiZCulling || app->useGpuDrivenCulling || app->lights[lightIdx].type != Light::Type::POINT)
+        return true;
+
+    u32 visibilityIdx = app->entities.size() + lightIdx;
+    return visibilityIdx >= app->cullVisibility.size() || app->cullVisibility[visibilityIdx] != 0u;
+}
+
+void BuildInstancedLightList(App* app)
+{
+    // Pixels covered by a sphere of radius 1 at distance 1
+    const f32 pixelsPerUnit = app->projection[1][1] * app->displaySize.y * 0.5f;
+
+    // Lights are grouped by proxy so every group is one contiguous instanced draw
+    std::vector<PointLightData> lodLights[ICOSPHERE_LODS];
+
+    for (u32 i = 0u; i < app->lights.size(); ++i)
+    {
+        const Light& light = app->lights[i];
+        if (light.type != Light::Type::POINT || !IsLightVisible(app, i))
+            continue;
+
+        f32 depth = -(app->view * glm::vec4(light.center, 1.0f)).z;
+
+        u32 lod = ICOSPHERE_LODS - 1u;
+        if (depth - light.range > app->znear)
+        {
+            f32 screenRadius = light.range / depth * pixelsPerUnit;
+            if (screenRadius < 64.0f)
+                lod = 0u;
+            else if (screenRadius < 256.0f)
+                lod = 1u;
+        }
+
+        lodLights[lod].push_back({ glm::vec4(light.color, 1.0f), glm::vec4(light.center, light.range) });
+    }
+
+    app->pointLights.clear();
+    for (u32 lod = 0u; lod < ICOSPHERE_LODS; ++lod)
+    {
+        app->pointLightInstanceCounts[lod] = lodLights[lod].size();
+        app->pointLights.insert(app->pointLights.end(), lodLights[lod].begin(), lodLights[lod].end());
+    }
+
+    UploadBufferData(app->pointLightsBuffer, app->pointLights.data(), app->pointLights.size() * sizeof(PointLightData));
+}
+
+std::vector<glm::vec3> GetSubmeshPositions(const Submesh& submesh)
+{
+    // Positions are always the attribute at location 0
+    u32 positionOffset = 0u;
+    for (const VertexBufferAttribute& attribute : submesh.vertexBufferLayout.attributes)
+        if (attribute.location == 0)
+            positionOffset = attribute.offset / sizeof(float);
+
+    std::vector<glm::vec3> positions;
+    u32 stride = submesh.vertexBufferLayout.stride / sizeof(float);
+    for (u32 v = positionOffset; v + 2 < submesh.vertices.size(); v += stride)
+        positions.push_back(glm::vec3(submesh.vertices[v], submesh.vertices[v + 1], submesh.vertices[v + 2]));
+    return positions;
+}
+
+u32 GetSubmeshVertexCount(const Submesh& submesh)
+{
+    return submesh.vertices.size() / (submesh.vertexBufferLayout.stride / sizeof(float));
+}
+
+u32 GetIndexSize(const Submesh& submesh)
+{
+    return submesh.indexType == GL_UNSIGNED_SHORT ? sizeof(u16) : sizeof(u32);
+}
+
+void ComputeMeshBounds(Mesh& mesh)
+{
+    mesh.aabbMin = glm::vec3(FLT_MAX);
+    mesh.aabbMax = glm::vec3(-FLT_MAX);
+
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        for (const glm::vec3& position : GetSubmeshPositions(submesh))
+        {
+            mesh.aabbMin = glm::min(mesh.aabbMin, position);
+            mesh.aabbMax = glm::max(mesh.aabbMax, position);
+        }
+    }
+}
+
+// Signed octahedral mapping, decoded by OctDecode in the vertex stage of the mesh programs
+glm::vec2 OctEncode(const glm::vec3& normal)
+{
+    glm::vec3 n = normal / glm::max(glm::abs(normal.x) + glm::abs(normal.y) + glm::abs(normal.z), FLT_EPSILON);
+    if (n.z >= 0.0f)
+        return glm::vec2(n.x, n.y);
+    return (1.0f - glm::abs(glm::vec2(n.y, n.x))) * glm::vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+}
+
+// Writes the attributes of gpuLayout, which may be a subset of the submesh ones
+void AppendGpuVertices(const Submesh& submesh, const VertexBufferLayout& gpuLayout, bool packed, const glm::vec3& boundsMin, f32 boundsSize, std::vector<u8>& data)
+{
+    // Float offset of the surface attributes in the source vertices, -1 when missing
+    i32 sourceOffsets[5] = { -1, -1, -1, -1, -1 };
+    for (const VertexBufferAttribute& attribute : submesh.vertexBufferLayout.attributes)
+        if (attribute.location < ARRAY_COUNT(sourceOffsets))
+            sourceOffsets[attribute.location] = attribute.offset / sizeof(float);
+
+    const u32 sourceStride = submesh.vertexBufferLayout.stride / sizeof(float);
+    const u32 vertexCount = GetSubmeshVertexCount(submesh);
+
+    u32 firstByte = data.size();
+    data.resize(firstByte + vertexCount * gpuLayout.stride);
+
+    for (u32 v = 0; v < vertexCount; ++v)
+    {
+        const float* source = &submesh.vertices[v * sourceStride];
+        u8* target = &data[firstByte + v * gpuLayout.stride];
+
+        for (const VertexBufferAttribute& attribute : gpuLayout.attributes)
+        {
+            const float* value = source + sourceOffsets[attribute.location];
+            u8* output = target + attribute.offset;
+
+            switch (attribute.location)
+            {
+            case 0:
+            {
+                glm::vec3 position = glm::make_vec3(value);
+                if (packed)
+                {
+                    glm::uint64 quantized = glm::packUnorm4x16(glm::vec4((position - boundsMin) / boundsSize, 0.0f));
+                    memcpy(output, &quantized, sizeof(quantized));
+                }
+                else
+                    memcpy(output, &position, sizeof(position));
+                break;
+            }
+            case 1:
+            {
+                glm::vec2 normal = OctEncode(glm::make_vec3(value));
+                if (packed)
+                {
+                    glm::uint32 quantized = glm::packSnorm2x16(normal);
+                    memcpy(output, &quantized, sizeof(quantized));
+                }
+                else
+                    memcpy(output, &normal, sizeof(normal));
+                break;
+            }
+            case 2:
+            {
+                glm::vec2 texCoord = glm::make_vec2(value);
+                if (packed)
+                {
+                    glm::uint32 half = glm::packHalf2x16(texCoord);
+                    memcpy(output, &half, sizeof(half));
+                }
+                else
+                    memcpy(output, &texCoord, sizeof(texCoord));
+                break;
+            }
+            case 3:
+            {
+                glm::vec3 tangent = glm::make_vec3(value);
+                tangent = glm::dot(tangent, tangent) > 0.0f ? glm::normalize(tangent) : glm::vec3(1.0f, 0.0f, 0.0f);
+
+                f32 handedness = 1.0f;
+                if (sourceOffsets[1] >= 0 && sourceOffsets[4] >= 0)
+                {
+                    glm::vec3 normal = glm::make_vec3(source + sourceOffsets[1]);
+                    glm::vec3 bitangent = glm::make_vec3(source + sourceOffsets[4]);
+                    handedness = glm::dot(glm::cross(normal, tangent), bitangent) < 0.0f ? -1.0f : 1.0f;
+                }
+
+                glm::vec4 tangentFrame = glm::vec4(tangent, handedness);
+                if (packed)
+                {
+                    glm::uint32 quantized = glm::packSnorm3x10_1x2(tangentFrame);
+                    memcpy(output, &quantized, sizeof(quantized));
+                }
+                else
+                    memcpy(output, &tangentFrame, sizeof(tangentFrame));
+                break;
+            }
+            }
+        }
+    }
+}
+
+void UploadMeshVertices(Mesh& mesh, VertexFormat format)
+{
+    assert(format != VertexFormat::RAW);
+    const bool packed = format == VertexFormat::PACKED;
+
+    // A cube keeps the dequantization a uniform scale, so the normals need no correction
+    ComputeMeshBounds(mesh);
+    glm::vec3 extent = mesh.aabbMax - mesh.aabbMin;
+    f32 boundsSize = glm::max(extent.x, glm::max(extent.y, extent.z));
+    if (boundsSize <= 0.0f)
+        boundsSize = 1.0f;
+
+    mesh.vertexFormat = format;
+    mesh.positionTransform = packed ? glm::scale(glm::translate(mesh.aabbMin), glm::vec3(boundsSize)) : IDENTITY4;
+
+    std::vector<u8> vertexData;
+    for (Submesh& submesh : mesh.submeshes)
+    {
+        submesh.layoutId = packed ? VertexLayoutId::PACKED_SURFACE : VertexLayoutId::FLOAT_SURFACE;
+        submesh.gpuVertexBufferLayout = packed ? PackedSurfaceVertex::MakeBufferLayout() : FloatSurfaceVertex::MakeBufferLayout();
+        submesh.vertexOffset = vertexData.size();
+        AppendGpuVertices(submesh, submesh.gpuVertexBufferLayout, packed, mesh.aabbMin, boundsSize, vertexData);
+
+        // Tightly packed copy of the positions for the programs that read nothing else
+        submesh.positionStreamLayoutId = packed ? VertexLayoutId::PACKED_POSITION : VertexLayoutId::FLOAT_POSITION;
+        submesh.positionStreamLayout = packed ? PackedPositionVertex::MakeBufferLayout() : FloatPositionVertex::MakeBufferLayout();
+        submesh.positionStreamOffset = vertexData.size();
+        AppendGpuVertices(submesh, submesh.positionStreamLayout, packed, mesh.aabbMin, boundsSize, vertexData);
+    }
+
+    if (mesh.vertexBufferHandle == 0)
+        glGenBuffers(1, &mesh.vertexBufferHandle);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
+    glBufferData(GL_ARRAY_BUFFER, vertexData.size(), vertexData.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+template <typename T>
+void AppendIndices(const std::vector<u32>& indices, std::vector<u8>& data)
+{
+    u32 firstByte = data.size();
+    data.resize(firstByte + indices.size() * sizeof(T));
+
+    T* output = (T*)&data[firstByte];
+    for (u32 i = 0; i < indices.size(); ++i)
+        output[i] = (T)indices[i];
+}
+
+void UploadMeshIndices(Mesh& mesh)
+{
+    std::vector<u8> indexData;
+    for (Submesh& submesh : mesh.submeshes)
+    {
+        submesh.indexType = GetSubmeshVertexCount(submesh) <= 65536u ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+        indexData.resize(Align(indexData.size(), sizeof(u32)));
+        submesh.indexOffset = indexData.size();
+
+        // Levels of detail right after the full detail indices
+        if (submesh.indexType == GL_UNSIGNED_SHORT)
+        {
+            AppendIndices<u16>(submesh.indices, indexData);
+            AppendIndices<u16>(submesh.lodIndices, indexData);
+        }
+        else
+        {
+            AppendIndices<u32>(submesh.indices, indexData);
+            AppendIndices<u32>(submesh.lodIndices, indexData);
+        }
+    }
+
+    glGenBuffers(1, &mesh.indexBufferHandle);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexData.size(), indexData.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void CreateHiZPyramid(App* app)
+{
+    if (app->hiZHandle != 0)
+        glDeleteTextures(1, &app->hiZHandle);
+
+    // Power of two levels so every texel of a level covers exactly 2x2 texels of the previous one
+    app->hiZSize = glm::ivec2(1);
+    while (app->hiZSize.x * 2 <= app->displaySize.x) app->hiZSize.x *= 2;
+    while (app->hiZSize.y * 2 <= app->displaySize.y) app->hiZSize.y *= 2;
+
+    app->hiZLevels = 1u;
+    while ((glm::max(app->hiZSize.x, app->hiZSize.y) >> app->hiZLevels) > 0)
+        ++app->hiZLevels;
+
+    glGenTextures(1, &app->hiZHandle);
+    glBindTexture(GL_TEXTURE_2D, app->hiZHandle);
+    glTexStorage2D(GL_TEXTURE_2D, app->hiZLevels, GL_R32F, app->hiZSize.x, app->hiZSize.y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void ResizeRenderTargets(App* app)
+{
+    // The transient targets are allocated again at the new size by the next frame graph compilation
+    ReleaseFrameGraphTargets(app->frameGraph);
+    CreateHiZPyramid(app);
+}
+
+void GetEntityWorldBounds(const App* app, const Entity& entity, glm::vec3& boxMin, glm::vec3& boxMax)
+{
+    const Mesh& mesh = app->meshes[app->models[entity.modelIdx].meshIdx];
+
+    // World box of the transformed local box
+    glm::vec3 center = glm::vec3(entity.transform * glm::vec4((mesh.aabbMin + mesh.aabbMax) * 0.5f, 1.0f));
+    glm::vec3 extents = (mesh.aabbMax - mesh.aabbMin) * 0.5f;
+    glm::mat3 absolute = glm::mat3(glm::abs(entity.transform[0]), glm::abs(entity.transform[1]), glm::abs(entity.transform[2]));
+    glm::vec3 worldExtents = absolute * extents;
+
+    boxMin = center - worldExtents;
+    boxMax = center + worldExtents;
+}
+
+void UpdateCullBounds(App* app)
+{
+    app->cullBounds.resize(app->entities.size() + app->lights.size());
+
+    ParallelFor(app->entities.size(), UPDATE_GRAIN_SIZE, [app](u32 begin, u32 end)
+    {
+        for (u32 i = begin; i < end; ++i)
+        {
+            glm::vec3 boxMin, boxMax;
+            GetEntityWorldBounds(app, app->entities[i], boxMin, boxMax);
+            app->cullBounds[i] = { glm::vec4(boxMin, 1.0f), glm::vec4(boxMax, 1.0f) };
+        }
+    });
+
+    for (u32 i = 0; i < app->lights.size(); ++i)
+    {
+        // Directional lights are never culled, their box is ignored
+        const Light& light = app->lights[i];
+        app->cullBounds[app->entities.size() + i] = { glm::vec4(light.center - glm::vec3(light.range), 1.0f), glm::vec4(light.center + glm::vec3(light.range), 1.0f) };
+    }
+}
+
+void BuildOccluders(App* app)
+{
+    app->occluderMeshes.clear();
+
+    for (const Mesh& mesh : app->meshes)
+    {
+        std::vector<glm::vec3> positions;
+        std::vector<u32> indices;
+
+        for (const Submesh& submesh : mesh.submeshes)
+        {
+            // Submesh indices are local, shift them past the positions already gathered
+            u32 vertexBase = positions.size();
+            std::vector<glm::vec3> submeshPositions = GetSubmeshPositions(submesh);
+            positions.insert(positions.end(), submeshPositions.begin(), submeshPositions.end());
+
+            for (u32 index : submesh.indices)
+                indices.push_back(vertexBase + index);
+        }
+
+        app->occluderMeshes.push_back(BuildOccluderMesh(positions, indices, 16u));
+    }
+}
+
+void SoftwareOcclusionCull(App* app)
+{
+    glm::mat4 viewProjection = app->projection * app->view;
+
+    app->occluderTransforms.resize(app->entities.size());
+    for (u32 i = 0; i < app->entities.size(); ++i)
+        app->occluderTransforms[i] = app->entities[i].transform;
+    MultiplyTransforms(viewProjection, app->occluderTransforms.data(), app->occluderTransforms.size(), app->occluderTransforms.data());
+
+    ClearOcclusionBuffer(app->occlusionBuffer);
+    for (u32 i = 0; i < app->entities.size(); ++i)
+        AddOccluder(app->occlusionBuffer, app->occluderMeshes[app->models[app->entities[i].modelIdx].meshIdx], app->occluderTransforms[i]);
+    app->occluderTriangles = app->occlusionBuffer.triangles.size();
+
+    RasterizeOccluders(app->occlusionBuffer);
+
+    // Clustered occluders can bulge past the real surface and hide slightly more than the mesh would,
+    // but they stay inside the mesh bounds, so an entity's own occluder never hides its box
+    app->softwareVisibility.resize(app->entities.size());
+    app->softwareCulledEntities = 0u;
+    for (u32 i = 0; i < app->entities.size(); ++i)
+    {
+        glm::vec3 boxMin, boxMax;
+        GetEntityWorldBounds(app, app->entities[i], boxMin, boxMax);
+        app->softwareVisibility[i] = IsBoxVisible(app->occlusionBuffer, boxMin, boxMax, viewProjection) ? 1u : 0u;
+        if (app->softwareVisibility[i] == 0u)
+            ++app->softwareCulledEntities;
+    }
+}
+
+// World bounding sphere of the mesh box
+void GetEntityBoundingSphere(const App* app, const Entity& entity, glm::vec3& center, f32& radius)
+{
+    const Mesh& mesh = app->meshes[app->models[entity.modelIdx].meshIdx];
+
+    center = glm::vec3(entity.transform * glm::vec4((mesh.aabbMin + mesh.aabbMax) * 0.5f, 1.0f));
+    f32 maxScale = glm::max(glm::length(glm::vec3(entity.transform[0])), glm::max(glm::length(glm::vec3(entity.transform[1])), glm::length(glm::vec3(entity.transform[2]))));
+    radius = glm::length(mesh.aabbMax - mesh.aabbMin) * 0.5f * maxScale;
+}
+
+bool IsEntityCulled(const App* app, u32 entityIdx)
+{
+    if (app->useLods && app->entities[entityIdx].lodCulled)
+        return true;
+    return app->useSoftwareOcclusion && entityIdx < app->softwareVisibility.size() && app->softwareVisibility[entityIdx] == 0u;
+}
+
+bool IsEntityDrawnAsMesh(const App* app, u32 entityIdx)
+{
+    return !IsEntityCulled(app, entityIdx) && !(app->useImpostors && app->entities[entityIdx].drawImpostor);
+}
+
+// Same mapping as OctDecode in the IMPOSTOR shader, uv in [0, 1]
+glm::vec3 OctahedralDirection(const glm::vec2& uv)
+{
+    glm::vec2 f = uv * 2.0f - 1.0f;
+    glm::vec3 n = glm::vec3(f.x, f.y, 1.0f - glm::abs(f.x) - glm::abs(f.y));
+    f32 t = glm::max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return glm::normalize(n);
+}
+
+void BakeImpostor(App* app, u32 modelIdx, Impostor& impostor, GLuint albedoHandle, GLuint normalDepthHandle)
+{
+    Model& model = app->models[modelIdx];
+    Mesh& mesh = app->meshes[model.meshIdx];
+    glm::ivec2 atlasSize = glm::ivec2(IMPOSTOR_FRAMES * IMPOSTOR_FRAME_SIZE);
+
+    // The submeshes are bound through the cache, which the loading code has been going around
+    ResetGLStateCache(app->glState);
+
+    GLuint depthHandle;
+    CreateDepthStencilAttachment(depthHandle, atlasSize);
+
+    GLuint frameBufferHandle;
+    glGenFramebuffers(1, &frameBufferHandle);
+    glBindFramebuffer(GL_FRAMEBUFFER, frameBufferHandle);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, albedoHandle, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, normalDepthHandle, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, depthHandle, 0);
+    CheckFrameBufferStatus();
+
+    GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
+
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+    glEnable(GL_DEPTH_TEST);
+
+    Program& program = app->programs[app->impostorBakeProgramIdx];
+    SetProgram(app->glState, program.handle);
+
+    // Orthographic views from outside the bounding sphere, depth spans it from front to back
+    f32 r = impostor.radius;
+    glm::mat4 projection = glm::ortho(-r, r, -r, r, r, 3.0f * r);
+    for (u32 y = 0; y < IMPOSTOR_FRAMES; ++y)
+        for (u32 x = 0; x < IMPOSTOR_FRAMES; ++x)
+        {
+            glm::vec3 direction = OctahedralDirection((glm::vec2(x, y) + 0.5f) / (f32)IMPOSTOR_FRAMES);
+            glm::vec3 up = glm::abs(direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+            glm::mat4 view = glm::lookAt(impostor.center + direction * 2.0f * r, impostor.center, up);
+            glUniformMatrix4fv(app->impostorBakeViewProjectionLocation, 1, GL_FALSE, glm::value_ptr(projection * view * mesh.positionTransform));
+
+            glViewport(x * IMPOSTOR_FRAME_SIZE, y * IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE);
+            for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+            {
+                BindSubmeshMaterial(app, model, i);
+                BindSubmeshVertices(app, mesh, i, program);
+                glDrawElements(GL_TRIANGLES, mesh.submeshes[i].indices.size(), mesh.submeshes[i].indexType, (void*)(u64)mesh.submeshes[i].indexOffset);
+            }
+        }
+
+    SetVertexArray(app->glState, 0);
+    SetProgram(app->glState, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &frameBufferHandle);
+    glDeleteTextures(1, &depthHandle);
+}
+
+// Same sampling for baked and cached atlases: only the first level, as the coarser ones blend neighbouring frames
+void SetImpostorAtlasSampling(GLuint handle)
+{
+    glBindTexture(GL_TEXTURE_2D, handle);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/**
+ * Bakes the impostor of a model, or loads <model>_impostor_albedo.png and <model>_impostor_normal_depth.png
+ * when they exist and are newer than the model file.
+ */
+void CreateImpostor(App* app, u32 modelIdx, const char* modelFilepath)
+{
+    if (modelIdx == UINT32_MAX)
+        return;
+
+    const Mesh& mesh = app->meshes[app->models[modelIdx].meshIdx];
+
+    Impostor impostor = {};
+    impostor.center = (mesh.aabbMin + mesh.aabbMax) * 0.5f;
+    impostor.radius = glm::length(mesh.aabbMax - mesh.aabbMin) * 0.5f;
+
+    std::string filepath = modelFilepath;
+    std::string basePath = filepath.substr(0, filepath.find_last_of('.'));
+    std::string albedoFilepath = basePath + "_impostor_albedo.png";
+    std::string normalDepthFilepath = basePath + "_impostor_normal_depth.png";
+
+    if (IsCacheCurrent(albedoFilepath.c_str(), modelFilepath) && IsCacheCurrent(normalDepthFilepath.c_str(), modelFilepath))
+    {
+        impostor.albedoTextureIdx = LoadTexture2D(app, albedoFilepath.c_str());
+        impostor.normalDepthTextureIdx = LoadTexture2D(app, normalDepthFilepath.c_str());
+        if (impostor.albedoTextureIdx != UINT32_MAX && impostor.normalDepthTextureIdx != UINT32_MAX)
+        {
+            SetImpostorAtlasSampling(app->textures[impostor.albedoTextureIdx].handle);
+            SetImpostorAtlasSampling(app->textures[impostor.normalDepthTextureIdx].handle);
+        }
+    }
+    else
+    {
+        glm::ivec2 atlasSize = glm::ivec2(IMPOSTOR_FRAMES * IMPOSTOR_FRAME_SIZE);
+        GLuint albedoHandle, normalDepthHandle;
+        CreateColorAttachment(albedoHandle, atlasSize, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        CreateColorAttachment(normalDepthHandle, atlasSize, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+
+        BakeImpostor(app, modelIdx, impostor, albedoHandle, normalDepthHandle);
+
+        WriteTexture2D(albedoHandle, atlasSize, albedoFilepath.c_str());
+        WriteTexture2D(normalDepthHandle, atlasSize, normalDepthFilepath.c_str());
+
+        SetImpostorAtlasSampling(albedoHandle);
+        SetImpostorAtlasSampling(normalDepthHandle);
+
+        impostor.albedoTextureIdx = app->textures.size();
+        app->textures.push_back({ albedoHandle, albedoFilepath });
+        impostor.normalDepthTextureIdx = app->textures.size();
+        app->textures.push_back({ normalDepthHandle, normalDepthFilepath });
+    }
+
+    if (impostor.albedoTextureIdx == UINT32_MAX || impostor.normalDepthTextureIdx == UINT32_MAX)
+    {
+        ELOG("Could not load the impostor of %s", modelFilepath);
+        return;
+    }
+
+    app->models[modelIdx].impostorIdx = app->impostors.size();
+    app->impostors.push_back(impostor);
+}
+
+void SelectImpostors(App* app)
+{
+    for (Entity& entity : app->entities)
+    {
+        entity.drawImpostor = false;
+        if (app->models[entity.modelIdx].impostorIdx == UINT32_MAX)
+            continue;
+
+        glm::vec3 center;
+        f32 radius;
+        GetEntityBoundingSphere(app, entity, center, radius);
+        entity.drawImpostor = glm::length(center - app->cameraPosition) - radius > app->impostorDistance;
+    }
+
+    // Instances are grouped so every impostor is a single instanced draw
+    app->impostorInstances.clear();
+    app->impostorInstanceCounts.assign(app->impostors.size(), 0u);
+    for (u32 i = 0; i < app->impostors.size(); ++i)
+        for (u32 e = 0; e < app->entities.size(); ++e)
+        {
+            const Entity& entity = app->entities[e];
+            if (!entity.drawImpostor || app->models[entity.modelIdx].impostorIdx != i || IsEntityCulled(app, e))
+                continue;
+
+            glm::vec3 center;
+            f32 radius;
+            GetEntityBoundingSphere(app, entity, center, radius);
+            if (!IsSphereInFrustum(app->frustumPlanes, center, radius))
+                continue;
+
+            app->impostorInstances.push_back(entity.transform);
+            ++app->impostorInstanceCounts[i];
+        }
+
+    UploadBufferData(app->impostorInstancesBuffer, app->impostorInstances.data(), app->impostorInstances.size() * sizeof(glm::mat4));
+}
+
+void SelectEntityLods(App* app)
+{
+    app->lodCulledEntities = 0u;
+    app->lodTriangles = 0u;
+
+    // Pixels covered by one world unit at distance 1
+    f32 pixelScale = app->projection[1][1] * app->displaySize.y * 0.5f;
+
+    for (Entity& entity : app->entities)
+    {
+        const Mesh& mesh = app->meshes[app->models[entity.modelIdx].meshIdx];
+
+        glm::vec3 center = glm::vec3(entity.transform * glm::vec4((mesh.aabbMin + mesh.aabbMax) * 0.5f, 1.0f));
+        f32 maxScale = glm::max(glm::length(glm::vec3(entity.transform[0])), glm::max(glm::length(glm::vec3(entity.transform[1])), glm::length(glm::vec3(entity.transform[2]))));
+        f32 radius = glm::length(mesh.aabbMax - mesh.aabbMin) * 0.5f * maxScale;
+        f32 distance = glm::length(center - app->cameraPosition);
+
+        entity.lodCulled = false;
+        if (distance <= radius)
+            entity.lodLevel = 0u;
+        else
+        {
+            f32 pixelsPerUnit = pixelScale / distance;
+            entity.lodCulled = 2.0f * radius * pixelsPerUnit < app->lodMinPixelSize;
+
+            // Coarser only once well under the threshold, finer only once well over it
+            u32 levelCount = glm::max((u32)mesh.lodErrors.size(), 1u);
+            u32 level = glm::min(entity.lodLevel, levelCount - 1u);
+            while (level + 1u < levelCount && mesh.lodErrors[level + 1u] * maxScale * pixelsPerUnit <= app->lodPixelError * (1.0f - LOD_HYSTERESIS))
+                ++level;
+            while (level > 0u && mesh.lodErrors[level] * maxScale * pixelsPerUnit > app->lodPixelError * (1.0f + LOD_HYSTERESIS))
+                --level;
+            entity.lodLevel = level;
+        }
+
+        if (entity.lodCulled)
+        {
+            ++app->lodCulledEntities;
+            continue;
+        }
+
+        for (const Submesh& submesh : mesh.submeshes)
+            app->lodTriangles += (entity.lodLevel == 0u || submesh.lods.empty() ? submesh.indices.size() : submesh.lods[glm::min(entity.lodLevel, (u32)submesh.lods.size()) - 1u].indexCount) / 3u;
+    }
+}
+
+GpuObject GetGpuObject(const App* app, const Entity& entity)
+{
+    const Mesh& mesh = app->meshes[app->models[entity.modelIdx].meshIdx];
+
+    GpuObject object;
+    // Bounds in the space of the vertices, where world applies
+    glm::mat4 meshToVertices = glm::inverse(mesh.positionTransform);
+    object.world = entity.transform * mesh.positionTransform;
+    object.aabbMin = meshToVertices * glm::vec4(mesh.aabbMin, 1.0f);
+    object.aabbMax = meshToVertices * glm::vec4(mesh.aabbMax, 1.0f);
+    object.firstBatch = app->modelFirstBatches[entity.modelIdx];
+    object.batchCount = mesh.submeshes.size();
+    object.hasNormalMapping = ModelHasNormalMapping(app, entity.modelIdx) ? 1u : 0u;
+    object.hasReliefMapping = ModelHasReliefMapping(app, entity.modelIdx) ? 1u : 0u;
+    return object;
+}
+
+/**
+ * Rebuilds the batches and commands and uploads every object, for when entities are added, removed or
+ * change model. The visibility starts over, as the object indices may have moved.
+ */
+void UpdateGpuScene(App* app)
+{
+    // Commands of a model are contiguous, each one owns an instance range big enough for all its entities
+    std::vector<u32> modelInstances(app->models.size(), 0u);
+    for (const Entity& entity : app->entities)
+        ++modelInstances[entity.modelIdx];
+
+    std::vector<u32>& modelFirstBatch = app->modelFirstBatches;
+    modelFirstBatch.assign(app->models.size(), 0u);
+    app->indirectBatches.clear();
+    app->indirectCommands.clear();
+
+    u32 instanceCount = 0u;
+    for (u32 m = 0; m < app->models.size(); ++m)
+    {
+        if (modelInstances[m] == 0u)
+            continue;
+
+        modelFirstBatch[m] = app->indirectBatches.size();
+        const Mesh& mesh = app->meshes[app->models[m].meshIdx];
+        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+        {
+            const Submesh& submesh = mesh.submeshes[i];
+            app->indirectBatches.push_back({ m, i });
+            app->indirectCommands.push_back({ (u32)submesh.indices.size(), 0u, submesh.indexOffset / GetIndexSize(submesh), 0, instanceCount });
+            instanceCount += modelInstances[m];
+        }
+    }
+
+    std::vector<GpuObject> objects(app->entities.size());
+    for (u32 i = 0; i < app->entities.size(); ++i)
+    {
+        objects[i] = GetGpuObject(app, app->entities[i]);
+        app->entities[i].gpuObjectDirty = false;
+    }
+
+    // Everything is drawn in the first phase after a change, the second one then settles the visibility
+    std::vector<u32> visibility(app->entities.size(), 1u);
+    std::vector<u32> instances(instanceCount, 0u);
+
+    UploadBufferData(app->gpuObjectsBuffer, objects.data(), objects.size() * sizeof(GpuObject));
+    UploadBufferData(app->objectVisibilityBuffer, visibility.data(), visibility.size() * sizeof(u32));
+    UploadBufferData(app->drawInstancesBuffer, instances.data(), instances.size() * sizeof(u32));
+
+    app->gpuSceneDirty = false;
+}
+
+/**
+ * Writes the objects of the entities whose transform or flags changed, one command per run of
+ * consecutive dirty entities. The batches and the visibility of every object are left as they are.
+ */
+void UpdateGpuObjects(App* app)
+{
+    std::vector<bool> dirty(app->entities.size());
+    for (u32 i = 0; i < app->entities.size(); ++i)
+        dirty[i] = app->entities[i].gpuObjectDirty;
+
+    std::vector<GpuObject> objects;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, app->gpuObjectsBuffer.handle);
+    for (const glm::uvec2& run : GetDirtyRuns(dirty))
+    {
+        objects.resize(run.y);
+        for (u32 i = 0; i < run.y; ++i)
+        {
+            Entity& entity = app->entities[run.x + i];
+            objects[i] = GetGpuObject(app, entity);
+            entity.gpuObjectDirty = false;
+        }
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, run.x * sizeof(GpuObject), run.y * sizeof(GpuObject), objects.data());
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void Init(App* app)
+{
+    app->mode = Mode::COLOR;
+    
+    app->aspectRatio = (float)app->displaySize.x / (float)app->displaySize.y;
+    app->znear = 0.1f;
+    app->zfar = 100.0f;
+    app->projection = glm::perspective(glm::radians(60.0f), app->aspectRatio, app->znear, app->zfar);
+    
+    app->cameraPosition = glm::vec3(0, 0, 20);
+    app->cameraDirection = glm::normalize(glm::vec3(0) - app->cameraPosition);
+    app->view = glm::lookAt(app->cameraPosition, app->cameraDirection, glm::vec3(0,1,0));
+    
+    // Saving openGL details
+    memcpy(app->openGlVersion, glGetString(GL_VERSION), 64);
+    memcpy(app->gpuName, glGetString(GL_RENDERER), 64);
+    memcpy(app->openGlVendor, glGetString(GL_VENDOR), 64);
+    memcpy(app->GLSLVersion, glGetString(GL_SHADING_LANGUAGE_VERSION), 64);
+
+    GLint extensionNum;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionNum);
+    for (int i = 0; i < extensionNum; ++i)
+    {
+        GLubyte* extension = new GLubyte[64];
+        memcpy(extension, glGetStringi(GL_EXTENSIONS, GLuint(i)), 64);
+        app->openGLExtensions.push_back(extension);
+    }
+
+    // Fill vertex input layout with required attributes
+    app->texturedMeshProgramIdx = LoadProgram(app, "Assets/Shaders/shaders.glsl", "TEXTURED_MESH");
+    SetTexturedMeshTextureLocations(app, app->texturedMeshProgramIdx);
+
+    // Same shader with forced early depth tests, used once the prepass filled the depth buffer
+    app->texturedMeshEarlyZProgramIdx = LoadProgramVariant(app, "Assets/Shaders/shaders.glsl", "TEXTURED_MESH", "EARLY_Z");
+    SetTexturedMeshTextureLocations(app, app->texturedMeshEarlyZProgramIdx);
+
+    // Relief mapping converging with a few cone steps instead of the linear search
+    app->texturedMeshConeProgramIdx = LoadProgramVariant(app, "Assets/Shaders/shaders.glsl", "TEXTURED_MESH", "CONE_STEP_MAPPING");
+    SetTexturedMeshTextureLocations(app, app->texturedMeshConeProgramIdx);
+
+    app->depthPrepassProgramIdx = LoadProgram(app, "Assets/Shaders/shaders.glsl", "DEPTH_PREPASS");
+
+    // Vertices fetched from the mesh vertex buffer by gl_VertexID, with no per-program VAOs
+    app->texturedMeshPullingProgramIdx = LoadProgramVariant(app, "Assets/Shaders/shaders.glsl", "TEXTURED_MESH", "VERTEX_PULLING");
+    app->texturedMeshPullingEarlyZProgramIdx = LoadProgramVariant(app, "Assets/Shaders/shaders.glsl", "TEXTURED_MESH", "VERTEX_PULLING EARLY_Z");
+    app->texturedMeshPullingConeProgramIdx = LoadProgramVariant(app, "Assets/Shaders/shaders.glsl", "TEXTURED_MESH", "VERTEX_PULLING CONE_STEP_MAPPING");
+    app->depthPrepassPullingProgramIdx = LoadProgramVariant(app, "Assets/Shaders/shaders.glsl", "DEPTH_PREPASS", "VERTEX_PULLING");
+    for (u32 programIdx : { app->texturedMeshPullingProgramIdx, app->texturedMeshPullingEarlyZProgramIdx, app->texturedMeshPullingConeProgramIdx })
+        SetTexturedMeshTextureLocations(app, programIdx);
+    for (u32 programIdx : { app->texturedMeshPullingProgramIdx, app->texturedMeshPullingEarlyZProgramIdx, app->texturedMeshPullingConeProgramIdx, app->depthPrepassPullingProgramIdx })
+        SetVertexPullingLocations(app, programIdx);
+    glGenVertexArrays(1, &app->vertexPullingVao);
+
+    // Per-entity data read from storage buffers, drawn with the commands written by GPU_CULL
+    app->texturedMeshIndirectProgramIdx = LoadProgramVariant(app, "Assets/Shaders/shaders.glsl", "TEXTURED_MESH", "INDIRECT");
+    SetTexturedMeshTextureLocations(app, app->texturedMeshIndirectProgramIdx);
+    app->texturedMeshIndirectEarlyZProgramIdx = LoadProgramVariant(app, "Assets/Shaders/shaders.glsl", "TEXTURED_MESH", "INDIRECT EARLY_Z");
+    SetTexturedMeshTextureLocations(app, app->texturedMeshIndirectEarlyZProgramIdx);
+    app->texturedMeshIndirectConeProgramIdx = LoadProgramVariant(app, "Assets/Shaders/shaders.glsl", "TEXTURED_MESH", "INDIRECT CONE_STEP_MAPPING");
+    SetTexturedMeshTextureLocations(app, app->texturedMeshIndirectConeProgramIdx);
+    app->depthPrepassIndirectProgramIdx = LoadProgramVariant(app, "Assets/Shaders/shaders.glsl", "DEPTH_PREPASS", "INDIRECT");
+
+    // Impostors
+    app->impostorBakeProgramIdx = LoadProgram(app, "Assets/Shaders/shaders.glsl", "IMPOSTOR_BAKE");
+    Program& impostorBakeProgram = app->programs[app->impostorBakeProgramIdx];
+    impostorBakeProgram.albedoLocation = glGetUniformLocation(impostorBakeProgram.handle, "uAlbedo");
+    SetProgramTextureUnits(impostorBakeProgram);
+    app->impostorBakeViewProjectionLocation = glGetUniformLocation(impostorBakeProgram.handle, "uBakeViewProjection");
+
+    app->impostorProgramIdx = LoadProgram(app, "Assets/Shaders/shaders.glsl", "IMPOSTOR");
+    Program& impostorProgram = app->programs[app->impostorProgramIdx];
+    impostorProgram.albedoLocation = glGetUniformLocation(impostorProgram.handle, "uAlbedo");
+    impostorProgram.normalsLocation = glGetUniformLocation(impostorProgram.handle, "uNormalDepth");
+    SetProgramTextureUnits(impostorProgram);
+    app->impostorInstanceOffsetLocation = glGetUniformLocation(impostorProgram.handle, "uInstanceOffset");
+    app->impostorSphereLocation = glGetUniformLocation(impostorProgram.handle, "uSphere");
+    app->impostorFramesLocation = glGetUniformLocation(impostorProgram.handle, "uFrames");
+    
+    // Create entities
+    app->defaultTextureIdx = LoadTexture2D(app, "Assets/Textures/color_white.png");
+
+    BuildPrimitives(app);
+
+    CreateEntity(app, app->planeIdx, app->texturedMeshProgramIdx, glm::vec3(0, -3.4, 0), glm::vec3(20), glm::vec3(0, 0, 0));
+    CreateEntity(app, app->sphereIdx, app->texturedMeshProgramIdx, glm::vec3(0, 3.2, 0), glm::vec3(1.4f), glm::vec3(220, 234, 43));
+    
+    app->patrickIdx = LoadModel(app, "Assets/Models/Patrick/Patrick.obj");
+    app->cyborgIdx = LoadModel(app, "Assets/Models/Cyborg/cyborg.obj");
+    CreateEntity(app, app->patrickIdx, app->texturedMeshProgramIdx, glm::vec3(0, 0, 0), glm::vec3(1.0f), glm::vec3(0, 0, 0));
+    CreateEntity(app, app->patrickIdx, app->texturedMeshProgramIdx, glm::vec3(0, 0, -20), glm::vec3(1, 1, 1), glm::vec3(0, 0, 0));
+    CreateEntity(app, app->cyborgIdx, app->texturedMeshProgramIdx, glm::vec3(10, -15, 6), glm::vec3(5), glm::vec3(0, 0, 0));
+    CreateEntity(app, app->cyborgIdx, app->texturedMeshProgramIdx, glm::vec3(-10, -15, 6), glm::vec3(5), glm::vec3(0, 0, 0));
+    CreateEntity(app, app->patrickIdx, app->texturedMeshProgramIdx, glm::vec3(5, 0, 3), glm::vec3(1, 1, 1), glm::vec3(0, 0, 0));
+    CreateEntity(app, app->patrickIdx, app->texturedMeshProgramIdx, glm::vec3(-5, 0, 3), glm::vec3(1, 1, 1), glm::vec3(0, 0, 0));
+
+    // Relief Stuff
+
+    app->materials.emplace_back(Material());
+    Material& material = app->materials.back();
+    material.albedoTextureIdx = LoadTexture2D(app, "Assets/Textures/diffuse.png");
+    material.normalsTextureIdx = LoadTexture2D(app, "Assets/Textures/normal.png");
+    material.bumpTextureIdx = LoadTexture2D(app, "Assets/Textures/displacement.png");
+    material.coneTextureIdx = LoadConeMap(app, "Assets/Textures/displacement.png");
+    
+    u32 reliefwallIdx = CreateEntity(app, app->planeIdx, app->texturedMeshProgramIdx, glm::vec3(0, 0, 0), glm::vec3(5), glm::vec3(90, 0, 0));
     app->models[app->entities[reliefwallIdx].modelIdx].materialIdx.emplace_back(app->materials.size() - 1u);
     
+    for (Model& model : app->models)
+        ComputeModelFeatures(app, model);
+    for (Mesh& mesh : app->meshes)
+        ComputeMeshBounds(mesh);
+    BuildOccluders(app);
+
+    // Distant crowds of these are drawn as impostors
+    CreateImpostor(app, app->patrickIdx, "Assets/Models/Patrick/Patrick.obj");
+    CreateImpostor(app, app->cyborgIdx, "Assets/Models/Cyborg/cyborg.obj");
+    app->impostorInstancesBuffer = CreateStorageBuffer(app->entities.size() * sizeof(glm::mat4));
+
     // Deferred Shading
     app->directionalProgramIdx = LoadProgram(app, "Assets/Shaders/shaders.glsl", "DIRECTIONAL_LIGHT");
     SetLightProgramTextureLocations(app, app->directionalProgramIdx);
     app->pointProgramIdx = LoadProgram(app, "Assets/Shaders/shaders.glsl", "POINT_LIGHT");
     SetLightProgramTextureLocations(app, app->pointProgramIdx);
+    app->pointInstancedProgramIdx = LoadProgramVariant(app, "Assets/Shaders/shaders.glsl", "POINT_LIGHT", "INSTANCED");
+    SetLightProgramTextureLocations(app, app->pointInstancedProgramIdx);
+    app->pointInstancedLightOffsetLocation = glGetUniformLocation(app->programs[app->pointInstancedProgramIdx].handle, "uLightOffset");
+    app->lightStencilProgramIdx = LoadProgram(app, "Assets/Shaders/shaders.glsl", "LIGHT_STENCIL");
+    app->clusteredProgramIdx = LoadProgram(app, "Assets/Shaders/shaders.glsl", "CLUSTERED_LIGHT");
+    SetLightProgramTextureLocations(app, app->clusteredProgramIdx);
+    Program& clusteredProgram = app->programs[app->clusteredProgramIdx];
+    glUseProgram(clusteredProgram.handle);
+    glUniform3ui(glGetUniformLocation(clusteredProgram.handle, "uClusterGrid"), CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES);
+    glUseProgram(0);
 
     // Create lights
     CreateLight(app, Light::Type::DIRECTIONAL, glm::vec3(0.3f, 0.3f, 0.3f), glm::vec3(1, 1, 1), glm::vec3(1, 1, 1), 0);
@@ -595,62 +1905,56 @@ void Init(App* app)
     app->toScreenProgramIdx = LoadProgram(app, "Assets/Shaders/shaders.glsl", "TO_SCREEN");
     Program& toScreenProgram = app->programs[app->toScreenProgramIdx];
     toScreenProgram.albedoLocation = glGetUniformLocation(toScreenProgram.handle, "uColor");
+    SetProgramTextureUnits(toScreenProgram);
+
+    app->gBufferDebugProgramIdx = LoadProgram(app, "Assets/Shaders/shaders.glsl", "GBUFFER_DEBUG");
+    SetLightProgramTextureLocations(app, app->gBufferDebugProgramIdx);
+    app->gBufferDebugModeLocation = glGetUniformLocation(app->programs[app->gBufferDebugProgramIdx].handle, "uMode");
+
+    // Vertex layouts, matched with the declared program inputs at compile time and with the linked ones here
+    CreateVertexLayoutVaos(app);
+    for (u32 programIdx : { app->texturedMeshProgramIdx, app->texturedMeshEarlyZProgramIdx, app->texturedMeshConeProgramIdx, app->texturedMeshIndirectProgramIdx,
+                            app->texturedMeshIndirectEarlyZProgramIdx, app->texturedMeshIndirectConeProgramIdx, app->impostorBakeProgramIdx })
+        CheckProgramInputs(app->programs[programIdx], SurfaceShaderInputs::locationMask);
+    for (u32 programIdx : { app->depthPrepassProgramIdx, app->depthPrepassIndirectProgramIdx, app->pointProgramIdx, app->pointInstancedProgramIdx, app->lightStencilProgramIdx })
+        CheckProgramInputs(app->programs[programIdx], PositionShaderInputs::locationMask);
+    for (u32 programIdx : { app->impostorProgramIdx, app->directionalProgramIdx, app->clusteredProgramIdx, app->toScreenProgramIdx, app->gBufferDebugProgramIdx })
+        CheckProgramInputs(app->programs[programIdx], ScreenShaderInputs::locationMask);
     
     // Create Uniform Buffer
     glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &app->maxUniformBufferSize);
     glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &app->uniformBlockAlignment);
     
-    app->uniform = CreateConstantBuffer(app->maxUniformBufferSize);
-    
-    // Frame buffer
-    // Albedo
-    CreateColorAttachment(app->albedoAttachmentHandle, app->displaySize);
-    // Normals
-    CreateColorAttachment(app->normalsAttachmentHandle, app->displaySize);
-    // Positions
-    CreateColorAttachment(app->positionsAttachmentHandle, app->displaySize);
-    // Depth
-    CreateColorAttachment(app->depthAttachmentHandle, app->displaySize);
-    glGenTextures(1, &app->depthHandle);
-    glBindTexture(GL_TEXTURE_2D, app->depthHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    
-    app->frameBufferHandle;
-    glGenFramebuffers(1, &app->frameBufferHandle);
-    glBindFramebuffer(GL_FRAMEBUFFER, app->frameBufferHandle);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->albedoAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, app->normalsAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, app->positionsAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, app->depthAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, app->depthHandle, 0);
-    
-    GLenum frameBufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (frameBufferStatus != GL_FRAMEBUFFER_COMPLETE)
-    {
-        switch (frameBufferStatus)
-        {
-        case GL_FRAMEBUFFER_UNDEFINED:                     ELOG("GL_FRAMEBUFFER_UNDEFINED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:         ELOG("GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT: ELOG("GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER:        ELOG("GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER:        ELOG("GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
-        case GL_FRAMEBUFFER_UNSUPPORTED:                   ELOG("GL_FRAMEBUFFER_UNSUPPORTED"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE:        ELOG("GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
-        case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS:      ELOG("GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
-        default: ELOG("Unknown frame buffer status error!");
-        }
-    }
+    app->uniform = CreateRingBuffer(Align(app->maxUniformBufferSize, app->uniformBlockAlignment), GL_UNIFORM_BUFFER);
+
+    // Clustered Shading
+    ComputeClusterBounds(app);
+    app->pointLightsBuffer = CreateStorageBuffer(LIGHT_AMOUNT * sizeof(PointLightData));
+    app->clusterRangesBuffer = CreateStorageBuffer(CLUSTER_COUNT * sizeof(glm::uvec2));
+    app->clusterIndicesBuffer = CreateStorageBuffer(CLUSTER_COUNT * sizeof(u32));
+
+    // Hi-Z Occlusion Culling
+    app->hiZDownsampleProgramIdx = LoadComputeProgram(app, "Assets/Shaders/shaders.glsl", "HIZ_DOWNSAMPLE", "");
+    app->hiZSourceLevelLocation = glGetUniformLocation(app->programs[app->hiZDownsampleProgramIdx].handle, "uSourceLevel");
+    app->hiZSourceSizeLocation = glGetUniformLocation(app->programs[app->hiZDownsampleProgramIdx].handle, "uSourceSize");
+    app->hiZCullProgramIdx = LoadComputeProgram(app, "Assets/Shaders/shaders.glsl", "HIZ_CULL", "");
+    app->hiZObjectCountLocation = glGetUniformLocation(app->programs[app->hiZCullProgramIdx].handle, "uObjectCount");
+
+    CreateHiZPyramid(app);
+    app->cullBoundsBuffer = CreateStorageBuffer((app->entities.size() + app->lights.size()) * sizeof(CullBounds));
+    app->cullVisibilityBuffer = CreateStorageBuffer((app->entities.size() + app->lights.size()) * sizeof(u32));
+    app->cullReadback = CreateReadbackRing(glm::max((u32)(app->entities.size() + app->lights.size()), 1u) * sizeof(u32));
+
+    // GPU-Driven Culling
+    app->gpuCullProgramIdx = LoadComputeProgram(app, "Assets/Shaders/shaders.glsl", "GPU_CULL", "");
+    app->gpuCullObjectCountLocation = glGetUniformLocation(app->programs[app->gpuCullProgramIdx].handle, "uObjectCount");
+    app->gpuCullPhaseLocation = glGetUniformLocation(app->programs[app->gpuCullProgramIdx].handle, "uCullPhase");
+
+    app->gpuObjectsBuffer = CreateBuffer(app->entities.size() * sizeof(GpuObject), GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_DRAW);
+    app->drawCommandsBuffer = CreateBuffer(sizeof(DrawElementsIndirectCommand), GL_DRAW_INDIRECT_BUFFER, GL_STREAM_DRAW);
+    app->drawInstancesBuffer = CreateBuffer(app->entities.size() * sizeof(u32), GL_ARRAY_BUFFER, GL_DYNAMIC_COPY);
+    app->objectVisibilityBuffer = CreateBuffer(app->entities.size() * sizeof(u32), GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
     
-    GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3 };
-    glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
     // Depth test
     glEnable(GL_BLEND);
 }
@@ -675,6 +1979,17 @@ void Gui(App* app)
     }
 
     ImGui::BulletText("FPS: %f", 1.0f / app->deltaTime);
+    ImGui::BulletText("Uniform ring waits: %u", app->uniform.fenceWaits);
+    ImGui::BulletText("Objects written: %u of %u", app->objectDataUpdates, app->objectDataCount);
+    ImGui::BulletText("GL state calls: %u issued, %u dropped", app->glState.issuedCalls, app->glState.droppedCalls);
+    ImGui::BulletText("Frame graph: %u of %u passes culled, %u pooled targets, %u aliased", app->frameGraph.culledPasses, (u32)app->frameGraph.passes.size(), (u32)app->frameGraph.pool.size(), app->frameGraph.aliasedTextures);
+    if (ImGui::Button("Benchmark Transforms"))
+        BenchmarkTransforms(app);
+    if (app->transformBenchmarkBatchedMs > 0.0f)
+    {
+        ImGui::SameLine();
+        ImGui::Text("%u matrices: glm %.3f ms, batched %.3f ms", TRANSFORM_BENCHMARK_COUNT, app->transformBenchmarkGlmMs, app->transformBenchmarkBatchedMs);
+    }
 
     ImGui::Text("Display Mode:");
     if (ImGui::Button("COLOR"))
@@ -691,8 +2006,87 @@ void Gui(App* app)
     ImGui::SameLine();
     if (ImGui::Button("DEPTH"))
         app->mode = Mode::DEPTH;
-    ImGui::Checkbox("Use Normal Mapping", &app->useNormalMap);
-    ImGui::Checkbox("Use Relief Mapping", &app->useReliefMap);
+    // Both flags are baked in the object data
+    if (ImGui::Checkbox("Use Normal Mapping", &app->useNormalMap))
+        MarkObjectDataDirty(app);
+    if (ImGui::Checkbox("Use Relief Mapping", &app->useReliefMap))
+        MarkObjectDataDirty(app);
+    ImGui::Checkbox("Use Cone Step Mapping", &app->useConeStepMapping);
+    ImGui::Checkbox("Use Depth Prepass", &app->useDepthPrepass);
+    ImGui::Checkbox("Use Hi-Z Occlusion Culling", &app->useHiZCulling);
+    if (app->useHiZCulling && !app->useGpuDrivenCulling)
+        ImGui::BulletText("Culled: %u entities, %u lights, waited %.2f ms", app->hiZCulledEntities, app->hiZCulledLights, app->cullWaitMs);
+    ImGui::Checkbox("Use Software Occlusion Culling", &app->useSoftwareOcclusion);
+    if (app->useSoftwareOcclusion && !app->useGpuDrivenCulling)
+        ImGui::BulletText("Culled: %u entities, %u occluder triangles", app->softwareCulledEntities, app->occluderTriangles);
+    if (ImGui::Button("Test Software Occlusion"))
+        app->occlusionTestFailures = (i32)TestOcclusionBuffer();
+    if (app->occlusionTestFailures >= 0)
+    {
+        ImGui::SameLine();
+        if (app->occlusionTestFailures == 0)
+            ImGui::Text("Passed");
+        else
+            ImGui::Text("%d checks failed, see the log", app->occlusionTestFailures);
+    }
+    ImGui::Checkbox("Use Mesh LODs", &app->useLods);
+    if (app->useLods && !app->useGpuDrivenCulling)
+    {
+        ImGui::DragFloat("LOD Pixel Error", &app->lodPixelError, 0.05f, 0.1f, 16.0f);
+        ImGui::DragFloat("LOD Min Pixel Size", &app->lodMinPixelSize, 0.1f, 0.0f, 32.0f);
+        ImGui::BulletText("Culled: %u entities, %u triangles drawn", app->lodCulledEntities, app->lodTriangles);
+    }
+    if (ImGui::Checkbox("Use Packed Vertices", &app->usePackedVertices))
+    {
+        for (Mesh& mesh : app->meshes)
+            if (mesh.vertexFormat != VertexFormat::RAW)
+                UploadMeshVertices(mesh, app->usePackedVertices ? VertexFormat::PACKED : VertexFormat::FLOAT);
+        MarkObjectDataDirty(app);
+    }
+    {
+        u32 vertexBytes = 0u;
+        for (const Mesh& mesh : app->meshes)
+            if (mesh.vertexFormat != VertexFormat::RAW)
+                for (const Submesh& submesh : mesh.submeshes)
+                    vertexBytes += GetSubmeshVertexCount(submesh) * (submesh.gpuVertexBufferLayout.stride + submesh.positionStreamLayout.stride);
+        ImGui::BulletText("Vertex data: %.2f MB", vertexBytes / (1024.0f * 1024.0f));
+    }
+    if (ImGui::TreeNode("Mesh Optimization"))
+    {
+        for (u32 i = 0; i < app->meshes.size(); ++i)
+        {
+            const MeshOptimizationStats& stats = app->meshes[i].optimizationStats;
+            if (stats.acmrBefore > 0.0f)
+                ImGui::BulletText("Mesh %u: ACMR %.3f -> %.3f, overdraw %.3f -> %.3f", i, stats.acmrBefore, stats.acmrAfter, stats.overdrawBefore, stats.overdrawAfter);
+        }
+        ImGui::TreePop();
+    }
+    ImGui::Checkbox("Use Vertex Pulling", &app->useVertexPulling);
+    ImGui::Checkbox("Use Impostors", &app->useImpostors);
+    if (app->useImpostors && !app->useGpuDrivenCulling)
+    {
+        ImGui::DragFloat("Impostor Distance", &app->impostorDistance, 0.5f, 0.0f, 500.0f);
+        ImGui::BulletText("%u impostors drawn", (u32)app->impostorInstances.size());
+    }
+    ImGui::Checkbox("Use Meshlet Culling", &app->useMeshletCulling);
+    if (app->useMeshletCulling && !app->useGpuDrivenCulling)
+        ImGui::BulletText("Culled: %u of %u meshlet draws", app->meshletsCulled, app->meshletsTested);
+    ImGui::Checkbox("Use GPU-Driven Culling", &app->useGpuDrivenCulling);
+    if (app->useGpuDrivenCulling)
+        ImGui::BulletText("%u objects, %u indirect draws", (u32)app->entities.size(), (u32)app->indirectBatches.size());
+    ImGui::Separator();
+
+    ImGui::Text("Lighting:");
+    if (ImGui::Button("LIGHT VOLUMES"))
+        app->lightingTechnique = LightingTechnique::LIGHT_VOLUMES;
+    ImGui::SameLine();
+    if (ImGui::Button("INSTANCED VOLUMES"))
+        app->lightingTechnique = LightingTechnique::INSTANCED_VOLUMES;
+    ImGui::SameLine();
+    if (ImGui::Button("CLUSTERED"))
+        app->lightingTechnique = LightingTechnique::CLUSTERED;
+    if (app->lightingTechnique == LightingTechnique::CLUSTERED)
+        ImGui::BulletText("Light assignments: %u (%.2f per cluster)", app->clusterLightAssignments, (f32)app->clusterLightAssignments / CLUSTER_COUNT);
     ImGui::Separator();
 
     ImGui::Checkbox("Moving Lights", &app->movingLights);
@@ -720,7 +2114,11 @@ void Gui(App* app)
             if (ImGui::Button("Delete"))
             {
                 if (app->selectedEntity > -1)
+                {
                     app->entities.erase(app->entities.begin() + app->selectedEntity);
+                    RemoveTransform(app->entityTransforms, app->selectedEntity);
+                    app->gpuSceneDirty = true;
+                }
                 else
                     app->lights.erase(app->lights.begin() + app->selectedLight);
 
@@ -759,6 +2157,8 @@ void Gui(App* app)
                                     entity.modelIdx = app->sphereIdx;
                                 else if (std::string(items[i]) == "PATRICK")
                                     entity.modelIdx = app->patrickIdx;
+                                app->gpuSceneDirty = true;
+                                entity.dataDirty = true;
                             }
 
                             if (is_selected)
@@ -767,12 +2167,20 @@ void Gui(App* app)
                         ImGui::EndCombo();
                     }
 
-                    if (ImGui::DragFloat3("Position", (float*)&entity.position))
-                        entity.transform = Rotate(Scale(Translate(IDENTITY4, entity.position), entity.scale), (entity.rotation / 360.0f) * 2.0f * PI);
-                    if (ImGui::DragFloat3("Scale", (float*)&entity.scale))
-                        entity.transform = Rotate(Scale(Translate(IDENTITY4, entity.position), entity.scale), (entity.rotation / 360.0f) * 2.0f * PI);
-                    if (ImGui::DragFloat3("Rotation", (float*)&entity.rotation))
-                        entity.transform = Rotate(Scale(Translate(IDENTITY4, entity.position), entity.scale), (entity.rotation / 360.0f) * 2.0f * PI);
+                    // Edited as angles in degrees, stored as the quaternion
+                    glm::vec3 position, scale;
+                    glm::quat orientation;
+                    GetTransform(app->entityTransforms, app->selectedEntity, position, orientation, scale);
+                    glm::vec3 rotation = QuatToEulerDegrees(orientation);
+
+                    bool transformChanged = ImGui::DragFloat3("Position", (float*)&position);
+                    transformChanged |= ImGui::DragFloat3("Scale", (float*)&scale);
+                    bool rotationChanged = ImGui::DragFloat3("Rotation", (float*)&rotation);
+                    if (transformChanged || rotationChanged)
+                    {
+                        SetTransform(app->entityTransforms, app->selectedEntity, position, rotationChanged ? EulerDegreesToQuat(rotation) : orientation, scale);
+                        entity.transformDirty = true;
+                    }
                 }
                 else
                 {
@@ -798,22 +2206,28 @@ void Gui(App* app)
                     {
                     case Light::Type::DIRECTIONAL:
                     {
-                        ImGui::DragFloat3("Direction", (float*)&light.direction);
+                        light.dataDirty |= ImGui::DragFloat3("Direction", (float*)&light.direction);
                     }
                     break;
                     case Light::Type::POINT:
                     {
                         if (!app->movingLights)
                             if (ImGui::DragFloat3("Center##point", (float*)&light.center))
+                            {
                                 light.transform = Scale(Translate(IDENTITY4, light.center), glm::vec3(light.range));
+                                light.dataDirty = true;
+                            }
                         if (ImGui::DragFloat("Range", &light.range))
+                        {
                             light.transform = Scale(Translate(IDENTITY4, light.center), glm::vec3(light.range));
+                            light.dataDirty = true;
+                        }
                     }
                     break;
                     }
 
                     ImGui::Separator();
-                    ImGui::ColorPicker3("Color", (float*)(&light.color), ImGuiColorEditFlags_Float);
+                    light.dataDirty |= ImGui::ColorPicker3("Color", (float*)(&light.color), ImGuiColorEditFlags_Float);
                 }
             }
             ImGui::Separator();
@@ -824,6 +2238,8 @@ void Gui(App* app)
         if (ImGui::Button("Delete All Entities"))
         {
             app->entities.clear();
+            ClearTransforms(app->entityTransforms);
+            app->gpuSceneDirty = true;
             app->selectedEntity = -1;
         }
 
@@ -899,321 +2315,1035 @@ void Gui(App* app)
                 }
             ImGui::TreePop();
         }
-        ImGui::TreePop();
+        ImGui::TreePop();
+    }
+
+    ImGui::End();
+}
+
+EntityData GetEntityData(App* app, const Entity& entity)
+{
+    EntityData data = {};
+
+    // The mesh position transform dequantizes packed vertices, identity otherwise
+    data.world = entity.transform * app->meshes[app->models[entity.modelIdx].meshIdx].positionTransform;
+    data.hasNormalMapping = ModelHasNormalMapping(app, entity.modelIdx) ? 1u : 0u;
+    data.hasReliefMapping = ModelHasReliefMapping(app, entity.modelIdx) ? 1u : 0u;
+    return data;
+}
+
+LightData GetLightData(App* app, const Light& light)
+{
+    LightData data = {};
+    data.color = glm::vec4(light.color, 1.0f);
+
+    switch (light.type)
+    {
+    case Light::Type::DIRECTIONAL:
+        data.vector = glm::vec4(glm::normalize(light.direction), 0.0f);
+        break;
+    case Light::Type::POINT:
+        // The volume is the sphere mesh, whose vertices may be quantized
+        data.vector = glm::vec4(light.center, light.range);
+        data.world = light.transform * app->meshes[app->models[app->sphereIdx].meshIdx].positionTransform;
+        break;
+    }
+    return data;
+}
+
+/**
+ * Writes the dirty entities and lights to the next region of objectDataStaging, where every element
+ * sits at the same offset as in its array, and copies each run of consecutive dirty elements over
+ * with a single command.
+ */
+void UpdateObjectData(App* app)
+{
+    const u32 entityCount = app->entities.size();
+    const u32 lightCount = app->lights.size();
+    const u32 entityBytes = entityCount * sizeof(EntityData);
+    const u32 lightBytes = lightCount * sizeof(LightData);
+
+    // Elements follow the entity and light indices, so adding or removing any moves them all
+    if (entityCount + lightCount != app->objectDataCount)
+    {
+        glDeleteBuffers(1, &app->entityDataBuffer.handle);
+        glDeleteBuffers(1, &app->lightDataBuffer.handle);
+        glDeleteBuffers(1, &app->objectDataStaging.handle);
+        for (GLsync fence : app->objectDataStaging.regionFences)
+            if (fence)
+                glDeleteSync(fence);
+
+        app->entityDataBuffer = CreateBuffer(glm::max(entityBytes, (u32)sizeof(EntityData)), GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_DRAW);
+        app->lightDataBuffer = CreateBuffer(glm::max(lightBytes, (u32)sizeof(LightData)), GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_DRAW);
+        app->objectDataStaging = CreateRingBuffer(glm::max(entityBytes + lightBytes, 1u), GL_COPY_READ_BUFFER);
+        app->objectDataCount = entityCount + lightCount;
+        MarkObjectDataDirty(app);
+    }
+
+    std::vector<bool> entityDirty(entityCount);
+    std::vector<bool> lightDirty(lightCount);
+    for (u32 i = 0; i < entityCount; ++i)
+        entityDirty[i] = app->entities[i].dataDirty;
+    for (u32 i = 0; i < lightCount; ++i)
+        lightDirty[i] = app->lights[i].dataDirty;
+    std::vector<glm::uvec2> entityRuns = GetDirtyRuns(entityDirty);
+    std::vector<glm::uvec2> lightRuns = GetDirtyRuns(lightDirty);
+
+    app->objectDataUpdates = 0u;
+    if (entityRuns.empty() && lightRuns.empty())
+        return;
+
+    for (const glm::uvec2& run : entityRuns)
+        app->objectDataUpdates += run.y;
+    for (const glm::uvec2& run : lightRuns)
+        app->objectDataUpdates += run.y;
+
+    // Every element has its own slice of the mapped region, the jobs never write the same bytes
+    Buffer& staging = app->objectDataStaging;
+    MapNextRegion(staging);
+    u8* entitySlices = (u8*)staging.data;
+    u8* lightSlices = (u8*)staging.data + entityBytes;
+    ParallelFor(entityCount, UPDATE_GRAIN_SIZE, [app, entitySlices](u32 begin, u32 end)
+    {
+        for (u32 i = begin; i < end; ++i)
+        {
+            Entity& entity = app->entities[i];
+            if (!entity.dataDirty)
+                continue;
+            EntityData data = GetEntityData(app, entity);
+            memcpy(entitySlices + i * sizeof(EntityData), &data, sizeof(data));
+            entity.dataDirty = false;
+        }
+    });
+    ParallelFor(lightCount, UPDATE_GRAIN_SIZE, [app, lightSlices](u32 begin, u32 end)
+    {
+        for (u32 i = begin; i < end; ++i)
+        {
+            Light& light = app->lights[i];
+            if (!light.dataDirty)
+                continue;
+            LightData data = GetLightData(app, light);
+            memcpy(lightSlices + i * sizeof(LightData), &data, sizeof(data));
+            light.dataDirty = false;
+        }
+    });
+    UnmapBuffer(staging);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, staging.handle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, app->entityDataBuffer.handle);
+    for (const glm::uvec2& run : entityRuns)
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, staging.dataOffset + run.x * sizeof(EntityData), run.x * sizeof(EntityData), run.y * sizeof(EntityData));
+    glBindBuffer(GL_COPY_WRITE_BUFFER, app->lightDataBuffer.handle);
+    for (const glm::uvec2& run : lightRuns)
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, staging.dataOffset + entityBytes + run.x * sizeof(LightData), run.x * sizeof(LightData), run.y * sizeof(LightData));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    // The copies are the only readers of the region
+    FenceRegion(staging);
+}
+
+void UpdateEntityTransforms(App* app)
+{
+    ASSERT(app->entityTransforms.positionX.size() == app->entities.size(), "Entity transforms out of sync with the entities");
+
+    std::vector<bool> dirty(app->entities.size());
+    for (u32 i = 0; i < app->entities.size(); ++i)
+        dirty[i] = app->entities[i].transformDirty;
+
+    std::vector<glm::mat4> world;
+    for (const glm::uvec2& run : GetDirtyRuns(dirty))
+    {
+        world.resize(run.y);
+        ComposeTransforms(app->entityTransforms, run.x, run.x + run.y, world.data());
+        for (u32 i = 0; i < run.y; ++i)
+        {
+            Entity& entity = app->entities[run.x + i];
+            entity.transform = world[i];
+            entity.transformDirty = false;
+            entity.dataDirty = true;
+            entity.gpuObjectDirty = true;
+        }
+    }
+}
+
+void BenchmarkTransforms(App* app)
+{
+    // Drawn from fixed streams, so every run measures the same work
+    TransformArrays transforms;
+    std::vector<glm::vec3> positions(TRANSFORM_BENCHMARK_COUNT);
+    std::vector<glm::vec3> scales(TRANSFORM_BENCHMARK_COUNT);
+    std::vector<glm::vec3> rotations(TRANSFORM_BENCHMARK_COUNT);
+    for (u32 i = 0; i < TRANSFORM_BENCHMARK_COUNT; ++i)
+    {
+        positions[i] = glm::vec3(CounterRandom(i, 0u) % 100, CounterRandom(i, 1u) % 100, CounterRandom(i, 2u) % 100) - glm::vec3(50.0f);
+        scales[i] = glm::vec3(1.0f + (CounterRandom(i, 3u) % 4));
+        rotations[i] = glm::vec3(CounterRandom(i, 4u) % 360, CounterRandom(i, 5u) % 360, CounterRandom(i, 6u) % 360);
+        AddTransform(transforms, positions[i], EulerDegreesToQuat(rotations[i]), scales[i]);
+    }
+
+    glm::mat4 viewProjection = app->projection * app->view;
+    std::vector<glm::mat4> world(TRANSFORM_BENCHMARK_COUNT);
+    std::vector<glm::mat4> mvp(TRANSFORM_BENCHMARK_COUNT);
+
+    f32 glmMs = FLT_MAX;
+    f32 batchedMs = FLT_MAX;
+    for (u32 run = 0; run < TRANSFORM_BENCHMARK_RUNS; ++run)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (u32 i = 0; i < TRANSFORM_BENCHMARK_COUNT; ++i)
+        {
+            world[i] = Rotate(Scale(Translate(IDENTITY4, positions[i]), scales[i]), (rotations[i] / 360.0f) * 2.0f * PI);
+            mvp[i] = viewProjection * world[i];
+        }
+        auto middle = std::chrono::high_resolution_clock::now();
+        ComposeTransforms(transforms, 0u, TRANSFORM_BENCHMARK_COUNT, world.data());
+        MultiplyTransforms(viewProjection, world.data(), TRANSFORM_BENCHMARK_COUNT, mvp.data());
+        auto end = std::chrono::high_resolution_clock::now();
+
+        glmMs = glm::min(glmMs, std::chrono::duration<f32, std::milli>(middle - start).count());
+        batchedMs = glm::min(batchedMs, std::chrono::duration<f32, std::milli>(end - middle).count());
+    }
+
+    app->transformBenchmarkGlmMs = glmMs;
+    app->transformBenchmarkBatchedMs = batchedMs;
+    ILOG("Transform benchmark, %u matrices: glm %.3f ms, batched %.3f ms", TRANSFORM_BENCHMARK_COUNT, glmMs, batchedMs);
+}
+
+void Update(App* app)
+{
+    //Camera
+
+    if (!app->freeCam)
+    {
+        app->cameraPosition = app->camDist * glm::vec3(cos(app->alpha), app->camHeight, sin(app->alpha));
+
+        app->cameraDirection = glm::vec3(0) - app->cameraPosition;
+    }
+    else
+    {
+        glm::vec2 r = (app->cameraRotation / 360.0f) * 2.0f * PI;
+        app->cameraDirection = glm::normalize(glm::vec3(Rotate(IDENTITY4, glm::vec3(0, -r.x, r.y)) * glm::vec4(glm::vec3(1, 0, 0), 0.0)));
+
+        if (app->input.keys[K_W] == BUTTON_PRESSED)
+        {
+            if (app->input.keys[K_SPACE] == BUTTON_PRESSED)
+            {
+                app->cameraRotation.y += app->camTurnSpeed * app->deltaTime;
+
+                glm::vec2 r = (app->cameraRotation / 360.0f) * 2.0f * PI;
+                app->cameraDirection = glm::normalize(glm::vec3(Rotate(IDENTITY4, glm::vec3(0, -r.x, r.y)) * glm::vec4(glm::vec3(1, 0, 0), 0.0)));
+            }
+            else
+                app->cameraPosition += app->cameraDirection * app->camSpeed * app->deltaTime;
+        }
+        if (app->input.keys[K_S] == BUTTON_PRESSED)
+        {
+            if (app->input.keys[K_SPACE] == BUTTON_PRESSED)
+            {
+                app->cameraRotation.y -= app->camTurnSpeed * app->deltaTime;
+
+                glm::vec2 r = (app->cameraRotation / 360.0f) * 2.0f * PI;
+                app->cameraDirection = glm::normalize(glm::vec3(Rotate(IDENTITY4, glm::vec3(0, -r.x, r.y)) * glm::vec4(glm::vec3(1, 0, 0), 0.0)));
+            }
+            else
+                app->cameraPosition -= app->cameraDirection * app->camSpeed * app->deltaTime;
+        }
+        if (app->input.keys[K_A] == BUTTON_PRESSED)
+        {
+            app->cameraRotation.x -= app->camTurnSpeed * app->deltaTime;
+
+            glm::vec2 r = (app->cameraRotation / 360.0f) * 2.0f * PI;
+            app->cameraDirection = glm::normalize(glm::vec3(Rotate(IDENTITY4, glm::vec3(0, -r.x, r.y)) * glm::vec4(glm::vec3(1, 0, 0), 0.0)));
+        }
+        if (app->input.keys[K_D] == BUTTON_PRESSED)
+        {
+            app->cameraRotation.x += app->camTurnSpeed * app->deltaTime;
+
+            glm::vec2 r = (app->cameraRotation / 360.0f) * 2.0f * PI;
+            app->cameraDirection = glm::normalize(glm::vec3(Rotate(IDENTITY4, glm::vec3(0, -r.x, r.y)) * glm::vec4(glm::vec3(1, 0, 0), 0.0)));
+        }
+    }
+    app->view = glm::lookAt(app->cameraPosition, app->cameraPosition + glm::normalize(app->cameraDirection), glm::vec3(0, 1, 0));
+
+    // Every light draws the same numbers of its own stream each frame, so they can be animated in any order
+    if (app->movingLights)
+        ParallelFor(app->lights.size(), UPDATE_GRAIN_SIZE, [app](u32 begin, u32 end)
+        {
+            for (u32 i = begin; i < end; ++i)
+            {
+                Light& light = app->lights[i];
+                if (light.type == Light::Type::DIRECTIONAL)
+                    continue;
+                i32 direction = (CounterRandom(i, 0u) % 3) - 1;
+
+                if (direction != 0)
+                {
+                    u32 spinTime = (CounterRandom(i, 1u) % 50000) + 9000;
+                    f32 distance = glm::length(light.center);
+
+                    u32 milliseconds = (u32)(app->timeRunning * 1000.0f) + (CounterRandom(i, 2u) % 1000);
+                    float alpha = 2.0f * PI * ((float)(milliseconds % spinTime) / spinTime) * direction;
+
+                    light.center = distance * glm::vec3(cos(alpha), light.center.y, sin(alpha));
+                    light.transform = Scale(Translate(IDENTITY4, light.center), glm::vec3(light.range));
+                    light.dataDirty = true;
+                }
+            }
+        });
+
+    UpdateEntityTransforms(app);
+
+    ExtractFrustumPlanes(app->projection * app->view, app->frustumPlanes);
+
+    if (app->useGpuDrivenCulling)
+    {
+        if (app->gpuSceneDirty)
+            UpdateGpuScene(app);
+        else
+            UpdateGpuObjects(app);
+    }
+    else if (app->useSoftwareOcclusion)
+        SoftwareOcclusionCull(app);
+
+    // Set Uniform Buffer data
+    MapNextRegion(app->uniform);
+    
+    // Set Global Parameters at the start
+    app->globalsOffset = app->uniform.head;
+    PushVec3(app->uniform, app->cameraPosition);
+    PushVec3(app->uniform, glm::vec3(app->displaySize.x, app->displaySize.y, app->aspectRatio));
+    PushFloat(app->uniform, app->znear);
+    PushFloat(app->uniform, app->zfar);
+    PushMat4(app->uniform, app->projection * app->view);
+    PushMat4(app->uniform, glm::inverse(app->projection * app->view));
+    
+    app->globalsSize = app->uniform.head - app->globalsOffset;
+    
+    //ELOG("Max: %d , Head: %d", app->maxUniformBufferSize, app->uniform.head);
+    UnmapBuffer(app->uniform);
+
+    // Changed entities and lights, the GPU-driven path reads the entities from gpuObjectsBuffer instead
+    UpdateObjectData(app);
+
+    if (app->lightingTechnique == LightingTechnique::CLUSTERED)
+        AssignLightsToClusters(app);
+
+    if (app->useHiZCulling && !app->useGpuDrivenCulling)
+        UpdateCullBounds(app);
+}
+
+void DrawEntity(App* app, u32 entityIdx, const Program& program, bool bindMaterials)
+{
+    const Entity& entity = app->entities[entityIdx];
+    Model& model = app->models[entity.modelIdx];
+    Mesh& mesh = app->meshes[model.meshIdx];
+
+    SetProgram(app->glState, program.handle);
+
+    glUniform1ui(program.entityIdxLocation, entityIdx);
+
+    // Meshlets are tested in mesh space, where the cones were built
+    glm::vec3 localCameraPosition = glm::vec3(glm::inverse(entity.transform) * glm::vec4(app->cameraPosition, 1.0f));
+    const bool mirrored = glm::determinant(glm::mat3(entity.transform)) < 0.0f;
+    f32 maxScale = glm::max(glm::length(glm::vec3(entity.transform[0])), glm::max(glm::length(glm::vec3(entity.transform[1])), glm::length(glm::vec3(entity.transform[2]))));
+
+    // Every submesh reads the same buffers, only the format descriptor changes
+    const bool pullVertices = program.vertexLayoutLocation != -1;
+    if (pullVertices)
+    {
+        SetVertexArray(app->glState, app->vertexPullingVao);
+        SetElementArrayBuffer(app->glState, mesh.indexBufferHandle);
+        SetStorageBuffer(app->glState, BINDING(4), mesh.vertexBufferHandle);
+    }
+
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    {
+        Submesh& submesh = mesh.submeshes[i];
+        if (pullVertices)
+            SetVertexPullingFormat(program, mesh, submesh);
+        else
+            BindSubmeshVertices(app, mesh, i, program);
+
+        if (bindMaterials)
+            BindSubmeshMaterial(app, model, i);
+
+        if (app->useLods && entity.lodLevel > 0u && !submesh.lods.empty())
+        {
+            // Simplified levels are small enough to be drawn whole
+            const SubmeshLod& lod = submesh.lods[glm::min(entity.lodLevel, (u32)submesh.lods.size()) - 1u];
+            glDrawElements(GL_TRIANGLES, lod.indexCount, submesh.indexType, (void*)(u64)(submesh.indexOffset + (submesh.indices.size() + lod.firstIndex) * GetIndexSize(submesh)));
+            continue;
+        }
+
+        if (!app->useMeshletCulling || submesh.meshlets.empty())
+        {
+            glDrawElements(GL_TRIANGLES, submesh.indices.size(), submesh.indexType, (void*)(u64)submesh.indexOffset);
+            continue;
+        }
+
+        // Visible meshlets next to each other are merged into a single range
+        std::vector<GLsizei>& counts = app->meshletDrawCounts;
+        std::vector<const void*>& offsets = app->meshletDrawOffsets;
+        counts.clear();
+        offsets.clear();
+        u32 rangeEnd = UINT32_MAX;
+        for (const Meshlet& meshlet : submesh.meshlets)
+        {
+            ++app->meshletsTested;
+            glm::vec3 center = glm::vec3(entity.transform * glm::vec4(meshlet.center, 1.0f));
+            if (IsMeshletBackFacing(meshlet, localCameraPosition, mirrored) || !IsSphereInFrustum(app->frustumPlanes, center, meshlet.radius * maxScale))
+            {
+                ++app->meshletsCulled;
+                continue;
+            }
+
+            if (meshlet.firstIndex == rangeEnd)
+                counts.back() += meshlet.triangleCount * 3u;
+            else
+            {
+                counts.push_back(meshlet.triangleCount * 3u);
+                offsets.push_back((void*)(u64)(submesh.indexOffset + meshlet.firstIndex * GetIndexSize(submesh)));
+            }
+            rangeEnd = meshlet.firstIndex + meshlet.triangleCount * 3u;
+        }
+
+        if (!counts.empty())
+            glMultiDrawElements(GL_TRIANGLES, counts.data(), submesh.indexType, offsets.data(), counts.size());
+    }
+}
+
+void RenderGeometry(App* app, const std::vector<u32>& entityIdxs)
+{
+    if (app->useDepthPrepass)
+    {
+        // Depth only pass, relief mapped entities are left out as they can discard fragments
+        Program& prepassProgram = app->programs[app->useVertexPulling ? app->depthPrepassPullingProgramIdx : app->depthPrepassProgramIdx];
+        SetProgram(app->glState, prepassProgram.handle);
+        SetColorMask(app->glState, false);
+
+        for (u32 e : entityIdxs)
+            if (!ModelHasReliefMapping(app, app->entities[e].modelIdx))
+                DrawEntity(app, e, prepassProgram, false);
+
+        SetColorMask(app->glState, true);
+
+        // Only the visible fragments pass the equal test, so the shading runs once per pixel
+        SetDepthFunc(app->glState, GL_EQUAL);
+        SetDepthMask(app->glState, false);
+
+        for (u32 e : entityIdxs)
+        {
+            Entity& entity = app->entities[e];
+            if (ModelHasReliefMapping(app, entity.modelIdx))
+                continue;
+
+            DrawEntity(app, e, app->programs[GetGeometryProgramIdx(app, entity, true)], true);
+        }
+
+        SetDepthMask(app->glState, true);
+        SetDepthFunc(app->glState, GL_LESS);
+
+        // Relief mapped entities are still rejected early against the prepass depth
+        for (u32 e : entityIdxs)
+            if (ModelHasReliefMapping(app, app->entities[e].modelIdx))
+                DrawEntity(app, e, app->programs[GetGeometryProgramIdx(app, app->entities[e], false)], true);
+    }
+    else
+    {
+        for (u32 e : entityIdxs)
+            DrawEntity(app, e, app->programs[GetGeometryProgramIdx(app, app->entities[e], false)], true);
     }
+}
 
-    ImGui::End();
+void DrawIndirectBatch(App* app, u32 batchIdx, const Program& program, bool bindMaterials)
+{
+    const IndirectBatch& batch = app->indirectBatches[batchIdx];
+    Model& model = app->models[batch.modelIdx];
+    Mesh& mesh = app->meshes[model.meshIdx];
+
+    SetProgram(app->glState, program.handle);
+
+    if (bindMaterials)
+        BindSubmeshMaterial(app, model, batch.submeshIdx);
+
+    BindSubmeshVertices(app, mesh, batch.submeshIdx, program, app->drawInstancesBuffer.handle);
+
+    // Commands with no visible instance are skipped by the GPU
+    glDrawElementsIndirect(GL_TRIANGLES, mesh.submeshes[batch.submeshIdx].indexType, (void*)(u64)(batchIdx * sizeof(DrawElementsIndirectCommand)));
 }
 
-void Update(App* app)
+// RenderGeometry for the GPU-driven path, every model submesh is one command whatever its entity count
+void RenderGeometryIndirect(App* app)
 {
-    //Camera
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, app->drawCommandsBuffer.handle);
+    SetStorageBuffer(app->glState, BINDING(0), app->gpuObjectsBuffer.handle);
 
-    if (!app->freeCam)
+    if (app->useDepthPrepass)
     {
-        app->cameraPosition = app->camDist * glm::vec3(cos(app->alpha), app->camHeight, sin(app->alpha));
+        Program& prepassProgram = app->programs[app->depthPrepassIndirectProgramIdx];
+        SetColorMask(app->glState, false);
 
-        app->cameraDirection = glm::vec3(0) - app->cameraPosition;
+        for (u32 b = 0; b < app->indirectBatches.size(); ++b)
+            if (!ModelHasReliefMapping(app, app->indirectBatches[b].modelIdx))
+                DrawIndirectBatch(app, b, prepassProgram, false);
+
+        SetColorMask(app->glState, true);
+
+        SetDepthFunc(app->glState, GL_EQUAL);
+        SetDepthMask(app->glState, false);
+
+        for (u32 b = 0; b < app->indirectBatches.size(); ++b)
+            if (!ModelHasReliefMapping(app, app->indirectBatches[b].modelIdx))
+                DrawIndirectBatch(app, b, app->programs[GetIndirectProgramIdx(app, app->indirectBatches[b].modelIdx, true)], true);
+
+        SetDepthMask(app->glState, true);
+        SetDepthFunc(app->glState, GL_LESS);
+
+        for (u32 b = 0; b < app->indirectBatches.size(); ++b)
+            if (ModelHasReliefMapping(app, app->indirectBatches[b].modelIdx))
+                DrawIndirectBatch(app, b, app->programs[GetIndirectProgramIdx(app, app->indirectBatches[b].modelIdx, false)], true);
     }
     else
     {
-        glm::vec2 r = (app->cameraRotation / 360.0f) * 2.0f * PI;
-        app->cameraDirection = glm::normalize(glm::vec3(Rotate(IDENTITY4, glm::vec3(0, -r.x, r.y)) * glm::vec4(glm::vec3(1, 0, 0), 0.0)));
+        for (u32 b = 0; b < app->indirectBatches.size(); ++b)
+            DrawIndirectBatch(app, b, app->programs[GetIndirectProgramIdx(app, app->indirectBatches[b].modelIdx, false)], true);
+    }
 
-        if (app->input.keys[K_W] == BUTTON_PRESSED)
-        {
-            if (app->input.keys[K_SPACE] == BUTTON_PRESSED)
-            {
-                app->cameraRotation.y += app->camTurnSpeed * app->deltaTime;
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
 
-                glm::vec2 r = (app->cameraRotation / 360.0f) * 2.0f * PI;
-                app->cameraDirection = glm::normalize(glm::vec3(Rotate(IDENTITY4, glm::vec3(0, -r.x, r.y)) * glm::vec4(glm::vec3(1, 0, 0), 0.0)));
-            }
-            else
-                app->cameraPosition += app->cameraDirection * app->camSpeed * app->deltaTime;
-        }
-        if (app->input.keys[K_S] == BUTTON_PRESSED)
-        {
-            if (app->input.keys[K_SPACE] == BUTTON_PRESSED)
-            {
-                app->cameraRotation.y -= app->camTurnSpeed * app->deltaTime;
+void BuildHiZPyramid(App* app)
+{
+    Program& program = app->programs[app->hiZDownsampleProgramIdx];
+    SetProgram(app->glState, program.handle);
 
-                glm::vec2 r = (app->cameraRotation / 360.0f) * 2.0f * PI;
-                app->cameraDirection = glm::normalize(glm::vec3(Rotate(IDENTITY4, glm::vec3(0, -r.x, r.y)) * glm::vec4(glm::vec3(1, 0, 0), 0.0)));
-            }
-            else
-                app->cameraPosition -= app->cameraDirection * app->camSpeed * app->deltaTime;
-        }
-        if (app->input.keys[K_A] == BUTTON_PRESSED)
-        {
-            app->cameraRotation.x -= app->camTurnSpeed * app->deltaTime;
+    // Each level keeps the farthest depth of the texels it covers in the previous one
+    for (u32 level = 0u; level < app->hiZLevels; ++level)
+    {
+        glm::ivec2 size = glm::max(app->hiZSize >> (i32)level, glm::ivec2(1));
 
-            glm::vec2 r = (app->cameraRotation / 360.0f) * 2.0f * PI;
-            app->cameraDirection = glm::normalize(glm::vec3(Rotate(IDENTITY4, glm::vec3(0, -r.x, r.y)) * glm::vec4(glm::vec3(1, 0, 0), 0.0)));
+        if (level == 0u)
+        {
+            SetTexture(app->glState, 0, GetFrameGraphTexture(app->frameGraph, app->depthTarget));
+            glUniform1i(app->hiZSourceLevelLocation, 0);
+            glUniform2i(app->hiZSourceSizeLocation, app->displaySize.x, app->displaySize.y);
         }
-        if (app->input.keys[K_D] == BUTTON_PRESSED)
+        else
         {
-            app->cameraRotation.x += app->camTurnSpeed * app->deltaTime;
-
-            glm::vec2 r = (app->cameraRotation / 360.0f) * 2.0f * PI;
-            app->cameraDirection = glm::normalize(glm::vec3(Rotate(IDENTITY4, glm::vec3(0, -r.x, r.y)) * glm::vec4(glm::vec3(1, 0, 0), 0.0)));
+            glm::ivec2 sourceSize = glm::max(app->hiZSize >> (i32)(level - 1u), glm::ivec2(1));
+            SetTexture(app->glState, 0, app->hiZHandle);
+            glUniform1i(app->hiZSourceLevelLocation, level - 1u);
+            glUniform2i(app->hiZSourceSizeLocation, sourceSize.x, sourceSize.y);
         }
+
+        glBindImageTexture(0, app->hiZHandle, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glDispatchCompute((size.x + 7) / 8, (size.y + 7) / 8, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
     }
-    app->view = glm::lookAt(app->cameraPosition, app->cameraPosition + glm::normalize(app->cameraDirection), glm::vec3(0, 1, 0));
+}
 
-    if (app->movingLights)
-        for (u32 i = 0u; i < app->lights.size(); ++i)
-        {
-            srand(i);
-            Light& light = app->lights[i];
-            if (light.type == Light::Type::DIRECTIONAL)
-                continue;
-            i32 direction =  (rand() % 3) - 1;
+// Tests every entity and light against the pyramid and queues the result for ReadCullVisibility
+void CullAgainstHiZ(App* app)
+{
+    // Culling may have been enabled after this frame's Update
+    if (app->cullBounds.size() != app->entities.size() + app->lights.size())
+        UpdateCullBounds(app);
 
-            if (direction != 0)
-            {
-                u32 spinTime = (rand() % 50000) + 9000;
-                f32 distance = glm::length(light.center);
+    u32 objectCount = app->cullBounds.size();
+    if (objectCount == 0u)
+        return;
 
-                u32 milliseconds = (u32)(app->timeRunning * 1000.0f) + (rand() % 1000);
-                float alpha = 2.0f * PI * ((float)(milliseconds % spinTime) / spinTime) * direction;
+    UploadBufferData(app->cullBoundsBuffer, app->cullBounds.data(), objectCount * sizeof(CullBounds));
 
-                app->lights[i].center = distance * glm::vec3(cos(alpha), light.center.y, sin(alpha));
-                app->lights[i].transform = Scale(Translate(IDENTITY4, app->lights[i].center), glm::vec3(app->lights[i].range));
-            }
-        }
+    // Every element is written by the shader, the storage only has to be big enough
+    if (app->cullVisibilityBuffer.size < objectCount * sizeof(u32))
+    {
+        app->cullVisibilityBuffer.size = objectCount * sizeof(u32);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, app->cullVisibilityBuffer.handle);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, app->cullVisibilityBuffer.size, NULL, app->cullVisibilityBuffer.usage);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
 
-    // Set Uniform Buffer data
-    MapBuffer(app->uniform, GL_WRITE_ONLY);
-    
-    // Set Global Parameters at the start
-    PushVec3(app->uniform, app->cameraPosition);
-    PushVec3(app->uniform, glm::vec3(app->displaySize.x, app->displaySize.y, app->aspectRatio));
-    PushFloat(app->uniform, app->znear);
-    PushFloat(app->uniform, app->zfar);
-    
-    app->globalsSize = app->uniform.head;
-    
-    // Set Entities data
-    for (u32 i = 0; i < app->entities.size(); ++i)
+    Buffer& readback = app->cullReadback;
+    if (readback.regionSize < objectCount * sizeof(u32))
     {
-        AlignHead(app->uniform, app->uniformBlockAlignment);
-    
-        Entity& entity = app->entities[i];
+        glDeleteBuffers(1, &readback.handle);
+        for (GLsync fence : readback.regionFences)
+            if (fence)
+                glDeleteSync(fence);
+        readback = CreateReadbackRing(objectCount * sizeof(u32));
+    }
+
+    Program& program = app->programs[app->hiZCullProgramIdx];
+    SetProgram(app->glState, program.handle);
+    glUniform1ui(app->hiZObjectCountLocation, objectCount);
+
+    SetTexture(app->glState, 0, app->hiZHandle);
+    SetStorageBuffer(app->glState, BINDING(0), app->cullBoundsBuffer.handle);
+    SetStorageBuffer(app->glState, BINDING(1), app->cullVisibilityBuffer.handle);
+
+    glDispatchCompute((objectCount + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    readback.regionIdx = (readback.regionIdx + 1) % BUFFER_RING_REGIONS;
+    GLsync& fence = readback.regionFences[readback.regionIdx];
+    if (fence)
+        glDeleteSync(fence);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, app->cullVisibilityBuffer.handle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, readback.handle);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, readback.regionIdx * readback.regionSize, objectCount * sizeof(u32));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Waits for the cull CullAgainstHiZ just queued, the second phase can't be submitted without knowing its
+// entities. Everything is visible when nothing was culled.
+void ReadCullVisibility(App* app)
+{
+    u32 objectCount = app->entities.size() + app->lights.size();
+    app->cullVisibility.assign(objectCount, 1u);
+    app->cullWaitMs = 0.0f;
+
+    Buffer& readback = app->cullReadback;
+    GLsync& fence = readback.regionFences[readback.regionIdx];
+    if (objectCount == 0u || !fence)
+        return;
+
+    // Only the work queued up to the copy is waited for, the flush makes sure it reaches the GPU
+    auto start = std::chrono::high_resolution_clock::now();
+    GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    app->cullWaitMs = std::chrono::duration<f32, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    glDeleteSync(fence);
+    fence = 0;
+    if (result == GL_WAIT_FAILED)
+        return;
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, readback.handle);
+    const void* data = glMapBufferRange(GL_COPY_WRITE_BUFFER, readback.regionIdx * readback.regionSize, objectCount * sizeof(u32), GL_MAP_READ_BIT);
+    memcpy(app->cullVisibility.data(), data, objectCount * sizeof(u32));
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+// Fills the indirect commands with the entities that pass the given phase, nothing is read back
+void CullOnGpu(App* app, CullPhase phase)
+{
+    u32 objectCount = app->entities.size();
+
+    // Instance counts back to zero, the shader appends to them
+    UploadBufferData(app->drawCommandsBuffer, app->indirectCommands.data(), app->indirectCommands.size() * sizeof(DrawElementsIndirectCommand));
+    if (objectCount == 0u)
+        return;
+
+    Program& program = app->programs[app->gpuCullProgramIdx];
+    SetProgram(app->glState, program.handle);
+    glUniform1ui(app->gpuCullObjectCountLocation, objectCount);
+    glUniform1ui(app->gpuCullPhaseLocation, (u32)phase);
+
+    SetTexture(app->glState, 0, app->hiZHandle);
+    SetStorageBuffer(app->glState, BINDING(0), app->gpuObjectsBuffer.handle);
+    SetStorageBuffer(app->glState, BINDING(1), app->drawCommandsBuffer.handle);
+    SetStorageBuffer(app->glState, BINDING(2), app->drawInstancesBuffer.handle);
+    SetStorageBuffer(app->glState, BINDING(3), app->objectVisibilityBuffer.handle);
+
+    glDispatchCompute((objectCount + 63) / 64, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void RenderImpostors(App* app)
+{
+    Program& program = app->programs[app->impostorProgramIdx];
+    SetProgram(app->glState, program.handle);
+    glUniform1ui(app->impostorFramesLocation, IMPOSTOR_FRAMES);
+    SetStorageBuffer(app->glState, BINDING(0), app->impostorInstancesBuffer.handle);
+
+    Mesh& mesh = app->meshes[app->models[app->screenIdx].meshIdx];
+    Submesh& submesh = mesh.submeshes[0];
+    BindSubmeshVertices(app, mesh, 0, program);
+
+    u32 instanceOffset = 0u;
+    for (u32 i = 0; i < app->impostors.size(); ++i)
+    {
+        u32 instanceCount = app->impostorInstanceCounts[i];
+        if (instanceCount == 0u)
+            continue;
+
+        const Impostor& impostor = app->impostors[i];
+        glUniform1ui(app->impostorInstanceOffsetLocation, instanceOffset);
+        glUniform4f(app->impostorSphereLocation, impostor.center.x, impostor.center.y, impostor.center.z, impostor.radius);
+
+        SetTexture(app->glState, 0, app->textures[impostor.albedoTextureIdx].handle);
+        SetTexture(app->glState, 1, app->textures[impostor.normalDepthTextureIdx].handle);
+
+        glDrawElementsInstanced(GL_TRIANGLES, submesh.indices.size(), submesh.indexType, (void*)(u64)submesh.indexOffset, instanceCount);
+        instanceOffset += instanceCount;
+    }
+}
+
+void ExecuteGeometryPass(App* app)
+{
+    SetCapability(app->glState, GL_CAPABILITY_DEPTH_TEST, true);
+    SetCapability(app->glState, GL_CAPABILITY_CULL_FACE, true);
+    SetDepthMask(app->glState, true);
+
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClearStencil(0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+    // The G-Buffer is written, never blended: the encoded normals have no alpha and impostors discard by coverage
+    SetCapability(app->glState, GL_CAPABILITY_BLEND, false);
+
+    app->meshletsTested = 0u;
+    app->meshletsCulled = 0u;
+
+    if (app->useLods && !app->useGpuDrivenCulling)
+        SelectEntityLods(app);
+    if (app->useImpostors && !app->useGpuDrivenCulling)
+        SelectImpostors(app);
     
-        entity.uniformOffset = app->uniform.head;
-        PushMat4(app->uniform, entity.transform);
-        PushMat4(app->uniform, app->projection * app->view * entity.transform);
-
-        u32 hasNormalMapping = 0u;
-        if (app->useNormalMap)
-            for (u32 m = 0u; m < app->models[entity.modelIdx].materialIdx.size(); ++m)
-                if (app->materials[app->models[entity.modelIdx].materialIdx[m]].normalsTextureIdx > 0)
-                {
-                    hasNormalMapping = 1u;
-                    break;
-                }
-        PushUInt(app->uniform, hasNormalMapping);
+    if (app->useGpuDrivenCulling)
+    {
+        // Same two phases as below, with the visibility kept on the GPU
+        if (app->useHiZCulling)
+        {
+            CullOnGpu(app, CullPhase::FIRST);
+            RenderGeometryIndirect(app);
 
-        u32 hasReliefMapping = 0u;
-        if (app->useReliefMap)
-            for (u32 m = 0u; m < app->models[entity.modelIdx].materialIdx.size(); ++m)
-                if (app->materials[app->models[entity.modelIdx].materialIdx[m]].bumpTextureIdx > 0)
-                {
-                    hasReliefMapping = 1u;
-                    break;
-                }
-        PushUInt(app->uniform, hasReliefMapping);
-        entity.uniformSize = app->uniform.head - entity.uniformOffset;
+            BuildHiZPyramid(app);
+
+            CullOnGpu(app, CullPhase::SECOND);
+            RenderGeometryIndirect(app);
+        }
+        else
+        {
+            CullOnGpu(app, CullPhase::FRUSTUM);
+            RenderGeometryIndirect(app);
+        }
     }
+    else if (app->useHiZCulling)
+    {
+        // Two phases: the entities visible last frame are drawn first and build the pyramid everything
+        // is tested against, then the ones uncovered this frame are drawn without a frame of delay.
+        // The CPU waits for the cull in between, the GPU-driven path does the same without a readback.
+        if (app->entityVisibility.size() != app->entities.size())
+            app->entityVisibility.assign(app->entities.size(), 1u);
+
+        std::vector<u32> drawList;
+        for (u32 e = 0; e < app->entities.size(); ++e)
+            if (app->entityVisibility[e] != 0u && IsEntityDrawnAsMesh(app, e))
+                drawList.push_back(e);
+        RenderGeometry(app, drawList);
+
+        BuildHiZPyramid(app);
+        CullAgainstHiZ(app);
+        ReadCullVisibility(app);
+
+        drawList.clear();
+        app->hiZCulledEntities = 0u;
+        for (u32 e = 0; e < app->entities.size(); ++e)
+        {
+            if (app->cullVisibility[e] != 0u && app->entityVisibility[e] == 0u && IsEntityDrawnAsMesh(app, e))
+                drawList.push_back(e);
+            if (app->cullVisibility[e] == 0u)
+                ++app->hiZCulledEntities;
+            app->entityVisibility[e] = app->cullVisibility[e];
+        }
+        RenderGeometry(app, drawList);
 
-    // Set Lights data
-    for (u32 i = 0; i < app->lights.size(); ++i)
+        app->hiZCulledLights = 0u;
+        for (u32 i = 0; i < app->lights.size(); ++i)
+            if (!IsLightVisible(app, i))
+                ++app->hiZCulledLights;
+    }
+    else
     {
-        AlignHead(app->uniform, app->uniformBlockAlignment);
+        std::vector<u32> drawList;
+        for (u32 e = 0; e < app->entities.size(); ++e)
+            if (IsEntityDrawnAsMesh(app, e))
+                drawList.push_back(e);
+        RenderGeometry(app, drawList);
+    }
+
+    if (app->useImpostors && !app->useGpuDrivenCulling)
+        RenderImpostors(app);
+}
+
+// The light volumes are depth and stencil tested against a copy of the G-Buffer depth, so the original can be sampled to rebuild the positions
+void ExecuteLightDepthCopyPass(App* app)
+{
+    GLuint depthHandle = GetFrameGraphTexture(app->frameGraph, app->depthTarget);
+    GLuint lightingDepthHandle = GetFrameGraphTexture(app->frameGraph, app->lightingDepthTarget);
+    glCopyImageSubData(depthHandle, GL_TEXTURE_2D, 0, 0, 0, 0, lightingDepthHandle, GL_TEXTURE_2D, 0, 0, 0, 0, app->displaySize.x, app->displaySize.y, 1);
+}
+
+// Lights are accumulated in their own target
+void ExecuteLightingPass(App* app)
+{
+    SetCapability(app->glState, GL_CAPABILITY_DEPTH_TEST, false);
+    SetCapability(app->glState, GL_CAPABILITY_CULL_FACE, false);
+    SetDepthMask(app->glState, false);
+
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    // Every light adds to the target
+    SetCapability(app->glState, GL_CAPABILITY_BLEND, true);
+    SetBlendFunc(app->glState, GL_SRC_ALPHA, GL_ONE);
 
+    for (u32 i = 0; i < app->lights.size(); ++i)
+    {
         Light& light = app->lights[i];
+        if (app->lightingTechnique != LightingTechnique::LIGHT_VOLUMES && light.type == Light::Type::POINT)
+            continue;
+        if (!IsLightVisible(app, i))
+            continue;
 
-        light.uniformOffset = app->uniform.head;
-        PushVec3(app->uniform, light.color);
-        
+        u32 modelIdx = 0;
         switch (light.type)
         {
         case Light::Type::DIRECTIONAL:
-            PushVec3(app->uniform, glm::normalize(light.direction));
+            modelIdx = app->screenIdx;
             break;
         case Light::Type::POINT:
-            PushVec3(app->uniform, light.center);
-            PushFloat(app->uniform, light.range);
-            PushMat4(app->uniform, light.transform);
-            PushMat4(app->uniform, app->projection * app->view * light.transform);
+            modelIdx = app->sphereIdx;
             break;
         }
 
-        light.uniformSize = app->uniform.head - light.uniformOffset;
-    }
-    //ELOG("Max: %d , Head: %d", app->maxUniformBufferSize, app->uniform.head);
-    UnmapBuffer(app->uniform);
-}
+        Mesh& mesh = app->meshes[app->models[modelIdx].meshIdx];
+        Submesh& submesh = mesh.submeshes[0];
 
-void Render(App* app)
-{
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_CULL_FACE);
+        if (light.type == Light::Type::POINT)
+        {
+            // Stencil pass: mark the pixels whose geometry lies inside the light volume.
+            // Back faces behind the geometry increment and front faces behind it decrement,
+            // so only the pixels between both faces end up with a non zero value.
+            Program& stencilProgram = app->programs[app->lightStencilProgramIdx];
+            SetProgram(app->glState, stencilProgram.handle);
+            glUniform1ui(stencilProgram.lightIdxLocation, i);
+            BindSubmeshVertices(app, mesh, 0, stencilProgram);
+
+            SetCapability(app->glState, GL_CAPABILITY_STENCIL_TEST, true);
+            SetCapability(app->glState, GL_CAPABILITY_DEPTH_TEST, true);
+            SetDepthFunc(app->glState, GL_LESS);
+            SetColorMask(app->glState, false);
+
+            SetStencilFunc(app->glState, GL_ALWAYS, 0, 0);
+            SetStencilOp(app->glState, GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+            SetStencilOp(app->glState, GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+
+            glDrawElements(GL_TRIANGLES, submesh.indices.size(), submesh.indexType, (void*)(u64)submesh.indexOffset);
+
+            // Light pass: shade the marked pixels only, clearing the mark for the next light.
+            // Back faces are drawn so the volume still covers the screen with the camera inside.
+            SetColorMask(app->glState, true);
+            SetCapability(app->glState, GL_CAPABILITY_DEPTH_TEST, false);
+            SetCapability(app->glState, GL_CAPABILITY_CULL_FACE, true);
+            SetCullFace(app->glState, GL_FRONT);
+
+            SetStencilFunc(app->glState, GL_NOTEQUAL, 0, 0xFF);
+            SetStencilOp(app->glState, GL_FRONT_AND_BACK, GL_KEEP, GL_KEEP, GL_ZERO);
+        }
 
-    // Pass global parameters data to shader
-    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->uniform.handle, 0, app->globalsSize);
+        Program& program = app->programs[light.programIdx];
+        SetProgram(app->glState, program.handle);
+        glUniform1ui(program.lightIdxLocation, i);
 
-    // Geometry Pass
-    glBindFramebuffer(GL_FRAMEBUFFER, app->frameBufferHandle);
-    
-    // Set up render
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    
-    glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+        BindSubmeshVertices(app, mesh, 0, program);
 
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    
-    // Loop through entites and render
-    for (u32 e = 0; e < app->entities.size(); ++e)
+        BindGBufferTextures(app);
+
+        glDrawElements(GL_TRIANGLES, submesh.indices.size(), submesh.indexType, (void*)(u64)submesh.indexOffset);
+
+        if (light.type == Light::Type::POINT)
+        {
+            SetCapability(app->glState, GL_CAPABILITY_STENCIL_TEST, false);
+            SetCapability(app->glState, GL_CAPABILITY_CULL_FACE, false);
+            SetCullFace(app->glState, GL_BACK);
+        }
+    }
+
+    // All the point lights are drawn with one instanced draw per proxy detail level.
+    // Back faces behind the geometry mark the pixels that can be inside each volume.
+    if (app->lightingTechnique == LightingTechnique::INSTANCED_VOLUMES)
     {
-        Entity& entity = app->entities[e];
-    
-        Model& model = app->models[entity.modelIdx];
-    
-        Program& program = app->programs[entity.programIdx];
-        glUseProgram(program.handle);
+        // Built here as the occlusion results of this frame are only known after the geometry pass
+        BuildInstancedLightList(app);
 
-        glUniform1i(program.albedoLocation, 0);
-        glUniform1i(program.normalsLocation, 1);
-        glUniform1i(program.depthLocation, 2);
-    
-        Mesh& mesh = app->meshes[model.meshIdx];
-    
-        // Pass local parameters data to shader
-        glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->uniform.handle, entity.uniformOffset, entity.uniformSize);
-    
-        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+        Program& program = app->programs[app->pointInstancedProgramIdx];
+        SetProgram(app->glState, program.handle);
+
+        SetStorageBuffer(app->glState, BINDING(0), app->pointLightsBuffer.handle);
+
+        BindGBufferTextures(app);
+
+        SetCapability(app->glState, GL_CAPABILITY_DEPTH_TEST, true);
+        SetDepthFunc(app->glState, GL_GEQUAL);
+        SetCapability(app->glState, GL_CAPABILITY_CULL_FACE, true);
+        SetCullFace(app->glState, GL_FRONT);
+
+        u32 lightOffset = 0u;
+        for (u32 lod = 0u; lod < ICOSPHERE_LODS; ++lod)
         {
-            GLuint vao = FindVAO(mesh, i, program);
-            glBindVertexArray(vao);
-    
-            GLuint albedoHandle = app->textures[app->defaultTextureIdx].handle;
-            GLuint normalHandle = 0u;
-            GLuint reliefHandle = 0u;
-            if (model.materialIdx.size() > 0u)
+            if (app->pointLightInstanceCounts[lod] > 0u)
             {
-                u32 submeshMaterialIdx = model.materialIdx[i];
-                Material& submeshMaterial = app->materials[submeshMaterialIdx];
-                albedoHandle = app->textures[submeshMaterial.albedoTextureIdx].handle;
-                normalHandle = app->textures[submeshMaterial.normalsTextureIdx].handle;
-                reliefHandle = app->textures[submeshMaterial.bumpTextureIdx].handle;
+                Mesh& mesh = app->meshes[app->models[app->icosphereIdx[lod]].meshIdx];
+                BindSubmeshVertices(app, mesh, 0, program);
+
+                glUniform1ui(app->pointInstancedLightOffsetLocation, lightOffset);
+
+                Submesh& submesh = mesh.submeshes[0];
+                glDrawElementsInstanced(GL_TRIANGLES, submesh.indices.size(), submesh.indexType, (void*)(u64)submesh.indexOffset, app->pointLightInstanceCounts[lod]);
             }
-    
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, albedoHandle);
-            glActiveTexture(GL_TEXTURE0 + 1);
-            glBindTexture(GL_TEXTURE_2D, normalHandle);
-            glActiveTexture(GL_TEXTURE0 + 2);
-            glBindTexture(GL_TEXTURE_2D, reliefHandle);
-
-            Submesh& submesh = mesh.submeshes[i];
-            glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
+            lightOffset += app->pointLightInstanceCounts[lod];
         }
+
+        SetCullFace(app->glState, GL_BACK);
+        SetCapability(app->glState, GL_CAPABILITY_CULL_FACE, false);
+        SetDepthFunc(app->glState, GL_LESS);
+        SetCapability(app->glState, GL_CAPABILITY_DEPTH_TEST, false);
     }
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-    // Lighting Pass
-    glDisable(GL_DEPTH_TEST);
-    glDisable(GL_CULL_FACE);
+    // All the point lights are shaded in a single pass that reads the cluster light lists
+    if (app->lightingTechnique == LightingTechnique::CLUSTERED)
+    {
+        Program& program = app->programs[app->clusteredProgramIdx];
+        SetProgram(app->glState, program.handle);
+
+        SetStorageBuffer(app->glState, BINDING(0), app->pointLightsBuffer.handle);
+        SetStorageBuffer(app->glState, BINDING(1), app->clusterRangesBuffer.handle);
+        SetStorageBuffer(app->glState, BINDING(2), app->clusterIndicesBuffer.handle);
+
+        Mesh& mesh = app->meshes[app->models[app->screenIdx].meshIdx];
+        BindSubmeshVertices(app, mesh, 0, program);
+
+        BindGBufferTextures(app);
+
+        Submesh& submesh = mesh.submeshes[0];
+        glDrawElements(GL_TRIANGLES, submesh.indices.size(), submesh.indexType, (void*)(u64)submesh.indexOffset);
+    }
+
+    SetDepthMask(app->glState, true);
+}
+
+void ExecutePresentPass(App* app)
+{
+    SetCapability(app->glState, GL_CAPABILITY_DEPTH_TEST, false);
+    SetCapability(app->glState, GL_CAPABILITY_CULL_FACE, false);
+    SetCapability(app->glState, GL_CAPABILITY_BLEND, false);
 
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    
-    glViewport(0, 0, app->displaySize.x, app->displaySize.y);
-    
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
 
     if (app->mode == Mode::COLOR)
-        for (u32 i = 0; i < app->lights.size(); ++i)
-        {
-            Light& light = app->lights[i];
+    {
+        Program& program = app->programs[app->toScreenProgramIdx];
+        SetProgram(app->glState, program.handle);
 
-            Program& program = app->programs[light.programIdx];
-            glUseProgram(program.handle);
+        Mesh& mesh = app->meshes[app->models[app->screenIdx].meshIdx];
+        BindSubmeshVertices(app, mesh, 0, program);
 
-            glUniform1i(program.albedoLocation, 0);
-            glUniform1i(program.normalsLocation, 1);
-            glUniform1i(program.positionLocation, 2);
-            glUniform1i(program.depthLocation, 3);
+        SetTexture(app->glState, 0, GetFrameGraphTexture(app->frameGraph, app->lightingTarget));
 
-            glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->uniform.handle, light.uniformOffset, light.uniformSize);
+        Submesh& submesh = mesh.submeshes[0];
+        glDrawElements(GL_TRIANGLES, submesh.indices.size(), submesh.indexType, (void*)(u64)submesh.indexOffset);
+    }
+    else
+    {
+        // The G-Buffer is no longer directly viewable, the debug shader decodes the selected channel
+        Program& program = app->programs[app->gBufferDebugProgramIdx];
+        SetProgram(app->glState, program.handle);
 
-            u32 modelIdx = 0;
-            switch (light.type)
-            {
-            case Light::Type::DIRECTIONAL:
-                modelIdx = app->screenIdx;
-                break;
-            case Light::Type::POINT:
-                modelIdx = app->sphereIdx;
-                break;
-            }
+        glUniform1i(app->gBufferDebugModeLocation, (GLint)app->mode);
+        BindGBufferTextures(app);
+
+        Mesh& mesh = app->meshes[app->models[app->screenIdx].meshIdx];
+        BindSubmeshVertices(app, mesh, 0, program);
 
-            Mesh& mesh = app->meshes[app->models[modelIdx].meshIdx];
-            GLuint vao = FindVAO(mesh, 0, program);
-            glBindVertexArray(vao);
+        Submesh& submesh = mesh.submeshes[0];
+        glDrawElements(GL_TRIANGLES, submesh.indices.size(), submesh.indexType, (void*)(u64)submesh.indexOffset);
+    }
+}
 
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
-            glActiveTexture(GL_TEXTURE0 + 1);
-            glBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
-            glActiveTexture(GL_TEXTURE0 + 2);
-            glBindTexture(GL_TEXTURE_2D, app->positionsAttachmentHandle);
-            glActiveTexture(GL_TEXTURE0 + 3);
-            glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
+// Declares the passes of this frame, the lighting ones are culled while a G-Buffer channel is viewed
+void BuildFrameGraph(App* app)
+{
+    FrameGraph& graph = app->frameGraph;
+    BeginFrameGraph(graph, app->displaySize);
+
+    app->albedoTarget = CreateTransientTexture(graph, "Albedo", GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+    app->normalsTarget = CreateTransientTexture(graph, "Normals", GL_RG16, GL_RG, GL_UNSIGNED_SHORT);
+    app->depthTarget = CreateTransientTexture(graph, "Depth", GL_DEPTH24_STENCIL8, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8);
+    app->lightingTarget = CreateTransientTexture(graph, "Lighting", GL_RGBA16F, GL_RGBA, GL_FLOAT);
+    app->lightingDepthTarget = CreateTransientTexture(graph, "Lighting depth", GL_DEPTH24_STENCIL8, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8);
+    app->hiZTarget = ImportTexture(graph, "Hi-Z", app->hiZHandle);
+
+    u32 geometryPass = AddFrameGraphPass(graph, "Geometry", ExecuteGeometryPass);
+    WriteColorAttachment(graph, geometryPass, app->albedoTarget);
+    WriteColorAttachment(graph, geometryPass, app->normalsTarget);
+    WriteDepthAttachment(graph, geometryPass, app->depthTarget);
+    WriteTexture(graph, geometryPass, app->hiZTarget);
+
+    // Clustered shading doesn't rasterize light volumes
+    const bool drawsLightVolumes = app->lightingTechnique != LightingTechnique::CLUSTERED;
+    if (drawsLightVolumes)
+    {
+        u32 copyPass = AddFrameGraphPass(graph, "Light volume depth", ExecuteLightDepthCopyPass);
+        ReadTexture(graph, copyPass, app->depthTarget);
+        WriteTexture(graph, copyPass, app->lightingDepthTarget);
+    }
 
-            Submesh& submesh = mesh.submeshes[0];
-            glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
+    u32 lightingPass = AddFrameGraphPass(graph, "Lighting", ExecuteLightingPass);
+    ReadTexture(graph, lightingPass, app->albedoTarget);
+    ReadTexture(graph, lightingPass, app->normalsTarget);
+    ReadTexture(graph, lightingPass, app->depthTarget);
+    WriteColorAttachment(graph, lightingPass, app->lightingTarget);
+    if (drawsLightVolumes)
+    {
+        ReadTexture(graph, lightingPass, app->lightingDepthTarget);
+        WriteDepthAttachment(graph, lightingPass, app->lightingDepthTarget);
+    }
 
-            glBindVertexArray(0);
-            glUseProgram(0);
-        }
+    u32 presentPass = AddFrameGraphPass(graph, "Present", ExecutePresentPass);
+    if (app->mode == Mode::COLOR)
+        ReadTexture(graph, presentPass, app->lightingTarget);
     else
     {
-        Program& program = app->programs[app->toScreenProgramIdx];
-        glUseProgram(program.handle);
+        ReadTexture(graph, presentPass, app->albedoTarget);
+        ReadTexture(graph, presentPass, app->normalsTarget);
+        ReadTexture(graph, presentPass, app->depthTarget);
+    }
+    WriteBackbuffer(graph, presentPass);
+}
 
-        glUniform1i(program.albedoLocation, 0);
+void Render(App* app)
+{
+    BuildFrameGraph(app);
 
-        Mesh& mesh = app->meshes[app->models[app->screenIdx].meshIdx];
-        GLuint vao = FindVAO(mesh, 0, program);
-        glBindVertexArray(vao);
+    // Creates the targets and framebuffers the passes left need, before the cached bindings start
+    CompileFrameGraph(app->frameGraph);
 
-        glActiveTexture(GL_TEXTURE0);
-        switch (app->mode)
-        {
-        case Mode::ALBEDO:
-            glBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
-            break;
-        case Mode::NORMALS:
-            glBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
-            break;
-        case Mode::POSITIONS:
-            glBindTexture(GL_TEXTURE_2D, app->positionsAttachmentHandle);
-            break;
-        case Mode::DEPTH:
-            glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
-            break;
-        }
+    // ImGui and the passes run outside Render leave the bindings changed behind the cache
+    ResetGLStateCache(app->glState);
 
-        Submesh& submesh = mesh.submeshes[0];
-        glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
+    // Pass global parameters data to shader
+    SetUniformBufferRange(app->glState, BINDING(0), app->uniform.handle, app->globalsOffset, app->globalsSize);
 
-        glBindVertexArray(0);
-        glUseProgram(0);
-    }
+    // Per-object arrays, every draw selects its element by index
+    SetStorageBuffer(app->glState, BINDING(5), app->entityDataBuffer.handle);
+    SetStorageBuffer(app->glState, BINDING(6), app->lightDataBuffer.handle);
 
-    glBindTexture(GL_TEXTURE_2D, 0);
+    ExecuteFrameGraph(app->frameGraph, app, app->glState);
+
+    // The UI is drawn after the frame with the default bindings
+    SetCapability(app->glState, GL_CAPABILITY_BLEND, true);
+    SetVertexArray(app->glState, 0);
+    SetProgram(app->glState, 0);
+    SetTexture(app->glState, 0, 0);
+
+    // Every draw reading this frame's uniforms has been issued
+    FenceRegion(app->uniform);
 }
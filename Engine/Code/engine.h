@@ -5,6 +5,12 @@
 #pragma once
 
 #include "platform.h"
+#include "geometry.h"
+#include "occlusion.h"
+#include "vertexformat.h"
+#include "glstate.h"
+#include "framegraph.h"
+#include "transform.h"
 #include <glad/glad.h>
 
 #define BINDING(b) b
@@ -13,24 +19,72 @@
 
 #define LIGHT_AMOUNT 100
 
+#define ICOSPHERE_LODS 3
+
+#define CLUSTER_TILES_X 16
+#define CLUSTER_TILES_Y 9
+#define CLUSTER_SLICES 24
+#define CLUSTER_COUNT (CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES)
+
+// Instanced object index read by the INDIRECT program variants
+#define OBJECT_INDEX_LOCATION 5
+
+// Relative margin around lodPixelError before switching level, so levels don't flicker
+#define LOD_HYSTERESIS 0.25f
+
+// Impostor atlases hold IMPOSTOR_FRAMES x IMPOSTOR_FRAMES views over the octahedron
+#define IMPOSTOR_FRAMES 8
+#define IMPOSTOR_FRAME_SIZE 128
+
+// Regions of a ring buffer, one written while the GPU may still read the others
+#define BUFFER_RING_REGIONS 3
+
+// Elements per job in the parallel loops of Update
+#define UPDATE_GRAIN_SIZE 256
+
+// Transforms composed and multiplied by each run of the benchmark in the Gui
+#define TRANSFORM_BENCHMARK_COUNT 16384
+#define TRANSFORM_BENCHMARK_RUNS 8
+
 struct Buffer
 {
     GLuint handle;
     GLenum type;
+    GLenum usage;
     u32 size;
     u32 head;
     void* data; // mapped data
+    u32 dataOffset; // Of data inside the buffer, head counts from the buffer start
+
+    // Ring buffers only
+    u32 regionSize;
+    u32 regionIdx;
+    GLsync regionFences[BUFFER_RING_REGIONS]; // Signaled when the GPU is done with the region
+    u32 fenceWaits; // Regions that had to wait for their fence
 };
 
 bool IsPowerOf2(u32 value);
 
 u32 Align(u32 value, u32 alignment);
 
+/**
+ * Random number that only depends on its arguments, so any thread can draw the counter-th number of
+ * the stream named by key without shared state.
+ */
+u32 CounterRandom(u32 key, u32 counter);
+
 Buffer CreateBuffer(u32 size, GLenum type, GLenum usage);
 
 #define CreateConstantBuffer(size) CreateBuffer(size, GL_UNIFORM_BUFFER, GL_STREAM_DRAW)
 #define CreateStaticVertexBuffer(size) CreateBuffer(size, GL_ARRAY_BUFFER, GL_STATIC_DRAW)
 #define CreateStaticIndexBuffer(size) CreateBuffer(size, GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW)
+#define CreateStorageBuffer(size) CreateBuffer(size, GL_SHADER_STORAGE_BUFFER, GL_STREAM_DRAW)
+
+/**
+ * Buffer split in BUFFER_RING_REGIONS regions of regionSize bytes, mapped one after another with
+ * MapNextRegion and fenced with FenceRegion, so the GPU never reads the region being written.
+ */
+Buffer CreateRingBuffer(u32 regionSize, GLenum type);
 
 void BindBuffer(const Buffer& buffer);
 
@@ -38,6 +92,21 @@ void MapBuffer(Buffer& buffer, GLenum access);
 
 void UnmapBuffer(Buffer& buffer);
 
+/**
+ * Maps the next region without synchronizing, waiting first for its fence if the GPU is still reading
+ * it. The head starts at the region offset, so the offsets it gives are valid for binding the buffer.
+ */
+void MapNextRegion(Buffer& buffer);
+
+// Fences the current region after the commands that read it
+void FenceRegion(Buffer& buffer);
+
+/**
+ * Orphans the buffer storage and uploads the whole contents at once. The buffer grows
+ * if the data does not fit, so it can be used for lists whose size changes every frame.
+ */
+void UploadBufferData(Buffer& buffer, const void* data, u32 size);
+
 void AlignHead(Buffer& buffer, u32 alignment);
 
 void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment);
@@ -64,19 +133,6 @@ struct VertexV3V2
     glm::vec2 uv;
 };
 
-struct VertexBufferAttribute
-{
-    u8 location;
-    u8 componentCount;
-    u8 offset;
-};
-
-struct VertexBufferLayout
-{
-    std::vector<VertexBufferAttribute> attributes;
-    u8 stride;
-};
-
 struct VertexShaderAttribute
 {
     u8 location;
@@ -88,12 +144,6 @@ struct VertexShaderLayout
     std::vector<VertexShaderAttribute> attributes;
 };
 
-struct VAO
-{
-    GLuint handle;
-    GLuint programHandle;
-};
-
 glm::mat4 Translate(const glm::mat4& transform, const glm::vec3& position);
 glm::mat4 Scale(const glm::mat4& transform, const glm::vec3& scaleFactor);
 glm::mat4 Rotate(const glm::mat4& transform, const glm::vec3& rotation);
@@ -115,48 +165,147 @@ struct Material
     u32 specularTextureIdx;
     u32 normalsTextureIdx = 0u;
     u32 bumpTextureIdx;
+    u32 coneTextureIdx = 0u; // Relaxed cone step map built from bumpTextureIdx
+};
+
+// Simplified index list stored after the full detail one in the index buffer
+struct SubmeshLod
+{
+    u32 firstIndex; // Inside lodIndices
+    u32 indexCount;
+    f32 error; // Mesh units
+};
+
+// How the float vertices of a mesh are stored in its vertex buffer
+enum class VertexFormat
+{
+    RAW, // As they are, for the screen quad and the light volumes
+    FLOAT, // Octahedral normal and tangent with the bitangent handedness, 44 bytes
+    PACKED // Same attributes quantized to 16 and 10 bits, 20 bytes
 };
 
 struct Submesh
 {
     VertexBufferLayout vertexBufferLayout;
+    VertexLayoutId layoutId = VertexLayoutId::FLOAT_POSITION; // Of the uploaded vertices
+    VertexBufferLayout gpuVertexBufferLayout; // Layout of the uploaded vertices, unused by VertexFormat::RAW
+    VertexBufferLayout positionStreamLayout; // Location 0 alone, after the interleaved vertices
+    u32 positionStreamOffset;
+    VertexLayoutId positionStreamLayoutId = VertexLayoutId::FLOAT_POSITION;
     std::vector<float> vertices;
     std::vector<u32> indices;
     u32 vertexOffset;
     u32 indexOffset;
+    GLenum indexType = GL_UNSIGNED_INT; // Of the uploaded indices, its LODs included
+
+    std::vector<Meshlet> meshlets; // Empty when the submesh is drawn whole
+
+    std::vector<u32> lodIndices;
+    std::vector<SubmeshLod> lods; // From level 1, level 0 is indices
+};
+
+/**
+ * Copies the location 0 attribute of the interleaved vertices.
+ */
+std::vector<glm::vec3> GetSubmeshPositions(const Submesh& submesh);
+
+u32 GetSubmeshVertexCount(const Submesh& submesh);
 
-    std::vector<VAO> vaos;
+u32 GetIndexSize(const Submesh& submesh);
+
+struct Mesh;
+
+/**
+ * Converts the surface vertices of every submesh (position, normal, texture coordinates, tangent and
+ * bitangent at locations 0 to 4) to the given format and uploads them with a separate position stream,
+ * replacing the previous vertex buffer contents and VAOs. Packed positions are quantized in the
+ * bounding cube of the mesh.
+ */
+void UploadMeshVertices(Mesh& mesh, VertexFormat format);
+
+/**
+ * Uploads the indices of every submesh followed by its levels of detail, as 16-bit indices when the
+ * submesh has few enough vertices. Offsets stay 4-byte aligned so both types share the buffer.
+ */
+void UploadMeshIndices(Mesh& mesh);
+
+// Measured on the full detail indices of all the submeshes, weighted by their triangles
+struct MeshOptimizationStats
+{
+    f32 acmrBefore = 0.0f;
+    f32 acmrAfter = 0.0f;
+    f32 overdrawBefore = 0.0f;
+    f32 overdrawAfter = 0.0f;
 };
 
 struct Mesh
 {
     std::vector<Submesh> submeshes;
-    GLuint vertexBufferHandle;
+    GLuint vertexBufferHandle = 0;
     GLuint indexBufferHandle;
+
+    VertexFormat vertexFormat = VertexFormat::RAW;
+    glm::mat4 positionTransform = IDENTITY4; // Quantized positions to mesh space, applied with the world matrix
+
+    glm::vec3 aabbMin;
+    glm::vec3 aabbMax;
+
+    std::vector<f32> lodErrors; // Largest submesh error of every level, empty without levels
+
+    MeshOptimizationStats optimizationStats; // Zero for the meshes built in code
 };
 
 struct Model
 {
     u32 meshIdx;
     std::vector<u32> materialIdx;
+    u32 impostorIdx = UINT32_MAX;
+
+    // Some material has the texture, set once the materials are assigned
+    bool hasNormalsTexture = false;
+    bool hasBumpTexture = false;
+    bool hasConeTexture = false;
+};
+
+// Views of a model baked from directions spread over the octahedron, drawn as a single quad
+struct Impostor
+{
+    u32 albedoTextureIdx; // Alpha is the coverage
+    u32 normalDepthTextureIdx; // RG: octahedral mesh space normal, BA: 16-bit depth across the bounding sphere, high byte first
+
+    glm::vec3 center; // Mesh space bounding sphere
+    f32 radius;
 };
 
 struct Program
 {
     GLuint handle;
 
-    GLint albedoLocation;
-    GLint normalsLocation;
-    GLint positionLocation;
-    GLint depthLocation;
+    // Sampler uniforms, -1 for the ones the program doesn't declare or that were never queried
+    GLint albedoLocation = -1;
+    GLint normalsLocation = -1;
+    GLint depthLocation = -1;
+    GLint coneLocation = -1;
+
+    // Per-draw vertex format of the VERTEX_PULLING variants, -1 for the others
+    GLint vertexLayoutLocation = -1;
+    GLint attributeOffsetsLocation = -1; // Also -1 for the variants that only read positions
+
+    // Element of the entity or light arrays read by the draw, -1 when the program reads neither
+    GLint entityIdxLocation = -1;
+    GLint lightIdxLocation = -1;
 
     std::string filepath;
     std::string programName;
+    std::string defines;
     u64 lastWriteTimestamp; // What is this for?
 
     VertexShaderLayout vetexInputLayout;
+    u32 inputLocationMask = 0; // Bit per location in vetexInputLayout
 };
 
+u32 GetVertexLayoutLocationMask(VertexLayoutId layoutId);
+
 struct Screen
 {
     const VertexV3V2 vertices[4] =
@@ -184,13 +333,15 @@ struct Entity
     u32 modelIdx;
     GLuint programIdx;
 
-    glm::mat4 transform;
-    glm::vec3 position;
-    glm::vec3 scale;
-    glm::vec3 rotation;
+    glm::mat4 transform; // Composed from App::entityTransforms by UpdateEntityTransforms
 
-    u32 uniformOffset;
-    u32 uniformSize;
+    bool transformDirty = true; // Its entry of App::entityTransforms changed since transform was composed
+    bool dataDirty = true; // Transform or flags changed since its EntityData was written
+    bool gpuObjectDirty = true; // Same for its GpuObject, the GPU-driven path's copy
+
+    u32 lodLevel = 0u;
+    bool lodCulled = false; // Smaller than lodMinPixelSize on screen
+    bool drawImpostor = false; // Further than impostorDistance
 };
 
 struct Light
@@ -211,8 +362,89 @@ struct Light
 
     glm::mat4 transform;
 
-    u32 uniformOffset;
-    u32 uniformSize;
+    bool dataDirty = true; // Since its LightData was written
+};
+
+// View-space bounds of a single cluster (screen tile x depth slice)
+struct ClusterBounds
+{
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+// std430 layout, world space box tested against the Hi-Z pyramid
+struct CullBounds
+{
+    glm::vec4 min;
+    glm::vec4 max;
+};
+
+// std430 layout of an entity inside the GPU-driven culling and drawing buffers
+struct GpuObject
+{
+    glm::mat4 world;
+    glm::vec4 aabbMin; // Local space
+    glm::vec4 aabbMax;
+    u32 firstBatch;
+    u32 batchCount;
+    u32 hasNormalMapping;
+    u32 hasReliefMapping;
+};
+
+// std430 layout of an entity in entityDataBuffer
+struct EntityData
+{
+    glm::mat4 world;
+    u32 hasNormalMapping;
+    u32 hasReliefMapping;
+    u32 padding[2];
+};
+
+// std430 layout of a light in lightDataBuffer
+struct LightData
+{
+    glm::vec4 color;
+    glm::vec4 vector; // Direction of the directional lights, center and range of the point lights
+    glm::mat4 world; // Point light volume
+};
+
+// Same layout as the commands read by glDrawElementsIndirect
+struct DrawElementsIndirectCommand
+{
+    u32 count;
+    u32 instanceCount;
+    u32 firstIndex;
+    i32 baseVertex;
+    u32 baseInstance;
+};
+
+// A submesh of a model used by some entity, drawn for all its visible entities with one command
+struct IndirectBatch
+{
+    u32 modelIdx;
+    u32 submeshIdx;
+};
+
+// Must match the constants of the GPU_CULL shader
+enum class CullPhase
+{
+    FRUSTUM = 0,
+    FIRST = 1,
+    SECOND = 2
+};
+
+// std430 layout of a point light inside the light lists read by the lighting shaders
+struct PointLightData
+{
+    glm::vec4 color;
+    glm::vec4 centerRange;
+};
+
+enum class LightingTechnique
+{
+    LIGHT_VOLUMES,
+    INSTANCED_VOLUMES,
+    CLUSTERED
 };
 
 enum class Mode
@@ -243,6 +475,13 @@ struct App
     // Mapping Techniques
     bool useNormalMap = true;
     bool useReliefMap = true;
+    bool useConeStepMapping = true;
+    u32 texturedMeshConeProgramIdx;
+
+    // Depth Prepass
+    bool useDepthPrepass = true;
+    u32 depthPrepassProgramIdx;
+    u32 texturedMeshEarlyZProgramIdx;
 
     // Loop
     f32  deltaTime;
@@ -270,6 +509,11 @@ struct App
     std::vector<Light> lights;
 
     std::vector<Entity> entities;
+    TransformArrays entityTransforms; // Same indices as entities
+
+    // Transform benchmark, best run of the glm path and the batched one
+    f32 transformBenchmarkGlmMs = 0.0f;
+    f32 transformBenchmarkBatchedMs = 0.0f;
 
     // UI
     i32 selectedEntity = -1;
@@ -283,6 +527,7 @@ struct App
     u32 planeIdx;
     u32 sphereIdx;
     u32 screenIdx;
+    u32 icosphereIdx[ICOSPHERE_LODS]; // Light volume proxies, from coarse to fine
 
     // Transforms
     float aspectRatio;
@@ -297,23 +542,154 @@ struct App
 
     Buffer uniform;
 
+    u32 globalsOffset;
     u32 globalsSize;
-    
-    // Frame Buffer
-    GLuint albedoAttachmentHandle;
-    GLuint normalsAttachmentHandle;
-    GLuint positionsAttachmentHandle;
-    GLuint depthAttachmentHandle; // Depth Render Output
-    GLuint depthHandle; // Actual Depth Attachment (No render Madge)
-    GLuint currentAttachmentHandle;
 
-    GLuint frameBufferHandle;
+    // Per-object arrays indexed by uEntityIdx and uLightIdx, rewritten only where they are dirty
+    Buffer entityDataBuffer;
+    Buffer lightDataBuffer;
+    Buffer objectDataStaging; // Ring whose regions hold both arrays back to back
+    u32 objectDataCount = 0u; // Entities and lights the buffers were sized for
+    u32 objectDataUpdates = 0u; // Written this frame
+
+    // Bindings and fixed function state set while rendering, forgotten at the start of every frame
+    GLStateCache glState;
+    
+    // Render targets, declared again every frame in the frame graph
+    FrameGraph frameGraph;
+    FrameGraphResource albedoTarget; // RGBA8
+    FrameGraphResource normalsTarget; // RG16 octahedral encoded
+    FrameGraphResource depthTarget; // Positions are rebuilt from it with the inverse view projection
+    FrameGraphResource lightingTarget; // Light accumulation
+    FrameGraphResource lightingDepthTarget; // Copy of depthTarget for the stencil volumes, so depthTarget can be sampled meanwhile
+    FrameGraphResource hiZTarget;
 
     // Deferred Shading
     u32 texturedMeshProgramIdx;
     u32 directionalProgramIdx;
     u32 pointProgramIdx;
+    u32 lightStencilProgramIdx;
     u32 toScreenProgramIdx;
+    u32 gBufferDebugProgramIdx;
+    GLint gBufferDebugModeLocation;
+
+    // Point light list shared by the clustered and instanced techniques
+    std::vector<PointLightData> pointLights;
+    Buffer pointLightsBuffer;
+
+    // Instanced Light Volumes
+    u32 pointInstancedProgramIdx;
+    GLint pointInstancedLightOffsetLocation;
+    u32 pointLightInstanceCounts[ICOSPHERE_LODS];
+
+    // Clustered Shading
+    LightingTechnique lightingTechnique = LightingTechnique::CLUSTERED;
+    u32 clusteredProgramIdx;
+
+    std::vector<ClusterBounds> clusterBounds;
+    std::vector<glm::uvec2> clusterRanges; // offset and count inside the index list
+    std::vector<u32> clusterIndices;
+    u32 clusterLightAssignments = 0u;
+
+    Buffer clusterRangesBuffer;
+    Buffer clusterIndicesBuffer;
+
+    // Hi-Z Occlusion Culling
+    bool useHiZCulling = true;
+    u32 hiZDownsampleProgramIdx;
+    GLint hiZSourceLevelLocation;
+    GLint hiZSourceSizeLocation;
+    u32 hiZCullProgramIdx;
+    GLint hiZObjectCountLocation;
+
+    GLuint hiZHandle; // R32F, farthest depth of each texel footprint
+    glm::ivec2 hiZSize;
+    u32 hiZLevels;
+
+    std::vector<CullBounds> cullBounds; // Entities followed by lights
+    std::vector<u32> cullVisibility; // Result of this frame's cull, same order as cullBounds
+    std::vector<u32> entityVisibility; // Entities drawn in the first phase, the previous frame's result
+    Buffer cullBoundsBuffer;
+    Buffer cullVisibilityBuffer;
+
+    // Copies of cullVisibilityBuffer, mapped once the fence after the copy signals
+    Buffer cullReadback;
+    f32 cullWaitMs = 0.0f; // CPU time spent waiting for the cull, the GPU-driven path has none
+    u32 hiZCulledEntities = 0u;
+    u32 hiZCulledLights = 0u;
+
+    // Software Occlusion Culling
+    bool useSoftwareOcclusion = false;
+    std::vector<OccluderMesh> occluderMeshes; // Simplified copy of every mesh, same indices as meshes
+    OcclusionBuffer occlusionBuffer;
+    std::vector<u8> softwareVisibility;
+    std::vector<glm::mat4> occluderTransforms; // MVP of every entity
+    u32 softwareCulledEntities = 0u;
+    u32 occluderTriangles = 0u;
+    i32 occlusionTestFailures = -1; // Of the last TestOcclusionBuffer, -1 before the first run
+
+    // Mesh LODs
+    bool useLods = true;
+    f32 lodPixelError = 1.0f; // Coarsest level whose error projects under this is drawn
+    f32 lodMinPixelSize = 2.0f;
+    u32 lodCulledEntities = 0u;
+    u32 lodTriangles = 0u;
+
+    // Impostors
+    bool useImpostors = true;
+    f32 impostorDistance = 60.0f;
+    std::vector<Impostor> impostors;
+    u32 impostorBakeProgramIdx;
+    GLint impostorBakeViewProjectionLocation;
+    u32 impostorProgramIdx;
+    GLint impostorInstanceOffsetLocation;
+    GLint impostorSphereLocation;
+    GLint impostorFramesLocation;
+
+    std::vector<glm::mat4> impostorInstances; // Grouped by impostor
+    std::vector<u32> impostorInstanceCounts;
+    Buffer impostorInstancesBuffer;
+
+    // Vertex Compression
+    bool usePackedVertices = true; // Format of the meshes drawn as entities
+
+    // Vertex Layouts
+    GLuint vertexLayoutVaos[(u32)VertexLayoutId::COUNT][2]; // Without and with the instanced object index
+
+    // Vertex Pulling
+    bool useVertexPulling = false;
+    GLuint vertexPullingVao; // No attributes, only the index buffer of the mesh being drawn
+    u32 texturedMeshPullingProgramIdx;
+    u32 texturedMeshPullingEarlyZProgramIdx;
+    u32 texturedMeshPullingConeProgramIdx;
+    u32 depthPrepassPullingProgramIdx;
+
+    // Meshlet Culling
+    bool useMeshletCulling = true;
+    glm::vec4 frustumPlanes[6];
+    u32 meshletsTested = 0u;
+    u32 meshletsCulled = 0u;
+    std::vector<GLsizei> meshletDrawCounts; // Scratch for the ranges of one submesh, kept to reuse the storage
+    std::vector<const void*> meshletDrawOffsets;
+
+    // GPU-Driven Culling
+    bool useGpuDrivenCulling = false;
+    bool gpuSceneDirty = true; // Entities added, removed or given another model since the batches were built
+    u32 gpuCullProgramIdx;
+    GLint gpuCullObjectCountLocation;
+    GLint gpuCullPhaseLocation;
+    u32 texturedMeshIndirectProgramIdx;
+    u32 texturedMeshIndirectEarlyZProgramIdx;
+    u32 texturedMeshIndirectConeProgramIdx;
+    u32 depthPrepassIndirectProgramIdx;
+
+    std::vector<IndirectBatch> indirectBatches;
+    std::vector<u32> modelFirstBatches; // Index into indirectBatches of the first submesh of every model
+    std::vector<DrawElementsIndirectCommand> indirectCommands; // Zero instance counts, copied before every cull
+    Buffer gpuObjectsBuffer;
+    Buffer drawCommandsBuffer;
+    Buffer drawInstancesBuffer; // Object indices, instanced vertex attribute
+    Buffer objectVisibilityBuffer;
 
     // Mode
     Mode mode;
@@ -321,6 +697,26 @@ struct App
 
 void Init(App* app);
 
+/**
+ * (Re)creates the Hi-Z pyramid for the current display size.
+ */
+void CreateHiZPyramid(App* app);
+
+/**
+ * Reallocates everything sized after the display, once app->displaySize holds the new size.
+ */
+void ResizeRenderTargets(App* app);
+
+void CreateColorAttachment(GLuint& handle, const glm::ivec2& displaySize, GLint internalFormat, GLenum format, GLenum type);
+
+void CheckFrameBufferStatus();
+
+/**
+ * Times TRANSFORM_BENCHMARK_COUNT world and MVP matrices built with glm against the batched kernels
+ * of transform.h, on the calling thread, keeping the best of TRANSFORM_BENCHMARK_RUNS runs of each.
+ */
+void BenchmarkTransforms(App* app);
+
 void Gui(App* app);
 
 void Update(App* app);
@@ -0,0 +1,305 @@
+//
+// framegraph.cpp: Pass culling, target lifetimes and the pools the transient targets are taken from.
+//
+
+#include "framegraph.h"
+#include "engine.h"
+
+bool operator==(const FrameGraphTextureDesc& a, const FrameGraphTextureDesc& b)
+{
+    return a.internalFormat == b.internalFormat && a.format == b.format && a.type == b.type;
+}
+
+bool IsDepthFormat(GLint internalFormat)
+{
+    return internalFormat == GL_DEPTH24_STENCIL8 || internalFormat == GL_DEPTH32F_STENCIL8 ||
+        internalFormat == GL_DEPTH_COMPONENT24 || internalFormat == GL_DEPTH_COMPONENT32F;
+}
+
+// Every texture the pass touches, a texture can appear more than once
+std::vector<FrameGraphResource> GetPassTextures(const FrameGraphPass& pass)
+{
+    std::vector<FrameGraphResource> textures = pass.reads;
+    textures.insert(textures.end(), pass.writes.begin(), pass.writes.end());
+    textures.insert(textures.end(), pass.colorAttachments.begin(), pass.colorAttachments.end());
+    if (pass.depthAttachment != UINT32_MAX)
+        textures.push_back(pass.depthAttachment);
+    return textures;
+}
+
+void BeginFrameGraph(FrameGraph& graph, glm::ivec2 size)
+{
+    graph.size = size;
+    graph.textures.clear();
+    graph.passes.clear();
+    ++graph.frameIdx;
+}
+
+FrameGraphResource CreateTransientTexture(FrameGraph& graph, const char* name, GLint internalFormat, GLenum format, GLenum type)
+{
+    FrameGraphTexture texture = {};
+    texture.name = name;
+    texture.desc = { internalFormat, format, type };
+    texture.poolIdx = UINT32_MAX;
+    graph.textures.push_back(texture);
+    return graph.textures.size() - 1u;
+}
+
+FrameGraphResource ImportTexture(FrameGraph& graph, const char* name, GLuint handle)
+{
+    FrameGraphTexture texture = {};
+    texture.name = name;
+    texture.imported = true;
+    texture.poolIdx = UINT32_MAX;
+    texture.handle = handle;
+    graph.textures.push_back(texture);
+    return graph.textures.size() - 1u;
+}
+
+u32 AddFrameGraphPass(FrameGraph& graph, const char* name, FrameGraphExecute execute)
+{
+    FrameGraphPass pass = {};
+    pass.name = name;
+    pass.execute = execute;
+    pass.depthAttachment = UINT32_MAX;
+    graph.passes.push_back(pass);
+    return graph.passes.size() - 1u;
+}
+
+void ReadTexture(FrameGraph& graph, u32 passIdx, FrameGraphResource texture)
+{
+    graph.passes[passIdx].reads.push_back(texture);
+}
+
+void WriteTexture(FrameGraph& graph, u32 passIdx, FrameGraphResource texture)
+{
+    graph.passes[passIdx].writes.push_back(texture);
+}
+
+void WriteColorAttachment(FrameGraph& graph, u32 passIdx, FrameGraphResource texture)
+{
+    FrameGraphPass& pass = graph.passes[passIdx];
+    ASSERT(pass.colorAttachments.size() < FRAME_GRAPH_MAX_COLOR_ATTACHMENTS, "Too many color attachments in a frame graph pass");
+    ASSERT(!graph.textures[texture].imported, "Imported textures can't be attached");
+    pass.colorAttachments.push_back(texture);
+}
+
+void WriteDepthAttachment(FrameGraph& graph, u32 passIdx, FrameGraphResource texture)
+{
+    ASSERT(IsDepthFormat(graph.textures[texture].desc.internalFormat), "Depth attachments need a depth format");
+    graph.passes[passIdx].depthAttachment = texture;
+}
+
+void WriteBackbuffer(FrameGraph& graph, u32 passIdx)
+{
+    graph.passes[passIdx].writesBackbuffer = true;
+}
+
+void DeletePooledTexture(FrameGraph& graph, u32 poolIdx)
+{
+    GLuint handle = graph.pool[poolIdx].handle;
+
+    for (u32 i = 0; i < graph.framebuffers.size();)
+    {
+        CachedFramebuffer& framebuffer = graph.framebuffers[i];
+        bool attached = framebuffer.depth == handle;
+        for (u32 c = 0; c < framebuffer.colorCount; ++c)
+            attached |= framebuffer.colors[c] == handle;
+
+        if (attached)
+        {
+            glDeleteFramebuffers(1, &framebuffer.handle);
+            graph.framebuffers.erase(graph.framebuffers.begin() + i);
+        }
+        else
+            ++i;
+    }
+
+    glDeleteTextures(1, &handle);
+    graph.pool.erase(graph.pool.begin() + poolIdx);
+}
+
+u32 AcquirePooledTexture(FrameGraph& graph, const FrameGraphTextureDesc& desc)
+{
+    for (u32 i = 0; i < graph.pool.size(); ++i)
+    {
+        PooledTexture& pooled = graph.pool[i];
+        if (pooled.inUse || !(pooled.desc == desc))
+            continue;
+
+        // Released by a texture that was alive earlier this frame
+        if (pooled.lastUsedFrame == graph.frameIdx)
+            ++graph.aliasedTextures;
+
+        pooled.inUse = true;
+        pooled.lastUsedFrame = graph.frameIdx;
+        return i;
+    }
+
+    PooledTexture pooled = {};
+    pooled.desc = desc;
+    pooled.inUse = true;
+    pooled.lastUsedFrame = graph.frameIdx;
+    CreateColorAttachment(pooled.handle, graph.size, desc.internalFormat, desc.format, desc.type);
+    graph.pool.push_back(pooled);
+    return graph.pool.size() - 1u;
+}
+
+GLuint GetFramebuffer(FrameGraph& graph, const FrameGraphPass& pass)
+{
+    GLuint colors[FRAME_GRAPH_MAX_COLOR_ATTACHMENTS] = {};
+    u32 colorCount = pass.colorAttachments.size();
+    for (u32 c = 0; c < colorCount; ++c)
+        colors[c] = graph.textures[pass.colorAttachments[c]].handle;
+    GLuint depth = pass.depthAttachment != UINT32_MAX ? graph.textures[pass.depthAttachment].handle : 0u;
+
+    for (const CachedFramebuffer& framebuffer : graph.framebuffers)
+        if (framebuffer.colorCount == colorCount && framebuffer.depth == depth && memcmp(framebuffer.colors, colors, sizeof(colors)) == 0)
+            return framebuffer.handle;
+
+    CachedFramebuffer framebuffer = {};
+    memcpy(framebuffer.colors, colors, sizeof(colors));
+    framebuffer.colorCount = colorCount;
+    framebuffer.depth = depth;
+
+    glGenFramebuffers(1, &framebuffer.handle);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer.handle);
+    for (u32 c = 0; c < colorCount; ++c)
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + c, colors[c], 0);
+    if (depth != 0u)
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, depth, 0);
+    CheckFrameBufferStatus();
+
+    GLenum drawBuffers[FRAME_GRAPH_MAX_COLOR_ATTACHMENTS];
+    for (u32 c = 0; c < colorCount; ++c)
+        drawBuffers[c] = GL_COLOR_ATTACHMENT0 + c;
+    if (colorCount > 0u)
+        glDrawBuffers(colorCount, drawBuffers);
+    else
+        glDrawBuffer(GL_NONE);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    graph.framebuffers.push_back(framebuffer);
+    return framebuffer.handle;
+}
+
+void CompileFrameGraph(FrameGraph& graph)
+{
+    // Backwards from the passes that write the backbuffer, a pass is kept when a kept pass reads what it writes
+    std::vector<bool> needed(graph.textures.size(), false);
+    graph.culledPasses = 0u;
+    for (u32 p = graph.passes.size(); p-- > 0u;)
+    {
+        FrameGraphPass& pass = graph.passes[p];
+
+        // Only what the pass writes counts, reading a needed texture doesn't make the pass needed
+        bool contributes = pass.writesBackbuffer;
+        for (FrameGraphResource texture : pass.writes)
+            contributes |= needed[texture];
+        for (FrameGraphResource texture : pass.colorAttachments)
+            contributes |= needed[texture];
+        if (pass.depthAttachment != UINT32_MAX)
+            contributes |= needed[pass.depthAttachment];
+
+        pass.culled = !contributes;
+        if (pass.culled)
+        {
+            ++graph.culledPasses;
+            continue;
+        }
+
+        for (FrameGraphResource texture : pass.reads)
+            needed[texture] = true;
+    }
+
+    // Lifetimes over the passes left
+    for (FrameGraphTexture& texture : graph.textures)
+    {
+        texture.firstPass = UINT32_MAX;
+        texture.lastPass = 0u;
+    }
+    for (u32 p = 0; p < graph.passes.size(); ++p)
+    {
+        if (graph.passes[p].culled)
+            continue;
+
+        for (FrameGraphResource texture : GetPassTextures(graph.passes[p]))
+        {
+            graph.textures[texture].firstPass = glm::min(graph.textures[texture].firstPass, p);
+            graph.textures[texture].lastPass = glm::max(graph.textures[texture].lastPass, p);
+        }
+    }
+
+    // Targets no frame has used for a while, before any pool index is handed out
+    for (u32 i = 0; i < graph.pool.size();)
+    {
+        if (graph.pool[i].lastUsedFrame + FRAME_GRAPH_POOL_FRAMES < graph.frameIdx)
+            DeletePooledTexture(graph, i);
+        else
+            ++i;
+    }
+    for (PooledTexture& pooled : graph.pool)
+        pooled.inUse = false;
+
+    // Each target is taken at the first pass of its texture and given back after the last one
+    graph.aliasedTextures = 0u;
+    for (u32 p = 0; p < graph.passes.size(); ++p)
+    {
+        FrameGraphPass& pass = graph.passes[p];
+        if (pass.culled)
+            continue;
+
+        const std::vector<FrameGraphResource> textures = GetPassTextures(pass);
+        for (FrameGraphResource t : textures)
+        {
+            FrameGraphTexture& texture = graph.textures[t];
+            if (!texture.imported && texture.poolIdx == UINT32_MAX)
+            {
+                texture.poolIdx = AcquirePooledTexture(graph, texture.desc);
+                texture.handle = graph.pool[texture.poolIdx].handle;
+            }
+        }
+
+        if (pass.writesBackbuffer)
+            pass.framebuffer = 0u;
+        else if (!pass.colorAttachments.empty() || pass.depthAttachment != UINT32_MAX)
+            pass.framebuffer = GetFramebuffer(graph, pass);
+
+        for (FrameGraphResource t : textures)
+        {
+            FrameGraphTexture& texture = graph.textures[t];
+            if (!texture.imported && texture.lastPass == p)
+                graph.pool[texture.poolIdx].inUse = false;
+        }
+    }
+}
+
+void ExecuteFrameGraph(FrameGraph& graph, App* app, GLStateCache& state)
+{
+    for (const FrameGraphPass& pass : graph.passes)
+    {
+        if (pass.culled)
+            continue;
+
+        // Passes without attachments, like copies and compute, keep whatever is bound
+        if (pass.writesBackbuffer || pass.framebuffer != 0u)
+        {
+            SetFramebuffer(state, GL_FRAMEBUFFER, pass.framebuffer);
+            glViewport(0, 0, graph.size.x, graph.size.y);
+        }
+
+        pass.execute(app);
+    }
+}
+
+GLuint GetFrameGraphTexture(const FrameGraph& graph, FrameGraphResource texture)
+{
+    ASSERT(graph.textures[texture].handle != 0u, "Frame graph texture read by a culled pass or before compiling");
+    return graph.textures[texture].handle;
+}
+
+void ReleaseFrameGraphTargets(FrameGraph& graph)
+{
+    while (!graph.pool.empty())
+        DeletePooledTexture(graph, graph.pool.size() - 1u);
+}
@@ -0,0 +1,131 @@
+//
+// framegraph.h: The passes of a frame declared with the textures they read and write, so the ones that
+// don't contribute to the screen are culled and the render targets are allocated only while alive,
+// from a pool shared by the targets whose lifetimes don't overlap.
+//
+
+#pragma once
+
+#include "platform.h"
+#include "glstate.h"
+#include <glad/glad.h>
+
+// Color attachments a single pass can write
+#define FRAME_GRAPH_MAX_COLOR_ATTACHMENTS 4
+
+// Frames a pooled target is kept without being used, so switching views doesn't reallocate
+#define FRAME_GRAPH_POOL_FRAMES 120
+
+struct App;
+
+typedef void (*FrameGraphExecute)(App* app);
+
+// Texture declared this frame, by its index in FrameGraph::textures
+typedef u32 FrameGraphResource;
+
+struct FrameGraphTextureDesc
+{
+    GLint internalFormat; // Depth formats are attached as depth stencil
+    GLenum format;
+    GLenum type;
+};
+
+struct FrameGraphTexture
+{
+    const char* name;
+    FrameGraphTextureDesc desc;
+    bool imported; // Owned outside the graph, never pooled
+
+    // Filled by CompileFrameGraph
+    u32 firstPass;
+    u32 lastPass;
+    u32 poolIdx;
+    GLuint handle;
+};
+
+struct FrameGraphPass
+{
+    const char* name;
+    FrameGraphExecute execute;
+
+    std::vector<FrameGraphResource> reads;
+    std::vector<FrameGraphResource> writes; // Written outside the attachments, like copies and images
+    std::vector<FrameGraphResource> colorAttachments;
+    FrameGraphResource depthAttachment;
+    bool writesBackbuffer;
+
+    // Filled by CompileFrameGraph
+    bool culled;
+    GLuint framebuffer;
+};
+
+struct PooledTexture
+{
+    FrameGraphTextureDesc desc;
+    GLuint handle;
+    bool inUse;
+    u64 lastUsedFrame;
+};
+
+struct CachedFramebuffer
+{
+    GLuint colors[FRAME_GRAPH_MAX_COLOR_ATTACHMENTS];
+    u32 colorCount;
+    GLuint depth;
+    GLuint handle;
+};
+
+struct FrameGraph
+{
+    glm::ivec2 size; // Of every transient target
+
+    // Declared every frame
+    std::vector<FrameGraphTexture> textures;
+    std::vector<FrameGraphPass> passes;
+
+    // Kept between frames
+    std::vector<PooledTexture> pool;
+    std::vector<CachedFramebuffer> framebuffers;
+    u64 frameIdx;
+
+    // Last compilation
+    u32 culledPasses;
+    u32 aliasedTextures; // Transient textures that reused a target freed earlier in the frame
+};
+
+/**
+ * Starts declaring a frame whose transient targets are size pixels big.
+ */
+void BeginFrameGraph(FrameGraph& graph, glm::ivec2 size);
+
+FrameGraphResource CreateTransientTexture(FrameGraph& graph, const char* name, GLint internalFormat, GLenum format, GLenum type);
+FrameGraphResource ImportTexture(FrameGraph& graph, const char* name, GLuint handle);
+
+u32 AddFrameGraphPass(FrameGraph& graph, const char* name, FrameGraphExecute execute);
+
+void ReadTexture(FrameGraph& graph, u32 passIdx, FrameGraphResource texture);
+void WriteTexture(FrameGraph& graph, u32 passIdx, FrameGraphResource texture);
+void WriteColorAttachment(FrameGraph& graph, u32 passIdx, FrameGraphResource texture);
+void WriteDepthAttachment(FrameGraph& graph, u32 passIdx, FrameGraphResource texture);
+void WriteBackbuffer(FrameGraph& graph, u32 passIdx);
+
+/**
+ * Culls the passes nothing on the backbuffer depends on, then assigns pooled targets to the transient
+ * textures of the others in pass order, releasing each one after its last pass so a later texture with
+ * the same description can alias it. Targets and framebuffers are created here, before any pass runs.
+ */
+void CompileFrameGraph(FrameGraph& graph);
+
+/**
+ * Runs the passes left by CompileFrameGraph in declaration order, each with its framebuffer bound
+ * and the viewport covering the targets.
+ */
+void ExecuteFrameGraph(FrameGraph& graph, App* app, GLStateCache& state);
+
+GLuint GetFrameGraphTexture(const FrameGraph& graph, FrameGraphResource texture);
+
+/**
+ * Frees the pooled targets and their framebuffers, the next compilation allocates them again. Called
+ * when the display size changes.
+ */
+void ReleaseFrameGraphTargets(FrameGraph& graph);
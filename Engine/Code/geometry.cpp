@@ -0,0 +1,714 @@
+//
+// geometry.cpp: Load-time mesh processing. Nothing in here touches OpenGL.
+//
+
+#include "geometry.h"
+
+#include <algorithm>
+
+void ComputeMeshletBounds(Meshlet& meshlet, const std::vector<glm::vec3>& positions, const std::vector<u32>& indices)
+{
+    glm::vec3 boundsMin = glm::vec3(FLT_MAX);
+    glm::vec3 boundsMax = glm::vec3(-FLT_MAX);
+    for (u32 i = meshlet.firstIndex; i < meshlet.firstIndex + meshlet.triangleCount * 3u; ++i)
+    {
+        boundsMin = glm::min(boundsMin, positions[indices[i]]);
+        boundsMax = glm::max(boundsMax, positions[indices[i]]);
+    }
+
+    meshlet.center = (boundsMin + boundsMax) * 0.5f;
+    meshlet.radius = 0.0f;
+    for (u32 i = meshlet.firstIndex; i < meshlet.firstIndex + meshlet.triangleCount * 3u; ++i)
+        meshlet.radius = glm::max(meshlet.radius, glm::length(positions[indices[i]] - meshlet.center));
+
+    // Normal cone around the average facing, from the winding so it agrees with glCullFace
+    std::vector<glm::vec3> normals;
+    glm::vec3 axis = glm::vec3(0.0f);
+    for (u32 i = meshlet.firstIndex; i < meshlet.firstIndex + meshlet.triangleCount * 3u; i += 3)
+    {
+        const glm::vec3& a = positions[indices[i]];
+        glm::vec3 normal = glm::cross(positions[indices[i + 1]] - a, positions[indices[i + 2]] - a);
+        f32 length = glm::length(normal);
+        if (length <= FLT_EPSILON)
+            continue;
+
+        normals.push_back(normal / length);
+        axis += normals.back();
+    }
+
+    meshlet.coneAxis = glm::vec3(0.0f, 0.0f, 1.0f);
+    meshlet.coneCutoff = 1.0f;
+    if (normals.empty() || glm::length(axis) <= FLT_EPSILON)
+        return;
+
+    meshlet.coneAxis = glm::normalize(axis);
+    f32 minDot = 1.0f;
+    for (const glm::vec3& normal : normals)
+        minDot = glm::min(minDot, glm::dot(meshlet.coneAxis, normal));
+
+    // Cones wider than a hemisphere always have some triangle facing the camera
+    if (minDot > 0.0f)
+        meshlet.coneCutoff = glm::sqrt(1.0f - minDot * minDot);
+}
+
+// Triangles around every vertex, adjacency[offsets[v]] to adjacency[offsets[v + 1] - 1]
+void BuildTriangleAdjacency(const std::vector<u32>& indices, u32 vertexCount, std::vector<u32>& offsets, std::vector<u32>& adjacency)
+{
+    offsets.assign(vertexCount + 1u, 0u);
+    for (u32 index : indices)
+        ++offsets[index + 1u];
+    for (u32 v = 0; v < vertexCount; ++v)
+        offsets[v + 1u] += offsets[v];
+
+    adjacency.resize(indices.size());
+    std::vector<u32> fill(offsets.begin(), offsets.end() - 1);
+    for (u32 i = 0; i < indices.size(); ++i)
+        adjacency[fill[indices[i]]++] = i / 3u;
+}
+
+std::vector<Meshlet> BuildMeshlets(const std::vector<glm::vec3>& positions, std::vector<u32>& indices)
+{
+    std::vector<Meshlet> meshlets;
+    u32 triangleCount = indices.size() / 3u;
+    if (triangleCount == 0u)
+        return meshlets;
+
+    std::vector<u32> adjacencyOffsets, adjacency;
+    BuildTriangleAdjacency(indices, positions.size(), adjacencyOffsets, adjacency);
+
+    std::vector<u8> triangleUsed(triangleCount, 0u);
+    std::vector<u32> vertexMeshlet(positions.size(), UINT32_MAX); // Last meshlet that took the vertex
+    std::vector<u32> meshletVertices;
+    std::vector<u32> reordered;
+    reordered.reserve(indices.size());
+
+    u32 nextSeed = 0u;
+    while (true)
+    {
+        while (nextSeed < triangleCount && triangleUsed[nextSeed])
+            ++nextSeed;
+        if (nextSeed == triangleCount)
+            break;
+
+        Meshlet meshlet = {};
+        meshlet.firstIndex = reordered.size();
+        u32 meshletIdx = meshlets.size();
+        meshletVertices.clear();
+
+        u32 triangle = nextSeed;
+        while (triangle != UINT32_MAX)
+        {
+            triangleUsed[triangle] = 1u;
+            for (u32 k = 0; k < 3; ++k)
+            {
+                u32 v = indices[triangle * 3u + k];
+                reordered.push_back(v);
+                if (vertexMeshlet[v] != meshletIdx)
+                {
+                    vertexMeshlet[v] = meshletIdx;
+                    meshletVertices.push_back(v);
+                }
+            }
+            ++meshlet.triangleCount;
+
+            if (meshlet.triangleCount == MESHLET_MAX_TRIANGLES)
+                break;
+
+            // Neighbour adding the fewest new vertices, the lowest index on ties keeps the cache order
+            triangle = UINT32_MAX;
+            u32 bestNewVertices = 4u;
+            for (u32 v : meshletVertices)
+            {
+                for (u32 a = adjacencyOffsets[v]; a < adjacencyOffsets[v + 1u]; ++a)
+                {
+                    u32 candidate = adjacency[a];
+                    if (triangleUsed[candidate])
+                        continue;
+
+                    u32 newVertices = 0u;
+                    for (u32 k = 0; k < 3; ++k)
+                        if (vertexMeshlet[indices[candidate * 3u + k]] != meshletIdx)
+                            ++newVertices;
+
+                    if (newVertices < bestNewVertices || (newVertices == bestNewVertices && candidate < triangle))
+                    {
+                        bestNewVertices = newVertices;
+                        triangle = candidate;
+                    }
+                }
+            }
+
+            if (triangle != UINT32_MAX && meshletVertices.size() + bestNewVertices > MESHLET_MAX_VERTICES)
+                triangle = UINT32_MAX;
+        }
+
+        meshlet.vertexCount = meshletVertices.size();
+        meshlets.push_back(meshlet);
+    }
+
+    indices.swap(reordered);
+
+    for (Meshlet& meshlet : meshlets)
+        ComputeMeshletBounds(meshlet, positions, indices);
+
+    return meshlets;
+}
+
+// Symmetric 4x4 matrix, the sum of the squared distances to a set of planes
+struct Quadric
+{
+    f64 a00, a01, a02, a03;
+    f64 a11, a12, a13;
+    f64 a22, a23;
+    f64 a33;
+};
+
+Quadric MakePlaneQuadric(const glm::dvec3& normal, f64 distance)
+{
+    return { normal.x * normal.x, normal.x * normal.y, normal.x * normal.z, normal.x * distance,
+             normal.y * normal.y, normal.y * normal.z, normal.y * distance,
+             normal.z * normal.z, normal.z * distance,
+             distance * distance };
+}
+
+void AddQuadric(Quadric& q, const Quadric& other)
+{
+    q.a00 += other.a00; q.a01 += other.a01; q.a02 += other.a02; q.a03 += other.a03;
+    q.a11 += other.a11; q.a12 += other.a12; q.a13 += other.a13;
+    q.a22 += other.a22; q.a23 += other.a23;
+    q.a33 += other.a33;
+}
+
+f64 EvaluateQuadric(const Quadric& q, const glm::vec3& p)
+{
+    f64 x = p.x, y = p.y, z = p.z;
+    f64 result = q.a00 * x * x + q.a11 * y * y + q.a22 * z * z + q.a33
+        + 2.0 * (q.a01 * x * y + q.a02 * x * z + q.a12 * y * z + q.a03 * x + q.a13 * y + q.a23 * z);
+    return glm::max(result, 0.0);
+}
+
+struct Collapse
+{
+    u32 from;
+    u32 to;
+    f64 cost;
+};
+
+std::vector<u32> SimplifyMesh(const std::vector<glm::vec3>& positions, const std::vector<u32>& indices, u32 targetIndexCount, f32& error)
+{
+    std::vector<u32> result = indices;
+    error = 0.0f;
+
+    // Edges used by a single triangle are open borders, their vertices never move
+    std::vector<u8> locked(positions.size(), 0u);
+    {
+        std::vector<u64> edges;
+        edges.reserve(result.size());
+        for (u32 i = 0; i < result.size(); ++i)
+        {
+            u32 a = result[i];
+            u32 b = result[i - i % 3u + (i + 1u) % 3u];
+            edges.push_back(((u64)glm::min(a, b) << 32) | glm::max(a, b));
+        }
+        std::sort(edges.begin(), edges.end());
+
+        for (u32 i = 0; i < edges.size();)
+        {
+            u32 j = i;
+            while (j < edges.size() && edges[j] == edges[i])
+                ++j;
+            if (j - i == 1u)
+            {
+                locked[edges[i] >> 32] = 1u;
+                locked[edges[i] & 0xffffffffu] = 1u;
+            }
+            i = j;
+        }
+    }
+
+    std::vector<Quadric> quadrics(positions.size(), Quadric{});
+    for (u32 i = 0; i + 2 < result.size(); i += 3)
+    {
+        glm::dvec3 a = positions[result[i]];
+        glm::dvec3 normal = glm::cross(glm::dvec3(positions[result[i + 1]]) - a, glm::dvec3(positions[result[i + 2]]) - a);
+        f64 length = glm::length(normal);
+        if (length <= 0.0)
+            continue;
+
+        normal /= length;
+        Quadric plane = MakePlaneQuadric(normal, -glm::dot(normal, a));
+        for (u32 k = 0; k < 3; ++k)
+            AddQuadric(quadrics[result[i + k]], plane);
+    }
+
+    std::vector<u32> remap(positions.size());
+    std::vector<u8> touched(positions.size());
+    std::vector<u32> adjacencyOffsets(positions.size() + 1u);
+    std::vector<u32> adjacency;
+    std::vector<Collapse> collapses;
+
+    // Every pass collapses the cheapest edges whose neighbourhoods don't overlap
+    while (result.size() > targetIndexCount)
+    {
+        collapses.clear();
+        for (u32 i = 0; i < result.size(); ++i)
+        {
+            u32 a = result[i];
+            u32 b = result[i - i % 3u + (i + 1u) % 3u];
+            Quadric q = quadrics[a];
+            AddQuadric(q, quadrics[b]);
+            if (!locked[a])
+                collapses.push_back({ a, b, EvaluateQuadric(q, positions[b]) });
+            if (!locked[b])
+                collapses.push_back({ b, a, EvaluateQuadric(q, positions[a]) });
+        }
+        if (collapses.empty())
+            break;
+
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse& l, const Collapse& r) { return l.cost < r.cost; });
+
+        std::fill(adjacencyOffsets.begin(), adjacencyOffsets.end(), 0u);
+        for (u32 index : result)
+            ++adjacencyOffsets[index + 1u];
+        for (u32 v = 0; v < positions.size(); ++v)
+            adjacencyOffsets[v + 1u] += adjacencyOffsets[v];
+        adjacency.resize(result.size());
+        std::vector<u32> adjacencyFill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+        for (u32 i = 0; i < result.size(); ++i)
+            adjacency[adjacencyFill[result[i]]++] = i / 3u;
+
+        for (u32 v = 0; v < positions.size(); ++v)
+            remap[v] = v;
+        std::fill(touched.begin(), touched.end(), 0u);
+
+        u32 triangleCount = result.size() / 3u;
+        u32 targetTriangles = targetIndexCount / 3u;
+        u32 collapsed = 0u;
+        for (const Collapse& collapse : collapses)
+        {
+            if (touched[collapse.from] || touched[collapse.to])
+                continue;
+
+            // Moving the vertex must not turn any of its other triangles over
+            bool flips = false;
+            u32 removedTriangles = 0u;
+            for (u32 a = adjacencyOffsets[collapse.from]; a < adjacencyOffsets[collapse.from + 1u] && !flips; ++a)
+            {
+                const u32* triangle = &result[adjacency[a] * 3u];
+                if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to)
+                {
+                    ++removedTriangles;
+                    continue;
+                }
+
+                glm::vec3 before[3];
+                glm::vec3 after[3];
+                for (u32 k = 0; k < 3; ++k)
+                {
+                    before[k] = positions[triangle[k]];
+                    after[k] = triangle[k] == collapse.from ? positions[collapse.to] : before[k];
+                }
+                glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+                glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+                flips = glm::dot(normalBefore, normalAfter) <= 0.0f;
+            }
+            if (flips)
+                continue;
+
+            remap[collapse.from] = collapse.to;
+            AddQuadric(quadrics[collapse.to], quadrics[collapse.from]);
+            error = glm::max(error, (f32)glm::sqrt(collapse.cost));
+
+            // Triangles around the collapse changed, their vertices wait for the next pass
+            for (u32 a = adjacencyOffsets[collapse.from]; a < adjacencyOffsets[collapse.from + 1u]; ++a)
+                for (u32 k = 0; k < 3; ++k)
+                    touched[result[adjacency[a] * 3u + k]] = 1u;
+
+            ++collapsed;
+            triangleCount -= glm::min(removedTriangles, triangleCount);
+            if (triangleCount <= targetTriangles)
+                break;
+        }
+        if (collapsed == 0u)
+            break;
+
+        // Triangles with two corners merged are gone
+        u32 write = 0u;
+        for (u32 i = 0; i + 2 < result.size(); i += 3)
+        {
+            u32 a = remap[result[i]];
+            u32 b = remap[result[i + 1]];
+            u32 c = remap[result[i + 2]];
+            if (a == b || b == c || a == c)
+                continue;
+
+            result[write++] = a;
+            result[write++] = b;
+            result[write++] = c;
+        }
+        result.resize(write);
+    }
+
+    return result;
+}
+
+std::vector<u32> OptimizeVertexCache(const std::vector<u32>& indices, u32 vertexCount)
+{
+    u32 triangleCount = indices.size() / 3u;
+
+    std::vector<u32> adjacencyOffsets, adjacency;
+    BuildTriangleAdjacency(indices, vertexCount, adjacencyOffsets, adjacency);
+
+    // Triangles not emitted yet around every vertex
+    std::vector<u32> liveTriangles(vertexCount);
+    for (u32 v = 0; v < vertexCount; ++v)
+        liveTriangles[v] = adjacencyOffsets[v + 1u] - adjacencyOffsets[v];
+
+    std::vector<u32> cacheTimestamps(vertexCount, 0u);
+    u32 time = VERTEX_CACHE_SIZE + 1u;
+
+    std::vector<u8> emitted(triangleCount, 0u);
+    std::vector<u32> deadEndStack;
+    std::vector<u32> candidates;
+    std::vector<u32> result;
+    result.reserve(indices.size());
+
+    u32 cursor = 0u; // Next vertex in input order, when the stack runs dry too
+    u32 fanning = UINT32_MAX;
+    while (cursor < vertexCount && fanning == UINT32_MAX)
+        if (liveTriangles[cursor++] > 0u)
+            fanning = cursor - 1u;
+
+    while (fanning != UINT32_MAX)
+    {
+        candidates.clear();
+        for (u32 a = adjacencyOffsets[fanning]; a < adjacencyOffsets[fanning + 1u]; ++a)
+        {
+            u32 triangle = adjacency[a];
+            if (emitted[triangle])
+                continue;
+
+            for (u32 k = 0; k < 3; ++k)
+            {
+                u32 v = indices[triangle * 3u + k];
+                result.push_back(v);
+                deadEndStack.push_back(v);
+                candidates.push_back(v);
+                --liveTriangles[v];
+                if (time - cacheTimestamps[v] > VERTEX_CACHE_SIZE)
+                    cacheTimestamps[v] = time++;
+            }
+            emitted[triangle] = 1u;
+        }
+
+        // Oldest candidate still in the cache once its remaining fan is emitted, else any live one
+        fanning = UINT32_MAX;
+        i32 bestPriority = -1;
+        for (u32 v : candidates)
+        {
+            if (liveTriangles[v] == 0u)
+                continue;
+
+            i32 priority = 0;
+            if (time - cacheTimestamps[v] + 2u * liveTriangles[v] <= VERTEX_CACHE_SIZE)
+                priority = time - cacheTimestamps[v];
+            if (priority > bestPriority)
+            {
+                bestPriority = priority;
+                fanning = v;
+            }
+        }
+
+        // Dead end: recently used vertices first, then the input order
+        while (fanning == UINT32_MAX && !deadEndStack.empty())
+        {
+            u32 v = deadEndStack.back();
+            deadEndStack.pop_back();
+            if (liveTriangles[v] > 0u)
+                fanning = v;
+        }
+        while (fanning == UINT32_MAX && cursor < vertexCount)
+            if (liveTriangles[cursor++] > 0u)
+                fanning = cursor - 1u;
+    }
+
+    return result;
+}
+
+glm::vec3 ComputeMeshCenter(const std::vector<glm::vec3>& positions, const std::vector<u32>& indices)
+{
+    glm::vec3 meshCenter = glm::vec3(0.0f);
+    for (u32 index : indices)
+        meshCenter += positions[index];
+    return meshCenter / (f32)indices.size();
+}
+
+// Occlusion potential: how far out of the mesh center the triangles face
+f32 ComputeOcclusionPotential(const std::vector<glm::vec3>& positions, const std::vector<u32>& indices, u32 firstTriangle, u32 triangleCount, const glm::vec3& meshCenter)
+{
+    glm::vec3 center = glm::vec3(0.0f);
+    glm::vec3 normal = glm::vec3(0.0f);
+    f32 area = 0.0f;
+    for (u32 t = firstTriangle; t < firstTriangle + triangleCount; ++t)
+    {
+        const glm::vec3& a = positions[indices[t * 3u]];
+        const glm::vec3& b = positions[indices[t * 3u + 1u]];
+        const glm::vec3& c = positions[indices[t * 3u + 2u]];
+        glm::vec3 weightedNormal = glm::cross(b - a, c - a);
+        f32 triangleArea = glm::length(weightedNormal);
+
+        center += (a + b + c) * (triangleArea / 3.0f);
+        normal += weightedNormal;
+        area += triangleArea;
+    }
+
+    if (area > 0.0f && glm::dot(normal, normal) > 0.0f)
+        return glm::dot(center / area - meshCenter, glm::normalize(normal));
+    return 0.0f;
+}
+
+void OptimizeOverdraw(const std::vector<glm::vec3>& positions, std::vector<u32>& indices)
+{
+    u32 triangleCount = indices.size() / 3u;
+    if (triangleCount == 0u)
+        return;
+
+    f32 acmr = ComputeAcmr(indices, positions.size());
+
+    // A cluster ends once its own miss ratio, counted from an empty cache, is within the threshold
+    std::vector<u32> clusterStarts;
+    std::vector<u32> cacheTimestamps(positions.size(), 0u);
+    u32 time = VERTEX_CACHE_SIZE + 1u;
+    u32 clusterMisses = 0u;
+    u32 clusterStart = 0u;
+    for (u32 t = 0; t < triangleCount; ++t)
+    {
+        if (t == clusterStart)
+        {
+            clusterStarts.push_back(t);
+            time += VERTEX_CACHE_SIZE + 1u;
+            clusterMisses = 0u;
+        }
+
+        for (u32 k = 0; k < 3; ++k)
+        {
+            u32 v = indices[t * 3u + k];
+            if (time - cacheTimestamps[v] > VERTEX_CACHE_SIZE)
+            {
+                cacheTimestamps[v] = time++;
+                ++clusterMisses;
+            }
+        }
+
+        if ((f32)clusterMisses / (t + 1u - clusterStart) <= acmr * OVERDRAW_ACMR_THRESHOLD)
+            clusterStart = t + 1u;
+    }
+    clusterStarts.push_back(triangleCount);
+
+    glm::vec3 meshCenter = ComputeMeshCenter(positions, indices);
+
+    struct Cluster
+    {
+        u32 firstTriangle;
+        u32 triangleCount;
+        f32 potential;
+    };
+    std::vector<Cluster> clusters;
+    for (u32 i = 0; i + 1u < clusterStarts.size(); ++i)
+    {
+        Cluster cluster = { clusterStarts[i], clusterStarts[i + 1u] - clusterStarts[i], 0.0f };
+        cluster.potential = ComputeOcclusionPotential(positions, indices, cluster.firstTriangle, cluster.triangleCount, meshCenter);
+        clusters.push_back(cluster);
+    }
+
+    std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) { return a.potential > b.potential; });
+
+    std::vector<u32> sorted;
+    sorted.reserve(indices.size());
+    for (const Cluster& cluster : clusters)
+        sorted.insert(sorted.end(), indices.begin() + cluster.firstTriangle * 3u, indices.begin() + (cluster.firstTriangle + cluster.triangleCount) * 3u);
+    indices.swap(sorted);
+}
+
+void OptimizeMeshletOverdraw(const std::vector<glm::vec3>& positions, std::vector<u32>& indices, std::vector<Meshlet>& meshlets)
+{
+    if (meshlets.empty())
+        return;
+
+    glm::vec3 meshCenter = ComputeMeshCenter(positions, indices);
+    std::vector<f32> potentials(meshlets.size());
+    for (u32 i = 0; i < meshlets.size(); ++i)
+        potentials[i] = ComputeOcclusionPotential(positions, indices, meshlets[i].firstIndex / 3u, meshlets[i].triangleCount, meshCenter);
+
+    std::vector<u32> order(meshlets.size());
+    for (u32 i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&potentials](u32 a, u32 b) { return potentials[a] > potentials[b]; });
+
+    // Whole meshlets move, so their triangles keep the order they were grown in
+    std::vector<u32> sorted;
+    sorted.reserve(indices.size());
+    std::vector<Meshlet> sortedMeshlets;
+    sortedMeshlets.reserve(meshlets.size());
+    for (u32 i : order)
+    {
+        Meshlet meshlet = meshlets[i];
+        std::vector<u32>::const_iterator first = indices.begin() + meshlet.firstIndex;
+        meshlet.firstIndex = sorted.size();
+        sorted.insert(sorted.end(), first, first + meshlet.triangleCount * 3u);
+        sortedMeshlets.push_back(meshlet);
+    }
+    indices.swap(sorted);
+    meshlets.swap(sortedMeshlets);
+}
+
+std::vector<u32> OptimizeVertexFetch(std::vector<u32>& indices, u32 vertexCount)
+{
+    std::vector<u32> remap(vertexCount, UINT32_MAX);
+    u32 next = 0u;
+    for (u32& index : indices)
+    {
+        if (remap[index] == UINT32_MAX)
+            remap[index] = next++;
+        index = remap[index];
+    }
+
+    for (u32& newIndex : remap)
+        if (newIndex == UINT32_MAX)
+            newIndex = next++;
+
+    return remap;
+}
+
+f32 ComputeAcmr(const std::vector<u32>& indices, u32 vertexCount)
+{
+    if (indices.empty())
+        return 0.0f;
+
+    std::vector<u32> cacheTimestamps(vertexCount, 0u);
+    u32 time = VERTEX_CACHE_SIZE + 1u;
+    u32 misses = 0u;
+    for (u32 index : indices)
+        if (time - cacheTimestamps[index] > VERTEX_CACHE_SIZE)
+        {
+            cacheTimestamps[index] = time++;
+            ++misses;
+        }
+
+    return (f32)misses / (indices.size() / 3u);
+}
+
+f32 ComputeOverdraw(const std::vector<glm::vec3>& positions, const std::vector<u32>& indices)
+{
+    const i32 resolution = 256;
+
+    glm::vec3 boundsMin = glm::vec3(FLT_MAX);
+    glm::vec3 boundsMax = glm::vec3(-FLT_MAX);
+    for (u32 index : indices)
+    {
+        boundsMin = glm::min(boundsMin, positions[index]);
+        boundsMax = glm::max(boundsMax, positions[index]);
+    }
+    glm::vec3 extent = boundsMax - boundsMin;
+    f32 scale = (resolution - 1) / glm::max(glm::max(extent.x, glm::max(extent.y, extent.z)), FLT_EPSILON);
+    glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+
+    std::vector<glm::vec3> screen(positions.size());
+    std::vector<f32> depthBuffer(resolution * resolution);
+    u64 shadedFragments = 0u;
+    u64 coveredPixels = 0u;
+
+    for (u32 view = 0; view < 6; ++view)
+    {
+        // Camera on the side of the axis it looks from, right x up points towards it
+        glm::vec3 toCamera = glm::vec3(0.0f);
+        toCamera[view / 2u] = view % 2u == 0u ? 1.0f : -1.0f;
+        glm::vec3 up = view / 2u == 1u ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        glm::vec3 right = glm::cross(up, toCamera);
+
+        // Pixels around the center of the bounds, depth grows away from the camera
+        for (u32 v = 0; v < positions.size(); ++v)
+        {
+            glm::vec3 p = positions[v] - center;
+            screen[v] = glm::vec3(glm::dot(p, right) * scale + resolution * 0.5f, glm::dot(p, up) * scale + resolution * 0.5f, -glm::dot(p, toCamera));
+        }
+
+        std::fill(depthBuffer.begin(), depthBuffer.end(), FLT_MAX);
+
+        for (u32 i = 0; i + 2u < indices.size(); i += 3)
+        {
+            const glm::vec3& a = screen[indices[i]];
+            const glm::vec3& b = screen[indices[i + 1u]];
+            const glm::vec3& c = screen[indices[i + 2u]];
+
+            f32 area = (b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y);
+            if (area <= 0.0f)
+                continue;
+
+            i32 minX = glm::max((i32)glm::min(a.x, glm::min(b.x, c.x)), 0);
+            i32 maxX = glm::min((i32)glm::max(a.x, glm::max(b.x, c.x)), resolution - 1);
+            i32 minY = glm::max((i32)glm::min(a.y, glm::min(b.y, c.y)), 0);
+            i32 maxY = glm::min((i32)glm::max(a.y, glm::max(b.y, c.y)), resolution - 1);
+
+            for (i32 y = minY; y <= maxY; ++y)
+                for (i32 x = minX; x <= maxX; ++x)
+                {
+                    f32 px = x + 0.5f;
+                    f32 py = y + 0.5f;
+                    f32 wa = (c.x - b.x) * (py - b.y) - (c.y - b.y) * (px - b.x);
+                    f32 wb = (a.x - c.x) * (py - c.y) - (a.y - c.y) * (px - c.x);
+                    f32 wc = area - wa - wb;
+                    if (wa < 0.0f || wb < 0.0f || wc < 0.0f)
+                        continue;
+
+                    f32 depth = (wa * a.z + wb * b.z + wc * c.z) / area;
+                    f32& stored = depthBuffer[y * resolution + x];
+                    if (depth >= stored)
+                        continue;
+
+                    if (stored == FLT_MAX)
+                        ++coveredPixels;
+                    stored = depth;
+                    ++shadedFragments;
+                }
+        }
+    }
+
+    return coveredPixels > 0u ? (f32)shadedFragments / coveredPixels : 0.0f;
+}
+
+bool IsMeshletBackFacing(const Meshlet& meshlet, const glm::vec3& cameraPosition, bool mirrored)
+{
+    // A mirroring transform reverses the winding glCullFace sees, so the other side is the back
+    glm::vec3 coneAxis = mirrored ? -meshlet.coneAxis : meshlet.coneAxis;
+
+    // The sphere keeps it conservative for every point of the meshlet, not only its center
+    glm::vec3 toCenter = meshlet.center - cameraPosition;
+    return glm::dot(toCenter, coneAxis) >= meshlet.coneCutoff * glm::length(toCenter) + meshlet.radius;
+}
+
+void ExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6])
+{
+    glm::vec4 row0 = glm::vec4(viewProjection[0][0], viewProjection[1][0], viewProjection[2][0], viewProjection[3][0]);
+    glm::vec4 row1 = glm::vec4(viewProjection[0][1], viewProjection[1][1], viewProjection[2][1], viewProjection[3][1]);
+    glm::vec4 row2 = glm::vec4(viewProjection[0][2], viewProjection[1][2], viewProjection[2][2], viewProjection[3][2]);
+    glm::vec4 row3 = glm::vec4(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+
+    planes[0] = row3 + row0; // Left
+    planes[1] = row3 - row0; // Right
+    planes[2] = row3 + row1; // Bottom
+    planes[3] = row3 - row1; // Top
+    planes[4] = row3 + row2; // Near
+    planes[5] = row3 - row2; // Far
+
+    for (u32 i = 0; i < 6; ++i)
+        planes[i] /= glm::length(glm::vec3(planes[i]));
+}
+
+bool IsSphereInFrustum(const glm::vec4 planes[6], const glm::vec3& center, f32 radius)
+{
+    for (u32 i = 0; i < 6; ++i)
+        if (glm::dot(glm::vec3(planes[i]), center) + planes[i].w < -radius)
+            return false;
+    return true;
+}
@@ -0,0 +1,103 @@
+//
+// geometry.h: Mesh processing done once at load time on plain position and index lists,
+// plus the bounding volume tests used to cull its results.
+//
+
+#pragma once
+
+#include "platform.h"
+
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+// Submeshes with fewer triangles are always drawn whole
+#define MESHLET_MIN_SUBMESH_TRIANGLES (4 * MESHLET_MAX_TRIANGLES)
+
+// Levels of detail per submesh, the full detail one included
+#define LOD_MAX_LEVELS 4
+
+// Triangles kept by every level compared to the previous one
+#define LOD_REDUCTION 0.5f
+
+// FIFO post-transform cache the triangle orders are tuned for and measured with
+#define VERTEX_CACHE_SIZE 16
+
+// Largest cache miss ratio the overdraw order may cost, relative to the vertex cache order
+#define OVERDRAW_ACMR_THRESHOLD 1.05f
+
+// Contiguous range of triangles inside the index list of its submesh
+struct Meshlet
+{
+    u32 firstIndex;
+    u32 triangleCount;
+    u32 vertexCount;
+
+    glm::vec3 center; // Bounding sphere
+    f32 radius;
+
+    glm::vec3 coneAxis; // Average facing of the triangles
+    f32 coneCutoff; // Sine of the normal cone half angle, 1 when it can't be back-face culled
+};
+
+/**
+ * Splits a triangle list into meshlets of at most MESHLET_MAX_VERTICES vertices and MESHLET_MAX_TRIANGLES
+ * triangles, growing each one through the triangles that share vertices with it. The indices are
+ * reordered so every meshlet is a contiguous range.
+ */
+std::vector<Meshlet> BuildMeshlets(const std::vector<glm::vec3>& positions, std::vector<u32>& indices);
+
+/**
+ * Quadric error metric simplification by half edge collapses, so the result indexes the same vertices.
+ * Vertices on open borders are locked, which includes the UV and normal seams split by the importer.
+ * Stops at targetIndexCount or when nothing else can collapse, error receives the largest collapse
+ * error as a distance in mesh units.
+ */
+std::vector<u32> SimplifyMesh(const std::vector<glm::vec3>& positions, const std::vector<u32>& indices, u32 targetIndexCount, f32& error);
+
+/**
+ * Tipsify triangle order for a VERTEX_CACHE_SIZE FIFO cache: fans around the vertices in the cache,
+ * preferring the ones that will stay there while their remaining triangles are emitted.
+ */
+std::vector<u32> OptimizeVertexCache(const std::vector<u32>& indices, u32 vertexCount);
+
+/**
+ * Splits a cache optimized triangle list into clusters where the cache can be restarted within
+ * OVERDRAW_ACMR_THRESHOLD, and sorts them so the ones facing out of the mesh are drawn first.
+ */
+void OptimizeOverdraw(const std::vector<glm::vec3>& positions, std::vector<u32>& indices);
+
+/**
+ * Same sort as OptimizeOverdraw with the meshlets as the clusters, so the indices stay one contiguous
+ * range per meshlet. The meshlets are reordered with their ranges.
+ */
+void OptimizeMeshletOverdraw(const std::vector<glm::vec3>& positions, std::vector<u32>& indices, std::vector<Meshlet>& meshlets);
+
+/**
+ * Renumbers the vertices in the order the indices first reference them, unused vertices last, and
+ * rewrites the indices. Returns the new index of every old vertex, to move the vertex data with.
+ */
+std::vector<u32> OptimizeVertexFetch(std::vector<u32>& indices, u32 vertexCount);
+
+/**
+ * Average cache misses per triangle (ACMR) of the list in a VERTEX_CACHE_SIZE FIFO cache.
+ */
+f32 ComputeAcmr(const std::vector<u32>& indices, u32 vertexCount);
+
+/**
+ * Fragments shaded per covered pixel when the list is drawn in order with back-face culling and an
+ * early depth test, averaged over orthographic views along the six axis directions.
+ */
+f32 ComputeOverdraw(const std::vector<glm::vec3>& positions, const std::vector<u32>& indices);
+
+/**
+ * True when every triangle of the meshlet faces away from the camera, both in the space of the mesh.
+ * Mirrored is set when the world matrix has a negative determinant, which flips the facing.
+ */
+bool IsMeshletBackFacing(const Meshlet& meshlet, const glm::vec3& cameraPosition, bool mirrored);
+
+/**
+ * Planes of the frustum pointing inwards, as ax + by + cz + d >= 0 for the points inside.
+ */
+void ExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6]);
+
+bool IsSphereInFrustum(const glm::vec4 planes[6], const glm::vec3& center, f32 radius);
@@ -0,0 +1,249 @@
+//
+// glstate.cpp: Redundant state filtering in front of the OpenGL calls issued while rendering.
+//
+
+#include "glstate.h"
+
+const GLenum glCapabilityNames[GL_CAPABILITY_COUNT] = { GL_BLEND, GL_DEPTH_TEST, GL_CULL_FACE, GL_STENCIL_TEST };
+
+// Counts the call and records the new value, false when the call can be dropped
+bool ChangeCachedValue(GLStateCache& cache, u32& current, u32 value)
+{
+    if (current == value)
+    {
+        ++cache.droppedCalls;
+        return false;
+    }
+
+    current = value;
+    ++cache.issuedCalls;
+    return true;
+}
+
+bool ChangeCachedBufferRange(GLStateCache& cache, GLBufferRange& current, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    if (current.buffer == buffer && current.offset == offset && current.size == size)
+    {
+        ++cache.droppedCalls;
+        return false;
+    }
+
+    current = { buffer, offset, size };
+    ++cache.issuedCalls;
+    return true;
+}
+
+void ResetGLStateCache(GLStateCache& cache)
+{
+    cache.program = GL_STATE_UNKNOWN;
+    cache.vertexArray = GL_STATE_UNKNOWN;
+    cache.elementArrayBuffer = GL_STATE_UNKNOWN;
+    cache.readFramebuffer = GL_STATE_UNKNOWN;
+    cache.drawFramebuffer = GL_STATE_UNKNOWN;
+
+    cache.activeTexture = GL_STATE_UNKNOWN;
+    for (u32 i = 0; i < GL_STATE_TEXTURE_UNITS; ++i)
+        cache.textures[i] = GL_STATE_UNKNOWN;
+
+    for (u32 i = 0; i < GL_STATE_BUFFER_BINDINGS; ++i)
+    {
+        cache.uniformBuffers[i] = { GL_STATE_UNKNOWN, 0, 0 };
+        cache.storageBuffers[i] = { GL_STATE_UNKNOWN, 0, 0 };
+    }
+
+    for (u32 i = 0; i < GL_CAPABILITY_COUNT; ++i)
+        cache.capabilities[i] = GL_STATE_UNKNOWN;
+    cache.depthFunc = GL_STATE_UNKNOWN;
+    cache.depthMask = GL_STATE_UNKNOWN;
+    cache.cullFace = GL_STATE_UNKNOWN;
+    cache.blendSource = GL_STATE_UNKNOWN;
+    cache.blendDestination = GL_STATE_UNKNOWN;
+    cache.colorMask = GL_STATE_UNKNOWN;
+    cache.stencilFunc = GL_STATE_UNKNOWN;
+    cache.stencilRef = 0;
+    cache.stencilMask = 0u;
+    for (u32 i = 0; i < 2; ++i)
+        cache.stencilOps[i] = { GL_STATE_UNKNOWN, GL_STATE_UNKNOWN, GL_STATE_UNKNOWN };
+
+    cache.issuedCalls = 0u;
+    cache.droppedCalls = 0u;
+}
+
+void SetProgram(GLStateCache& cache, GLuint program)
+{
+    if (ChangeCachedValue(cache, cache.program, program))
+        glUseProgram(program);
+}
+
+void SetVertexArray(GLStateCache& cache, GLuint vertexArray)
+{
+    if (!ChangeCachedValue(cache, cache.vertexArray, vertexArray))
+        return;
+
+    glBindVertexArray(vertexArray);
+    cache.elementArrayBuffer = GL_STATE_UNKNOWN;
+}
+
+void SetElementArrayBuffer(GLStateCache& cache, GLuint buffer)
+{
+    if (ChangeCachedValue(cache, cache.elementArrayBuffer, buffer))
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+}
+
+void SetFramebuffer(GLStateCache& cache, GLenum target, GLuint framebuffer)
+{
+    if (target == GL_FRAMEBUFFER)
+    {
+        if (cache.readFramebuffer == framebuffer && cache.drawFramebuffer == framebuffer)
+        {
+            ++cache.droppedCalls;
+            return;
+        }
+
+        cache.readFramebuffer = framebuffer;
+        cache.drawFramebuffer = framebuffer;
+        ++cache.issuedCalls;
+        glBindFramebuffer(target, framebuffer);
+        return;
+    }
+
+    assert(target == GL_READ_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER);
+    if (ChangeCachedValue(cache, target == GL_READ_FRAMEBUFFER ? cache.readFramebuffer : cache.drawFramebuffer, framebuffer))
+        glBindFramebuffer(target, framebuffer);
+}
+
+void SetTexture(GLStateCache& cache, u32 unit, GLuint texture)
+{
+    if (unit >= GL_STATE_TEXTURE_UNITS)
+    {
+        // Leaves the active texture unknown, as the unit switch went around the cache
+        cache.activeTexture = GL_STATE_UNKNOWN;
+        cache.issuedCalls += 2u;
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        return;
+    }
+
+    if (!ChangeCachedValue(cache, cache.textures[unit], texture))
+        return;
+
+    if (ChangeCachedValue(cache, cache.activeTexture, GL_TEXTURE0 + unit))
+        glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, texture);
+}
+
+void SetUniformBufferRange(GLStateCache& cache, u32 index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    if (index < GL_STATE_BUFFER_BINDINGS && !ChangeCachedBufferRange(cache, cache.uniformBuffers[index], buffer, offset, size))
+        return;
+
+    if (index >= GL_STATE_BUFFER_BINDINGS)
+        ++cache.issuedCalls;
+    glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer, offset, size);
+}
+
+void SetStorageBuffer(GLStateCache& cache, u32 index, GLuint buffer)
+{
+    if (index < GL_STATE_BUFFER_BINDINGS && !ChangeCachedBufferRange(cache, cache.storageBuffers[index], buffer, 0, -1))
+        return;
+
+    if (index >= GL_STATE_BUFFER_BINDINGS)
+        ++cache.issuedCalls;
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, buffer);
+}
+
+void SetCapability(GLStateCache& cache, GLCapability capability, bool enabled)
+{
+    if (!ChangeCachedValue(cache, cache.capabilities[capability], enabled ? 1u : 0u))
+        return;
+
+    if (enabled)
+        glEnable(glCapabilityNames[capability]);
+    else
+        glDisable(glCapabilityNames[capability]);
+}
+
+void SetDepthFunc(GLStateCache& cache, GLenum func)
+{
+    if (ChangeCachedValue(cache, cache.depthFunc, func))
+        glDepthFunc(func);
+}
+
+void SetDepthMask(GLStateCache& cache, bool enabled)
+{
+    if (ChangeCachedValue(cache, cache.depthMask, enabled ? 1u : 0u))
+        glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+}
+
+void SetCullFace(GLStateCache& cache, GLenum mode)
+{
+    if (ChangeCachedValue(cache, cache.cullFace, mode))
+        glCullFace(mode);
+}
+
+void SetBlendFunc(GLStateCache& cache, GLenum source, GLenum destination)
+{
+    if (cache.blendSource == source && cache.blendDestination == destination)
+    {
+        ++cache.droppedCalls;
+        return;
+    }
+
+    cache.blendSource = source;
+    cache.blendDestination = destination;
+    ++cache.issuedCalls;
+    glBlendFunc(source, destination);
+}
+
+void SetColorMask(GLStateCache& cache, bool enabled)
+{
+    if (!ChangeCachedValue(cache, cache.colorMask, enabled ? 1u : 0u))
+        return;
+
+    GLboolean channel = enabled ? GL_TRUE : GL_FALSE;
+    glColorMask(channel, channel, channel, channel);
+}
+
+void SetStencilFunc(GLStateCache& cache, GLenum func, GLint ref, GLuint mask)
+{
+    if (cache.stencilFunc == func && cache.stencilRef == ref && cache.stencilMask == mask)
+    {
+        ++cache.droppedCalls;
+        return;
+    }
+
+    cache.stencilFunc = func;
+    cache.stencilRef = ref;
+    cache.stencilMask = mask;
+    ++cache.issuedCalls;
+    glStencilFunc(func, ref, mask);
+}
+
+void SetStencilOp(GLStateCache& cache, GLenum face, GLenum stencilFail, GLenum depthFail, GLenum depthPass)
+{
+    assert(face == GL_FRONT || face == GL_BACK || face == GL_FRONT_AND_BACK);
+    const GLStencilOps ops = { stencilFail, depthFail, depthPass };
+
+    // Only the faces whose operations change are set, both at once when both do
+    bool changed[2];
+    for (u32 i = 0; i < 2; ++i)
+    {
+        const GLStencilOps& current = cache.stencilOps[i];
+        bool affected = face == GL_FRONT_AND_BACK || face == (i == 0 ? GL_FRONT : GL_BACK);
+        changed[i] = affected && (current.stencilFail != stencilFail || current.depthFail != depthFail || current.depthPass != depthPass);
+        if (changed[i])
+            cache.stencilOps[i] = ops;
+    }
+
+    if (!changed[0] && !changed[1])
+    {
+        ++cache.droppedCalls;
+        return;
+    }
+
+    ++cache.issuedCalls;
+    if (changed[0] && changed[1])
+        glStencilOp(stencilFail, depthFail, depthPass);
+    else
+        glStencilOpSeparate(changed[0] ? GL_FRONT : GL_BACK, stencilFail, depthFail, depthPass);
+}
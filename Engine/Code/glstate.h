@@ -0,0 +1,104 @@
+//
+// glstate.h: Shadow copy of the OpenGL bindings and fixed function state the frame changes, so calls
+// that would set what is already set are dropped before reaching the driver. Vertex buffer, image and
+// copy or indirect buffer bindings are not shadowed and always reach the driver.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+
+// Texture units and indexed buffer bindings shadowed, higher ones always reach the driver
+#define GL_STATE_TEXTURE_UNITS 8
+#define GL_STATE_BUFFER_BINDINGS 8
+
+// Value of the shadowed state nothing has been cached for yet
+#define GL_STATE_UNKNOWN UINT32_MAX
+
+enum GLCapability
+{
+    GL_CAPABILITY_BLEND,
+    GL_CAPABILITY_DEPTH_TEST,
+    GL_CAPABILITY_CULL_FACE,
+    GL_CAPABILITY_STENCIL_TEST,
+    GL_CAPABILITY_COUNT
+};
+
+struct GLBufferRange
+{
+    GLuint buffer;
+    GLintptr offset;
+    GLsizeiptr size; // -1 for the whole buffer, as bound by glBindBufferBase
+};
+
+// Stencil test outcomes of one face, as given to glStencilOp
+struct GLStencilOps
+{
+    GLenum stencilFail;
+    GLenum depthFail;
+    GLenum depthPass;
+};
+
+struct GLStateCache
+{
+    GLuint program;
+    GLuint vertexArray;
+    GLuint elementArrayBuffer; // Of vertexArray, unknown again whenever it changes
+    GLuint readFramebuffer;
+    GLuint drawFramebuffer;
+
+    GLenum activeTexture;
+    GLuint textures[GL_STATE_TEXTURE_UNITS]; // GL_TEXTURE_2D of every unit
+
+    GLBufferRange uniformBuffers[GL_STATE_BUFFER_BINDINGS];
+    GLBufferRange storageBuffers[GL_STATE_BUFFER_BINDINGS];
+
+    u32 capabilities[GL_CAPABILITY_COUNT];
+    GLenum depthFunc;
+    u32 depthMask;
+    GLenum cullFace;
+    GLenum blendSource;
+    GLenum blendDestination;
+    u32 colorMask; // All the channels together, the frame never masks them one by one
+    GLenum stencilFunc;
+    GLint stencilRef;
+    GLuint stencilMask;
+    GLStencilOps stencilOps[2]; // Front and back faces
+
+    // Since the last ResetGLStateCache
+    u32 issuedCalls;
+    u32 droppedCalls;
+};
+
+/**
+ * Forgets the shadowed state, so the next call of every kind reaches the driver. Needed whenever code
+ * outside the cache may have changed the state, like ImGui between frames or the load time passes.
+ */
+void ResetGLStateCache(GLStateCache& cache);
+
+void SetProgram(GLStateCache& cache, GLuint program);
+void SetVertexArray(GLStateCache& cache, GLuint vertexArray);
+
+// Index buffer of the bound vertex array, which owns the binding
+void SetElementArrayBuffer(GLStateCache& cache, GLuint buffer);
+
+// GL_FRAMEBUFFER sets both the read and the draw framebuffer
+void SetFramebuffer(GLStateCache& cache, GLenum target, GLuint framebuffer);
+
+// Binds a GL_TEXTURE_2D to the unit, switching the active texture only when the binding changes
+void SetTexture(GLStateCache& cache, u32 unit, GLuint texture);
+
+void SetUniformBufferRange(GLStateCache& cache, u32 index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+void SetStorageBuffer(GLStateCache& cache, u32 index, GLuint buffer);
+
+void SetCapability(GLStateCache& cache, GLCapability capability, bool enabled);
+void SetDepthFunc(GLStateCache& cache, GLenum func);
+void SetDepthMask(GLStateCache& cache, bool enabled);
+void SetCullFace(GLStateCache& cache, GLenum mode);
+void SetBlendFunc(GLStateCache& cache, GLenum source, GLenum destination);
+void SetColorMask(GLStateCache& cache, bool enabled);
+void SetStencilFunc(GLStateCache& cache, GLenum func, GLint ref, GLuint mask);
+
+// GL_FRONT, GL_BACK or GL_FRONT_AND_BACK, as glStencilOpSeparate
+void SetStencilOp(GLStateCache& cache, GLenum face, GLenum stencilFail, GLenum depthFail, GLenum depthPass);
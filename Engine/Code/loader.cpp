@@ -6,7 +6,32 @@
 #include <stb_image.h>
 #include <stb_image_write.h>
 
-GLuint CreateProgramFromSource(String programSource, const char* shaderName)
+#define CONE_MAP_MAX_SIZE 256
+#define CONE_MAP_SEARCH_RADIUS 16
+
+// Bump it whenever the mesh cache layout or the processing stored in it changes
+#define MESH_CACHE_VERSION 2u
+#define MESH_CACHE_MAGIC 0x4843534du // "MSCH"
+
+// Every word in defines becomes its own #define line
+std::string BuildVariantDefines(const char* defines)
+{
+    std::string variantDefines;
+    for (const char* c = defines; *c != '\0';)
+    {
+        while (*c == ' ')
+            ++c;
+        const char* end = c;
+        while (*end != ' ' && *end != '\0')
+            ++end;
+        if (end != c)
+            variantDefines += "#define " + std::string(c, end - c) + "\n";
+        c = end;
+    }
+    return variantDefines;
+}
+
+GLuint CreateProgramFromSource(String programSource, const char* shaderName, const char* defines)
 {
     GLchar  infoLogBuffer[1024] = {};
     GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
@@ -19,27 +44,33 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
     char vertexShaderDefine[] = "#define VERTEX\n";
     char fragmentShaderDefine[] = "#define FRAGMENT\n";
 
+    std::string variantDefines = BuildVariantDefines(defines);
+
     const GLchar* vertexShaderSource[] = {
         versionString,
         shaderNameDefine,
+        variantDefines.c_str(),
         vertexShaderDefine,
         programSource.str
     };
     const GLint vertexShaderLengths[] = {
         (GLint)strlen(versionString),
         (GLint)strlen(shaderNameDefine),
+        (GLint)variantDefines.size(),
         (GLint)strlen(vertexShaderDefine),
         (GLint)programSource.len
     };
     const GLchar* fragmentShaderSource[] = {
         versionString,
         shaderNameDefine,
+        variantDefines.c_str(),
         fragmentShaderDefine,
         programSource.str
     };
     const GLint fragmentShaderLengths[] = {
         (GLint)strlen(versionString),
         (GLint)strlen(shaderNameDefine),
+        (GLint)variantDefines.size(),
         (GLint)strlen(fragmentShaderDefine),
         (GLint)programSource.len
     };
@@ -85,15 +116,78 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
     return programHandle;
 }
 
+GLuint CreateComputeProgramFromSource(String programSource, const char* shaderName, const char* defines)
+{
+    GLchar  infoLogBuffer[1024] = {};
+    GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
+    GLsizei infoLogSize;
+    GLint   success;
+
+    char versionString[] = "#version 430\n";
+    char shaderNameDefine[128];
+    sprintf(shaderNameDefine, "#define %s\n", shaderName);
+    char computeShaderDefine[] = "#define COMPUTE\n";
+
+    std::string variantDefines = BuildVariantDefines(defines);
+
+    const GLchar* computeShaderSource[] = {
+        versionString,
+        shaderNameDefine,
+        variantDefines.c_str(),
+        computeShaderDefine,
+        programSource.str
+    };
+    const GLint computeShaderLengths[] = {
+        (GLint)strlen(versionString),
+        (GLint)strlen(shaderNameDefine),
+        (GLint)variantDefines.size(),
+        (GLint)strlen(computeShaderDefine),
+        (GLint)programSource.len
+    };
+
+    GLuint cshader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(cshader, ARRAY_COUNT(computeShaderSource), computeShaderSource, computeShaderLengths);
+    glCompileShader(cshader);
+    glGetShaderiv(cshader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(cshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glCompileShader() failed with compute shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+    }
+
+    GLuint programHandle = glCreateProgram();
+    glAttachShader(programHandle, cshader);
+    glLinkProgram(programHandle);
+    glGetProgramiv(programHandle, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+    }
+
+    glDetachShader(programHandle, cshader);
+    glDeleteShader(cshader);
+
+    return programHandle;
+}
+
 u32 LoadProgram(App* app, const char* filepath, const char* programName)
+{
+    return LoadProgramVariant(app, filepath, programName, "");
+}
+
+u32 LoadProgramVariant(App* app, const char* filepath, const char* programName, const char* defines)
 {
     String programSource = ReadTextFile(filepath);
 
     Program program = {};
-    program.handle = CreateProgramFromSource(programSource, programName);
+    program.handle = CreateProgramFromSource(programSource, programName, defines);
     program.filepath = filepath;
     program.programName = programName;
+    program.defines = defines;
     program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
+    program.entityIdxLocation = glGetUniformLocation(program.handle, "uEntityIdx");
+    program.lightIdxLocation = glGetUniformLocation(program.handle, "uLightIdx");
 
     GLint attribCount = 0;
     glGetProgramiv(program.handle, GL_ACTIVE_ATTRIBUTES, &attribCount);
@@ -108,13 +202,32 @@ u32 LoadProgram(App* app, const char* filepath, const char* programName)
         glGetActiveAttrib(program.handle, i, ARRAY_COUNT(name), &nameLenght, &size, &type, name);
 
         GLint location = glGetAttribLocation(program.handle, name);
+        if (location < 0) // Built-in inputs like gl_VertexID
+            continue;
+
         program.vetexInputLayout.attributes.push_back({ (u8)location,(u8)size });
+        program.inputLocationMask |= 1u << location;
     }
 
     app->programs.push_back(program);
     return app->programs.size() - 1;
 }
 
+u32 LoadComputeProgram(App* app, const char* filepath, const char* programName, const char* defines)
+{
+    String programSource = ReadTextFile(filepath);
+
+    Program program = {};
+    program.handle = CreateComputeProgramFromSource(programSource, programName, defines);
+    program.filepath = filepath;
+    program.programName = programName;
+    program.defines = defines;
+    program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
+
+    app->programs.push_back(program);
+    return app->programs.size() - 1;
+}
+
 Image LoadImage(const char* filename)
 {
     Image img = {};
@@ -144,6 +257,8 @@ GLuint CreateTexture2DFromImage(Image image)
 
     switch (image.nchannels)
     {
+    case 1: dataFormat = GL_RED; internalFormat = GL_R8; break;
+    case 2: dataFormat = GL_RG; internalFormat = GL_RG8; break;
     case 3: dataFormat = GL_RGB; internalFormat = GL_RGB8; break;
     case 4: dataFormat = GL_RGBA; internalFormat = GL_RGBA8; break;
     default: ELOG("LoadTexture2D() - Unsupported number of channels");
@@ -152,7 +267,9 @@ GLuint CreateTexture2DFromImage(Image image)
     GLuint texHandle;
     glGenTextures(1, &texHandle);
     glBindTexture(GL_TEXTURE_2D, texHandle);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // stb rows are tightly packed
     glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.size.x, image.size.y, 0, dataFormat, dataType, image.pixels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -190,15 +307,177 @@ u32 LoadTexture2D(App* app, const char* filepath)
     }
 }
 
+bool IsCacheCurrent(const char* cacheFilepath, const char* sourceFilepath)
+{
+    // A timestamp of 0 is a missing file
+    u64 cacheTimestamp = GetFileLastWriteTimestamp(cacheFilepath);
+    return cacheTimestamp != 0u && cacheTimestamp >= GetFileLastWriteTimestamp(sourceFilepath);
+}
+
+bool WriteFlippedPng(const char* filepath, const glm::ivec2& size, u32 channels, const u8* pixels)
+{
+    // Images are flipped when loaded
+    const u32 rowSize = size.x * channels;
+    std::vector<u8> flipped(rowSize * size.y);
+    for (i32 y = 0; y < size.y; ++y)
+        memcpy(flipped.data() + y * rowSize, pixels + (size.y - 1 - y) * rowSize, rowSize);
+
+    return stbi_write_png(filepath, size.x, size.y, channels, flipped.data(), rowSize) != 0;
+}
+
+void WriteTexture2D(GLuint handle, const glm::ivec2& size, const char* filepath)
+{
+    std::vector<u8> pixels(size.x * size.y * 4);
+    glBindTexture(GL_TEXTURE_2D, handle);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    if (!WriteFlippedPng(filepath, size, 4, pixels.data()))
+        ELOG("Could not write texture %s", filepath);
+}
+
+struct ConeMapJob
+{
+    const f32* depths; // 0 at the top of the surface, 1 at the bottom
+    u8* pixels;
+    glm::ivec2 size;
+    f32 maxRatio;
+};
+
+void ComputeConeMapRows(const ConeMapJob& job, i32 firstRow, i32 lastRow)
+{
+    const glm::ivec2 size = job.size;
+    const glm::vec2 texelSize = 1.0f / glm::vec2(size);
+
+    for (i32 y = firstRow; y < lastRow; ++y)
+    {
+        for (i32 x = 0; x < size.x; ++x)
+        {
+            f32 srcDepth = job.depths[y * size.x + x];
+            f32 bestRatio = job.maxRatio;
+
+            // A ray entering at the top of the source texel through every destination surface point
+            // must leave the surface again outside of the cone, so it is crossed at most once inside.
+            for (i32 dy = -CONE_MAP_SEARCH_RADIUS; dy <= CONE_MAP_SEARCH_RADIUS; ++dy)
+            {
+                for (i32 dx = -CONE_MAP_SEARCH_RADIUS; dx <= CONE_MAP_SEARCH_RADIUS; ++dx)
+                {
+                    i32 dstX = x + dx;
+                    i32 dstY = y + dy;
+                    if ((dx == 0 && dy == 0) || dstX < 0 || dstY < 0 || dstX >= size.x || dstY >= size.y)
+                        continue;
+
+                    // Rays through deeper points stay below the source texel
+                    f32 dstDepth = job.depths[dstY * size.x + dstX];
+                    if (dstDepth >= srcDepth)
+                        continue;
+
+                    // March one texel at a time from the destination until the ray is above the surface again
+                    i32 steps = glm::max(abs(dx), abs(dy));
+                    glm::vec3 step = glm::vec3((f32)dx, (f32)dy, dstDepth) / (f32)steps;
+                    glm::vec3 pos = glm::vec3((f32)dstX, (f32)dstY, dstDepth);
+
+                    while (true)
+                    {
+                        pos += step;
+
+                        i32 px = (i32)(pos.x + 0.5f);
+                        i32 py = (i32)(pos.y + 0.5f);
+                        if (pos.z >= srcDepth || px < 0 || py < 0 || px >= size.x || py >= size.y)
+                            break;
+
+                        // Further points only give wider cones
+                        f32 ratio = glm::length((glm::vec2(pos) - glm::vec2((f32)x, (f32)y)) * texelSize) / (srcDepth - pos.z);
+                        if (ratio >= bestRatio)
+                            break;
+
+                        if (job.depths[py * size.x + px] > pos.z)
+                        {
+                            bestRatio = ratio;
+                            break;
+                        }
+                    }
+                }
+            }
+
+            u8* pixel = job.pixels + (y * size.x + x) * 2;
+            pixel[0] = (u8)(srcDepth * 255.0f + 0.5f);
+            pixel[1] = (u8)(sqrtf(glm::min(bestRatio, 1.0f)) * 255.0f + 0.5f);
+        }
+    }
+}
+
+u32 LoadConeMap(App* app, const char* heightmapFilepath)
+{
+    std::string filepath = heightmapFilepath;
+    std::string coneFilepath = filepath.substr(0, filepath.find_last_of('.')) + "_cone.png";
+
+    if (IsCacheCurrent(coneFilepath.c_str(), heightmapFilepath))
+        return LoadTexture2D(app, coneFilepath.c_str());
+
+    Image heightmap = LoadImage(heightmapFilepath);
+    if (!heightmap.pixels)
+        return 0u; // Same as a material without cone map
+
+    // The search is quadratic in the resolution, so the cones are computed on a reduced height map
+    // keeping the highest point of each block
+    glm::ivec2 size = glm::min(heightmap.size, glm::ivec2(CONE_MAP_MAX_SIZE));
+    glm::ivec2 blockSize = heightmap.size / size;
+
+    std::vector<f32> depths(size.x * size.y);
+    for (i32 y = 0; y < size.y; ++y)
+        for (i32 x = 0; x < size.x; ++x)
+        {
+            u8 maxHeight = 0u;
+            for (i32 by = 0; by < blockSize.y; ++by)
+                for (i32 bx = 0; bx < blockSize.x; ++bx)
+                {
+                    u8* pixel = (u8*)heightmap.pixels + (y * blockSize.y + by) * heightmap.stride + (x * blockSize.x + bx) * heightmap.nchannels;
+                    maxHeight = glm::max(maxHeight, pixel[0]);
+                }
+            depths[y * size.x + x] = 1.0f - maxHeight / 255.0f;
+        }
+    FreeImage(heightmap);
+
+    ConeMapJob job = {};
+    job.depths = depths.data();
+    job.size = size;
+    // Cones are not allowed to reach outside the search window
+    job.maxRatio = (f32)CONE_MAP_SEARCH_RADIUS / (f32)glm::max(size.x, size.y);
+
+    std::vector<u8> pixels(size.x * size.y * 2);
+    job.pixels = pixels.data();
+
+    // Rows cost the same, a few of them per job keeps every thread busy until the end
+    ParallelFor(size.y, 4u, [&job](u32 firstRow, u32 lastRow)
+    {
+        ComputeConeMapRows(job, firstRow, lastRow);
+    });
+
+    // Flipped back so the cache reloads the same way
+    if (!WriteFlippedPng(coneFilepath.c_str(), size, 2, pixels.data()))
+        ELOG("Could not write cone map cache %s", coneFilepath.c_str());
+
+    Image image = {};
+    image.pixels = pixels.data();
+    image.size = size;
+    image.nchannels = 2;
+    image.stride = size.x * 2;
+
+    Texture tex = {};
+    tex.handle = CreateTexture2DFromImage(image);
+    tex.filepath = coneFilepath;
+
+    app->textures.push_back(tex);
+    return app->textures.size() - 1u;
+}
+
 void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices)
 {
     std::vector<float> vertices;
     std::vector<u32> indices;
 
-    bool hasTexCoords = false;
-    bool hasTangentSpace = false;
-
-    // process vertices
+    // process vertices, missing attributes are zeroed so every mesh has the SurfaceSourceVertex layout
     for (unsigned int i = 0; i < mesh->mNumVertices; i++)
     {
         vertices.push_back(mesh->mVertices[i].x);
@@ -210,14 +489,14 @@ void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 bas
 
         if (mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
         {
-            hasTexCoords = true;
             vertices.push_back(mesh->mTextureCoords[0][i].x);
             vertices.push_back(mesh->mTextureCoords[0][i].y);
         }
+        else
+            vertices.insert(vertices.end(), { 0.0f, 0.0f });
 
         if (mesh->mTangents && mesh->mBitangents)
         {
-            hasTangentSpace = true;
             vertices.push_back(mesh->mTangents[i].x);
             vertices.push_back(mesh->mTangents[i].y);
             vertices.push_back(mesh->mTangents[i].z);
@@ -234,6 +513,8 @@ void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 bas
             vertices.push_back(-mesh->mBitangents[i].y);
             vertices.push_back(-mesh->mBitangents[i].z);
         }
+        else
+            vertices.insert(vertices.end(), { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f });
     }
 
     // process indices
@@ -249,31 +530,226 @@ void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 bas
     // store the proper (previously proceessed) material for this mesh
     submeshMaterialIndices.push_back(baseMeshMaterialIndex + mesh->mMaterialIndex);
 
-    // create the vertex format
-    VertexBufferLayout vertexBufferLayout = {};
-    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0 });
-    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 1, 3, 3 * sizeof(float) });
-    vertexBufferLayout.stride = 6 * sizeof(float);
-    if (hasTexCoords)
+    // add the submesh into the mesh
+    Submesh submesh = {};
+    submesh.vertexBufferLayout = SurfaceSourceVertex::MakeBufferLayout();
+    submesh.vertices.swap(vertices);
+    submesh.indices.swap(indices);
+    myMesh->submeshes.push_back(submesh);
+}
+
+bool ReadMeshCache(const char* cacheFilepath, Mesh& mesh)
+{
+    FILE* file = fopen(cacheFilepath, "rb");
+    if (!file)
+        return false;
+
+    // Everything is validated before touching the mesh, a stale cache is just rebuilt
+    bool valid = true;
+    u32 header[3] = {};
+    MeshOptimizationStats stats;
+    valid = fread(header, sizeof(header), 1, file) == 1 && header[0] == MESH_CACHE_MAGIC && header[1] == MESH_CACHE_VERSION && header[2] == mesh.submeshes.size()
+        && fread(&stats, sizeof(stats), 1, file) == 1;
+
+    std::vector<std::vector<u32>> indices(mesh.submeshes.size());
+    std::vector<std::vector<u32>> lodIndices(mesh.submeshes.size());
+    std::vector<std::vector<SubmeshLod>> lods(mesh.submeshes.size());
+    std::vector<std::vector<Meshlet>> meshlets(mesh.submeshes.size());
+    for (u32 i = 0; i < mesh.submeshes.size() && valid; ++i)
+    {
+        const Submesh& submesh = mesh.submeshes[i];
+        u32 counts[5] = {};
+        valid = fread(counts, sizeof(counts), 1, file) == 1 && counts[0] == submesh.vertices.size() && counts[1] == submesh.indices.size() && counts[2] < LOD_MAX_LEVELS;
+        if (!valid)
+            break;
+
+        indices[i].resize(counts[1]);
+        lods[i].resize(counts[2]);
+        lodIndices[i].resize(counts[3]);
+        meshlets[i].resize(counts[4]);
+        valid = (counts[1] == 0u || fread(indices[i].data(), sizeof(u32), counts[1], file) == counts[1])
+            && (counts[2] == 0u || fread(lods[i].data(), sizeof(SubmeshLod), counts[2], file) == counts[2])
+            && (counts[3] == 0u || fread(lodIndices[i].data(), sizeof(u32), counts[3], file) == counts[3])
+            && (counts[4] == 0u || fread(meshlets[i].data(), sizeof(Meshlet), counts[4], file) == counts[4]);
+
+        // Every index must reference the vertices and every range must stay inside its index list
+        u32 vertexCount = GetSubmeshVertexCount(submesh);
+        for (u32 j = 0; j < indices[i].size() && valid; ++j)
+            valid = indices[i][j] < vertexCount;
+        for (u32 j = 0; j < lodIndices[i].size() && valid; ++j)
+            valid = lodIndices[i][j] < vertexCount;
+        for (u32 j = 0; j < lods[i].size() && valid; ++j)
+            valid = (u64)lods[i][j].firstIndex + lods[i][j].indexCount <= lodIndices[i].size();
+        for (u32 j = 0; j < meshlets[i].size() && valid; ++j)
+            valid = (u64)meshlets[i][j].firstIndex + meshlets[i][j].triangleCount * 3ull <= indices[i].size();
+    }
+    fclose(file);
+
+    if (!valid)
+        return false;
+
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
     {
-        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 2, 2, vertexBufferLayout.stride });
-        vertexBufferLayout.stride += 2 * sizeof(float);
+        mesh.submeshes[i].indices.swap(indices[i]);
+        mesh.submeshes[i].lods.swap(lods[i]);
+        mesh.submeshes[i].lodIndices.swap(lodIndices[i]);
+        mesh.submeshes[i].meshlets.swap(meshlets[i]);
     }
-    if (hasTangentSpace)
+    mesh.optimizationStats = stats;
+    return true;
+}
+
+void WriteMeshCache(const char* cacheFilepath, const Mesh& mesh)
+{
+    FILE* file = fopen(cacheFilepath, "wb");
+    if (!file)
     {
-        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 3, 3, vertexBufferLayout.stride });
-        vertexBufferLayout.stride += 3 * sizeof(float);
+        ELOG("Could not write mesh cache %s", cacheFilepath);
+        return;
+    }
 
-        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 4, 3, vertexBufferLayout.stride });
-        vertexBufferLayout.stride += 3 * sizeof(float);
+    u32 header[3] = { MESH_CACHE_MAGIC, MESH_CACHE_VERSION, (u32)mesh.submeshes.size() };
+    fwrite(header, sizeof(header), 1, file);
+    fwrite(&mesh.optimizationStats, sizeof(mesh.optimizationStats), 1, file);
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        u32 counts[5] = { (u32)submesh.vertices.size(), (u32)submesh.indices.size(), (u32)submesh.lods.size(), (u32)submesh.lodIndices.size(), (u32)submesh.meshlets.size() };
+        fwrite(counts, sizeof(counts), 1, file);
+        fwrite(submesh.indices.data(), sizeof(u32), submesh.indices.size(), file);
+        fwrite(submesh.lods.data(), sizeof(SubmeshLod), submesh.lods.size(), file);
+        fwrite(submesh.lodIndices.data(), sizeof(u32), submesh.lodIndices.size(), file);
+        fwrite(submesh.meshlets.data(), sizeof(Meshlet), submesh.meshlets.size(), file);
     }
+    fclose(file);
+}
 
-    // add the submesh into the mesh
-    Submesh submesh = {};
-    submesh.vertexBufferLayout = vertexBufferLayout;
-    submesh.vertices.swap(vertices);
-    submesh.indices.swap(indices);
-    myMesh->submeshes.push_back(submesh);
+void BuildSubmeshLods(Submesh& submesh)
+{
+    std::vector<glm::vec3> positions = GetSubmeshPositions(submesh);
+
+    u32 previousCount = submesh.indices.size();
+    f32 targetCount = (f32)submesh.indices.size();
+    for (u32 level = 1; level < LOD_MAX_LEVELS; ++level)
+    {
+        // Always from the full detail list, so the error is measured against the original surface
+        targetCount *= LOD_REDUCTION;
+        f32 error = 0.0f;
+        std::vector<u32> indices = SimplifyMesh(positions, submesh.indices, (u32)targetCount / 3u * 3u, error);
+
+        // Mostly locked borders, coarser levels would be the same
+        if (indices.size() > previousCount * 0.9f)
+            break;
+
+        submesh.lods.push_back({ (u32)submesh.lodIndices.size(), (u32)indices.size(), error });
+        submesh.lodIndices.insert(submesh.lodIndices.end(), indices.begin(), indices.end());
+        previousCount = indices.size();
+    }
+}
+
+void MeasureMesh(const Mesh& mesh, f32& acmr, f32& overdraw)
+{
+    acmr = 0.0f;
+    overdraw = 0.0f;
+
+    u32 triangleCount = 0u;
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        std::vector<glm::vec3> positions = GetSubmeshPositions(submesh);
+        u32 submeshTriangles = submesh.indices.size() / 3u;
+        acmr += ComputeAcmr(submesh.indices, positions.size()) * submeshTriangles;
+        overdraw += ComputeOverdraw(positions, submesh.indices) * submeshTriangles;
+        triangleCount += submeshTriangles;
+    }
+
+    if (triangleCount > 0u)
+    {
+        acmr /= triangleCount;
+        overdraw /= triangleCount;
+    }
+}
+
+/**
+ * Vertex cache and then overdraw triangle orders, the levels of detail are only ordered for the cache.
+ * Big submeshes are split into meshlets before the overdraw sort, which then moves whole meshlets.
+ */
+void OptimizeMeshTriangles(Mesh& mesh)
+{
+    MeasureMesh(mesh, mesh.optimizationStats.acmrBefore, mesh.optimizationStats.overdrawBefore);
+
+    for (Submesh& submesh : mesh.submeshes)
+    {
+        std::vector<glm::vec3> positions = GetSubmeshPositions(submesh);
+        submesh.indices = OptimizeVertexCache(submesh.indices, positions.size());
+
+        // Big submeshes are split so their back-facing and off-screen parts can be skipped
+        if (submesh.indices.size() / 3u >= MESHLET_MIN_SUBMESH_TRIANGLES)
+        {
+            submesh.meshlets = BuildMeshlets(positions, submesh.indices);
+            OptimizeMeshletOverdraw(positions, submesh.indices, submesh.meshlets);
+        }
+        else
+        {
+            OptimizeOverdraw(positions, submesh.indices);
+        }
+
+        for (const SubmeshLod& lod : submesh.lods)
+        {
+            std::vector<u32>::iterator first = submesh.lodIndices.begin() + lod.firstIndex;
+            std::vector<u32> lodIndices = OptimizeVertexCache(std::vector<u32>(first, first + lod.indexCount), positions.size());
+            std::copy(lodIndices.begin(), lodIndices.end(), first);
+        }
+    }
+
+    // On the order that is drawn, the vertex fetch order doesn't change either measure
+    MeasureMesh(mesh, mesh.optimizationStats.acmrAfter, mesh.optimizationStats.overdrawAfter);
+}
+
+/**
+ * Levels of detail, triangle orders and meshlets of every submesh, read from <model>.meshcache when it
+ * is newer than the model.
+ */
+void LoadMeshTriangles(Mesh& mesh, const char* filename)
+{
+    std::string cacheFilepath = std::string(filename) + ".meshcache";
+    bool cached = IsCacheCurrent(cacheFilepath.c_str(), filename) && ReadMeshCache(cacheFilepath.c_str(), mesh);
+    if (!cached)
+    {
+        // From the imported indices, so the error is measured against the original surface
+        for (Submesh& submesh : mesh.submeshes)
+            BuildSubmeshLods(submesh);
+        OptimizeMeshTriangles(mesh);
+        WriteMeshCache(cacheFilepath.c_str(), mesh);
+    }
+
+    u32 levelCount = 1u;
+    for (const Submesh& submesh : mesh.submeshes)
+        levelCount = glm::max(levelCount, (u32)submesh.lods.size() + 1u);
+
+    // Submeshes with fewer levels keep drawing their coarsest one
+    mesh.lodErrors.assign(levelCount, 0.0f);
+    for (u32 level = 1; level < levelCount; ++level)
+        for (const Submesh& submesh : mesh.submeshes)
+            if (!submesh.lods.empty())
+                mesh.lodErrors[level] = glm::max(mesh.lodErrors[level], submesh.lods[glm::min(level, (u32)submesh.lods.size()) - 1u].error);
+}
+
+/**
+ * Vertices in the order the final full detail indices fetch them, the levels of detail are remapped.
+ */
+void OptimizeMeshVertices(Mesh& mesh)
+{
+    for (Submesh& submesh : mesh.submeshes)
+    {
+        const u32 stride = submesh.vertexBufferLayout.stride / sizeof(float);
+        std::vector<u32> remap = OptimizeVertexFetch(submesh.indices, GetSubmeshVertexCount(submesh));
+        for (u32& index : submesh.lodIndices)
+            index = remap[index];
+
+        std::vector<float> vertices(submesh.vertices.size());
+        for (u32 v = 0; v < remap.size(); ++v)
+            std::copy(submesh.vertices.begin() + v * stride, submesh.vertices.begin() + (v + 1u) * stride, vertices.begin() + remap[v] * stride);
+        submesh.vertices.swap(vertices);
+    }
 }
 
 void ProcessAssimpMaterial(App* app, aiMaterial* material, Material& myMaterial, String directory)
@@ -392,43 +868,11 @@ u32 LoadModel(App* app, const char* filename)
 
     aiReleaseImport(scene);
 
-    u32 vertexBufferSize = 0;
-    u32 indexBufferSize = 0;
-
-    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-    {
-        vertexBufferSize += mesh.submeshes[i].vertices.size() * sizeof(float);
-        indexBufferSize += mesh.submeshes[i].indices.size() * sizeof(u32);
-    }
-
-    glGenBuffers(1, &mesh.vertexBufferHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
-
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
-
-    u32 indicesOffset = 0;
-    u32 verticesOffset = 0;
-
-    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-    {
-        const void* verticesData = mesh.submeshes[i].vertices.data();
-        const u32   verticesSize = mesh.submeshes[i].vertices.size() * sizeof(float);
-        glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-        mesh.submeshes[i].vertexOffset = verticesOffset;
-        verticesOffset += verticesSize;
-
-        const void* indicesData = mesh.submeshes[i].indices.data();
-        const u32   indicesSize = mesh.submeshes[i].indices.size() * sizeof(u32);
-        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-        mesh.submeshes[i].indexOffset = indicesOffset;
-        indicesOffset += indicesSize;
-    }
+    LoadMeshTriangles(mesh, filename);
+    OptimizeMeshVertices(mesh);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    UploadMeshVertices(mesh, app->usePackedVertices ? VertexFormat::PACKED : VertexFormat::FLOAT);
+    UploadMeshIndices(mesh);
 
     return modelIdx;
 }
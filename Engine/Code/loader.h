@@ -3,10 +3,23 @@
 #include "engine.h"
 #include <assimp/scene.h>
 
-GLuint CreateProgramFromSource(String programSource, const char* shaderName);
+GLuint CreateProgramFromSource(String programSource, const char* shaderName, const char* defines);
 
 u32 LoadProgram(App* app, const char* filepath, const char* programName);
 
+/**
+ * Loads a program with extra preprocessor symbols (a space separated list) defined
+ * before the source, so the same shader block can be compiled in several variants.
+ */
+u32 LoadProgramVariant(App* app, const char* filepath, const char* programName, const char* defines);
+
+GLuint CreateComputeProgramFromSource(String programSource, const char* shaderName, const char* defines);
+
+/**
+ * Loads the COMPUTE stage of a shader block, defines work as in LoadProgramVariant.
+ */
+u32 LoadComputeProgram(App* app, const char* filepath, const char* programName, const char* defines);
+
 Image LoadImage(const char* filename);
 
 void FreeImage(Image image);
@@ -15,6 +28,29 @@ GLuint CreateTexture2DFromImage(Image image);
 
 u32 LoadTexture2D(App* app, const char* filepath);
 
+/**
+ * True when the cache file exists and was written after the source it was built from.
+ */
+bool IsCacheCurrent(const char* cacheFilepath, const char* sourceFilepath);
+
+/**
+ * Saves tightly packed 8-bit rows as a png, bottom row first, so LoadImage gives them back in the
+ * same order. The rows are flipped here instead of through the global stb write state.
+ */
+bool WriteFlippedPng(const char* filepath, const glm::ivec2& size, u32 channels, const u8* pixels);
+
+/**
+ * Reads an RGBA8 texture back and saves it as a png that LoadTexture2D loads the same way.
+ */
+void WriteTexture2D(GLuint handle, const glm::ivec2& size, const char* filepath);
+
+/**
+ * Builds a relaxed cone step map from a height map (R: depth, G: square root of the cone ratio)
+ * and caches it next to the source as <name>_cone.png. The cache is rebuilt when the height map
+ * is newer than it.
+ */
+u32 LoadConeMap(App* app, const char* heightmapFilepath);
+
 void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices);
 
 void ProcessAssimpMaterial(App* app, aiMaterial* material, Material& myMaterial, String directory);
@@ -0,0 +1,320 @@
+//
+// occlusion.cpp: Tile binned software depth rasterizer. The inner loop shades 4 pixels at
+// a time with SSE, which every x86 target the project builds for has.
+//
+
+#include "occlusion.h"
+
+#include <unordered_map>
+#include <xmmintrin.h>
+
+OccluderMesh BuildOccluderMesh(const std::vector<glm::vec3>& positions, const std::vector<u32>& indices, u32 gridResolution)
+{
+    OccluderMesh occluder;
+    if (positions.empty())
+        return occluder;
+
+    glm::vec3 boundsMin = glm::vec3(FLT_MAX);
+    glm::vec3 boundsMax = glm::vec3(-FLT_MAX);
+    for (const glm::vec3& position : positions)
+    {
+        boundsMin = glm::min(boundsMin, position);
+        boundsMax = glm::max(boundsMax, position);
+    }
+    glm::vec3 cellScale = f32(gridResolution) / glm::max(boundsMax - boundsMin, glm::vec3(FLT_EPSILON));
+
+    // Cell of every vertex and the accumulated position of every cell
+    std::unordered_map<u32, u32> cellVertex;
+    std::vector<u32> remap(positions.size());
+    std::vector<u32> cellCounts;
+    for (u32 i = 0; i < positions.size(); ++i)
+    {
+        glm::uvec3 cell = glm::min(glm::uvec3((positions[i] - boundsMin) * cellScale), glm::uvec3(gridResolution - 1u));
+        u32 cellIdx = (cell.z * gridResolution + cell.y) * gridResolution + cell.x;
+
+        auto it = cellVertex.find(cellIdx);
+        if (it == cellVertex.end())
+        {
+            it = cellVertex.emplace(cellIdx, (u32)occluder.positions.size()).first;
+            occluder.positions.push_back(glm::vec3(0.0f));
+            cellCounts.push_back(0u);
+        }
+
+        remap[i] = it->second;
+        occluder.positions[it->second] += positions[i];
+        ++cellCounts[it->second];
+    }
+
+    for (u32 i = 0; i < occluder.positions.size(); ++i)
+        occluder.positions[i] /= (f32)cellCounts[i];
+
+    // Triangles collapsed into a line or a point are dropped
+    for (u32 i = 0; i + 2 < indices.size(); i += 3)
+    {
+        u32 a = remap[indices[i]];
+        u32 b = remap[indices[i + 1]];
+        u32 c = remap[indices[i + 2]];
+        if (a == b || b == c || a == c)
+            continue;
+
+        occluder.indices.push_back(a);
+        occluder.indices.push_back(b);
+        occluder.indices.push_back(c);
+    }
+
+    return occluder;
+}
+
+void ClearOcclusionBuffer(OcclusionBuffer& buffer)
+{
+    buffer.depth.assign(OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT, 1.0f);
+    buffer.triangles.clear();
+    for (std::vector<u32>& bin : buffer.tileBins)
+        bin.clear();
+}
+
+void AddOccluder(OcclusionBuffer& buffer, const OccluderMesh& occluder, const glm::mat4& worldViewProjection)
+{
+    const glm::vec2 screenSize = glm::vec2(OCCLUSION_BUFFER_WIDTH, OCCLUSION_BUFFER_HEIGHT);
+
+    // Pixel x, y and depth, z is negative for vertices behind the near plane
+    std::vector<glm::vec3> screen(occluder.positions.size());
+    std::vector<bool> valid(occluder.positions.size());
+    for (u32 i = 0; i < occluder.positions.size(); ++i)
+    {
+        glm::vec4 clip = worldViewProjection * glm::vec4(occluder.positions[i], 1.0f);
+        valid[i] = clip.w > 0.0f && clip.z >= -clip.w;
+        if (valid[i])
+        {
+            glm::vec3 ndc = glm::vec3(clip) / clip.w;
+            screen[i] = glm::vec3((glm::vec2(ndc) * 0.5f + 0.5f) * screenSize, ndc.z * 0.5f + 0.5f);
+        }
+    }
+
+    for (u32 i = 0; i + 2 < occluder.indices.size(); i += 3)
+    {
+        u32 i0 = occluder.indices[i];
+        u32 i1 = occluder.indices[i + 1];
+        u32 i2 = occluder.indices[i + 2];
+        if (!valid[i0] || !valid[i1] || !valid[i2])
+            continue;
+
+        const glm::vec3& v0 = screen[i0];
+        const glm::vec3& v1 = screen[i1];
+        const glm::vec3& v2 = screen[i2];
+
+        // Counter clockwise front faces, as in the GL pipeline
+        f32 area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+        if (area <= 0.0f)
+            continue;
+
+        OcclusionTriangle triangle;
+        triangle.minX = glm::max((i32)floorf(glm::min(v0.x, glm::min(v1.x, v2.x))), 0);
+        triangle.minY = glm::max((i32)floorf(glm::min(v0.y, glm::min(v1.y, v2.y))), 0);
+        triangle.maxX = glm::min((i32)ceilf(glm::max(v0.x, glm::max(v1.x, v2.x))), OCCLUSION_BUFFER_WIDTH - 1);
+        triangle.maxY = glm::min((i32)ceilf(glm::max(v0.y, glm::max(v1.y, v2.y))), OCCLUSION_BUFFER_HEIGHT - 1);
+        if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+            continue;
+
+        const glm::vec3* v[3] = { &v0, &v1, &v2 };
+        for (u32 e = 0; e < 3; ++e)
+        {
+            const glm::vec3& a = *v[e];
+            const glm::vec3& b = *v[(e + 1) % 3];
+            triangle.edgeA[e] = a.y - b.y;
+            triangle.edgeB[e] = b.x - a.x;
+            triangle.edgeC[e] = a.x * b.y - a.y * b.x;
+        }
+
+        triangle.depthA = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+        triangle.depthB = ((v2.z - v0.z) * (v1.x - v0.x) - (v1.z - v0.z) * (v2.x - v0.x)) / area;
+        triangle.depthC = v0.z - triangle.depthA * v0.x - triangle.depthB * v0.y;
+
+        u32 triangleIdx = buffer.triangles.size();
+        buffer.triangles.push_back(triangle);
+
+        for (i32 ty = triangle.minY / OCCLUSION_TILE_HEIGHT; ty <= triangle.maxY / OCCLUSION_TILE_HEIGHT; ++ty)
+            for (i32 tx = triangle.minX / OCCLUSION_TILE_WIDTH; tx <= triangle.maxX / OCCLUSION_TILE_WIDTH; ++tx)
+                buffer.tileBins[ty * OCCLUSION_TILES_X + tx].push_back(triangleIdx);
+    }
+}
+
+void RasterizeTile(OcclusionBuffer& buffer, u32 tileIdx)
+{
+    const i32 tileMinX = (tileIdx % OCCLUSION_TILES_X) * OCCLUSION_TILE_WIDTH;
+    const i32 tileMinY = (tileIdx / OCCLUSION_TILES_X) * OCCLUSION_TILE_HEIGHT;
+    const i32 tileMaxX = tileMinX + OCCLUSION_TILE_WIDTH - 1;
+    const i32 tileMaxY = tileMinY + OCCLUSION_TILE_HEIGHT - 1;
+
+    for (u32 triangleIdx : buffer.tileBins[tileIdx])
+    {
+        const OcclusionTriangle& t = buffer.triangles[triangleIdx];
+
+        // Rows start 4 aligned so the vector loop never crosses the tile
+        i32 minX = glm::max(t.minX, tileMinX) & ~3;
+        i32 maxX = glm::min(t.maxX, tileMaxX);
+        i32 minY = glm::max(t.minY, tileMinY);
+        i32 maxY = glm::min(t.maxY, tileMaxY);
+
+        const __m128 laneOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        const __m128 zero = _mm_setzero_ps();
+
+        for (i32 y = minY; y <= maxY; ++y)
+        {
+            f32 py = (f32)y + 0.5f;
+            f32* row = buffer.depth.data() + y * OCCLUSION_BUFFER_WIDTH;
+
+            __m128 rowEdge[3];
+            for (u32 e = 0; e < 3; ++e)
+                rowEdge[e] = _mm_set1_ps(t.edgeB[e] * py + t.edgeC[e]);
+            __m128 rowDepth = _mm_set1_ps(t.depthB * py + t.depthC);
+
+            for (i32 x = minX; x <= maxX; x += 4)
+            {
+                __m128 px = _mm_add_ps(_mm_set1_ps((f32)x), laneOffsets);
+
+                __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.edgeA[0]), px), rowEdge[0]), zero);
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.edgeA[1]), px), rowEdge[1]), zero));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.edgeA[2]), px), rowEdge[2]), zero));
+                if (_mm_movemask_ps(inside) == 0)
+                    continue;
+
+                __m128 depth = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.depthA), px), rowDepth);
+                __m128 stored = _mm_loadu_ps(row + x);
+                __m128 nearest = _mm_min_ps(stored, depth);
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, stored)));
+            }
+        }
+    }
+}
+
+void RasterizeOccluders(OcclusionBuffer& buffer)
+{
+    // Tiles own disjoint pixels, so they can be rasterized in any order without locks
+    ParallelFor(OCCLUSION_TILES_X * OCCLUSION_TILES_Y, 1u, [&buffer](u32 begin, u32 end)
+    {
+        for (u32 tileIdx = begin; tileIdx < end; ++tileIdx)
+            RasterizeTile(buffer, tileIdx);
+    });
+}
+
+bool IsBoxVisible(const OcclusionBuffer& buffer, const glm::vec3& boxMin, const glm::vec3& boxMax, const glm::mat4& viewProjection)
+{
+    glm::vec3 ndcMin = glm::vec3(FLT_MAX);
+    glm::vec3 ndcMax = glm::vec3(-FLT_MAX);
+    for (u32 i = 0; i < 8; ++i)
+    {
+        glm::vec3 corner = glm::vec3(i & 1 ? boxMax.x : boxMin.x, i & 2 ? boxMax.y : boxMin.y, i & 4 ? boxMax.z : boxMin.z);
+        glm::vec4 clip = viewProjection * glm::vec4(corner, 1.0f);
+
+        // Boxes crossing the near plane can't be projected
+        if (clip.w <= 0.0f || clip.z < -clip.w)
+            return true;
+
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        ndcMin = glm::min(ndcMin, ndc);
+        ndcMax = glm::max(ndcMax, ndc);
+    }
+
+    if (ndcMax.x < -1.0f || ndcMax.y < -1.0f || ndcMin.x > 1.0f || ndcMin.y > 1.0f || ndcMin.z > 1.0f)
+        return false;
+
+    i32 minX = glm::max((i32)floorf((ndcMin.x * 0.5f + 0.5f) * OCCLUSION_BUFFER_WIDTH), 0);
+    i32 minY = glm::max((i32)floorf((ndcMin.y * 0.5f + 0.5f) * OCCLUSION_BUFFER_HEIGHT), 0);
+    i32 maxX = glm::min((i32)floorf((ndcMax.x * 0.5f + 0.5f) * OCCLUSION_BUFFER_WIDTH), OCCLUSION_BUFFER_WIDTH - 1);
+    i32 maxY = glm::min((i32)floorf((ndcMax.y * 0.5f + 0.5f) * OCCLUSION_BUFFER_HEIGHT), OCCLUSION_BUFFER_HEIGHT - 1);
+    f32 nearestDepth = ndcMin.z * 0.5f + 0.5f;
+
+    for (i32 y = minY; y <= maxY; ++y)
+        for (i32 x = minX; x <= maxX; ++x)
+            if (buffer.depth[y * OCCLUSION_BUFFER_WIDTH + x] >= nearestDepth)
+                return true;
+
+    return false;
+}
+
+// Fixed seed linear congruential generator, in [0, 1)
+f32 NextTestRandom(u32& state)
+{
+    state = state * 1664525u + 1013904223u;
+    return (f32)(state >> 8) / 16777216.0f;
+}
+
+// Per pixel rasterization of the binned triangles, over the same 4 aligned spans as RasterizeTile
+std::vector<f32> RasterizeReference(const OcclusionBuffer& buffer)
+{
+    std::vector<f32> depth(OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT, 1.0f);
+    for (const OcclusionTriangle& t : buffer.triangles)
+        for (i32 y = t.minY; y <= t.maxY; ++y)
+        {
+            f32 py = (f32)y + 0.5f;
+            for (i32 x = t.minX & ~3; x <= (t.maxX | 3); ++x)
+            {
+                f32 px = (f32)x + 0.5f;
+                if (t.edgeA[0] * px + (t.edgeB[0] * py + t.edgeC[0]) < 0.0f ||
+                    t.edgeA[1] * px + (t.edgeB[1] * py + t.edgeC[1]) < 0.0f ||
+                    t.edgeA[2] * px + (t.edgeB[2] * py + t.edgeC[2]) < 0.0f)
+                    continue;
+
+                f32& stored = depth[y * OCCLUSION_BUFFER_WIDTH + x];
+                stored = glm::min(stored, t.depthA * px + (t.depthB * py + t.depthC));
+            }
+        }
+    return depth;
+}
+
+u32 TestOcclusionBuffer()
+{
+    u32 failures = 0u;
+    OcclusionBuffer buffer;
+
+    // Random triangles straight in clip space
+    u32 state = 1u;
+    OccluderMesh random;
+    for (u32 i = 0; i < 600; ++i)
+    {
+        random.positions.push_back(glm::vec3(NextTestRandom(state), NextTestRandom(state), NextTestRandom(state)) * 2.2f - 1.1f);
+        random.indices.push_back(i);
+    }
+    ClearOcclusionBuffer(buffer);
+    AddOccluder(buffer, random, glm::mat4(1.0f));
+    RasterizeOccluders(buffer);
+
+    std::vector<f32> reference = RasterizeReference(buffer);
+    u32 mismatches = 0u;
+    for (u32 i = 0; i < reference.size(); ++i)
+        if (reference[i] != buffer.depth[i])
+            ++mismatches;
+    if (mismatches > 0u)
+    {
+        ELOG("Occlusion test: %u of %u pixels differ from the reference rasterizer", mismatches, (u32)reference.size());
+        ++failures;
+    }
+
+    // Wall at z = 0 seen from z = 5, boxes behind it are hidden and the others aren't
+    glm::mat4 viewProjection = glm::perspective(glm::radians(60.0f), (f32)OCCLUSION_BUFFER_WIDTH / OCCLUSION_BUFFER_HEIGHT, 0.1f, 100.0f) *
+        glm::lookAt(glm::vec3(0.0f, 0.0f, 5.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    OccluderMesh wall;
+    wall.positions = { glm::vec3(-2.0f, -2.0f, 0.0f), glm::vec3(2.0f, -2.0f, 0.0f), glm::vec3(2.0f, 2.0f, 0.0f), glm::vec3(-2.0f, 2.0f, 0.0f) };
+    wall.indices = { 0, 1, 2, 0, 2, 3 };
+    ClearOcclusionBuffer(buffer);
+    AddOccluder(buffer, wall, viewProjection);
+    RasterizeOccluders(buffer);
+
+    struct BoxCheck { const char* name; glm::vec3 boxMin; glm::vec3 boxMax; bool visible; };
+    const BoxCheck checks[] =
+    {
+        { "behind the wall", glm::vec3(-0.5f, -0.5f, -3.0f), glm::vec3(0.5f, 0.5f, -2.0f), false },
+        { "in front of the wall", glm::vec3(-0.5f, -0.5f, 2.0f), glm::vec3(0.5f, 0.5f, 3.0f), true },
+        { "crossing the wall", glm::vec3(-0.5f, -0.5f, -1.0f), glm::vec3(0.5f, 0.5f, 1.0f), true },
+        { "beside the wall", glm::vec3(6.0f, -0.5f, -3.0f), glm::vec3(7.0f, 0.5f, -2.0f), true },
+    };
+    for (const BoxCheck& check : checks)
+        if (IsBoxVisible(buffer, check.boxMin, check.boxMax, viewProjection) != check.visible)
+        {
+            ELOG("Occlusion test: box %s is %s", check.name, check.visible ? "hidden" : "visible");
+            ++failures;
+        }
+
+    return failures;
+}
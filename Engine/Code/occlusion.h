@@ -0,0 +1,72 @@
+//
+// occlusion.h: CPU depth-only rasterizer used to cull entities hidden behind simplified occluders.
+// It does not depend on OpenGL, so it also runs on machines without a GPU.
+//
+
+#pragma once
+
+#include "platform.h"
+
+#define OCCLUSION_BUFFER_WIDTH 320
+#define OCCLUSION_BUFFER_HEIGHT 192
+#define OCCLUSION_TILE_WIDTH 64
+#define OCCLUSION_TILE_HEIGHT 32
+#define OCCLUSION_TILES_X (OCCLUSION_BUFFER_WIDTH / OCCLUSION_TILE_WIDTH)
+#define OCCLUSION_TILES_Y (OCCLUSION_BUFFER_HEIGHT / OCCLUSION_TILE_HEIGHT)
+
+struct OccluderMesh
+{
+    std::vector<glm::vec3> positions;
+    std::vector<u32> indices;
+};
+
+// Screen space triangle ready to rasterize, inside where the three edge functions are positive
+struct OcclusionTriangle
+{
+    f32 edgeA[3];
+    f32 edgeB[3];
+    f32 edgeC[3];
+    f32 depthA; // depth = depthA * x + depthB * y + depthC
+    f32 depthB;
+    f32 depthC;
+    i32 minX, minY;
+    i32 maxX, maxY; // Inclusive, clamped to the buffer
+};
+
+struct OcclusionBuffer
+{
+    std::vector<f32> depth; // Nearest occluder depth of each pixel in [0, 1]
+    std::vector<OcclusionTriangle> triangles;
+    std::vector<u32> tileBins[OCCLUSION_TILES_X * OCCLUSION_TILES_Y];
+};
+
+/**
+ * Simplifies a triangle list by vertex clustering: vertices falling in the same cell of a
+ * gridResolution^3 grid over the mesh bounds are merged into their average. The result is not
+ * conservative, it can bulge up to a cell past the real surface, but it stays inside the mesh bounds.
+ */
+OccluderMesh BuildOccluderMesh(const std::vector<glm::vec3>& positions, const std::vector<u32>& indices, u32 gridResolution);
+
+void ClearOcclusionBuffer(OcclusionBuffer& buffer);
+
+/**
+ * Transforms, culls and bins the triangles of an occluder. Triangles touching the near plane
+ * are dropped, which only makes the buffer less occluding.
+ */
+void AddOccluder(OcclusionBuffer& buffer, const OccluderMesh& occluder, const glm::mat4& worldViewProjection);
+
+/**
+ * Rasterizes the binned triangles, every tile is a job of its own.
+ */
+void RasterizeOccluders(OcclusionBuffer& buffer);
+
+/**
+ * Returns false only when every pixel covered by the box is behind the occluders.
+ */
+bool IsBoxVisible(const OcclusionBuffer& buffer, const glm::vec3& boxMin, const glm::vec3& boxMax, const glm::mat4& viewProjection);
+
+/**
+ * Checks the rasterizer and the box test on the CPU alone: random triangles against a scalar
+ * reference, and boxes in front of, behind and beside a known wall. Logs and returns the failed checks.
+ */
+u32 TestOcclusionBuffer();
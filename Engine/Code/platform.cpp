@@ -19,6 +19,10 @@
 
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <deque>
+#include <condition_variable>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
@@ -107,19 +111,7 @@ void OnGlfwResizeFramebuffer(GLFWwindow* window, int width, int height)
     App* app = (App*)glfwGetWindowUserPointer(window);
     app->displaySize = glm::vec2(width, height);
 
-    glBindTexture(GL_TEXTURE_2D, app->albedoAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-    glBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-    glBindTexture(GL_TEXTURE_2D, app->positionsAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-
-    glBindTexture(GL_TEXTURE_2D, app->depthHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-
-    glBindTexture(GL_TEXTURE_2D, 0);
+    ResizeRenderTargets(app);
 }
 
 void OnGlfwCloseWindow(GLFWwindow* window)
@@ -128,8 +120,23 @@ void OnGlfwCloseWindow(GLFWwindow* window)
     app->isRunning = false;
 }
 
-int main()
+// Runs on machines without a GPU, so it is done before GLFW or any graphics context is created
+int RunOcclusionTest()
 {
+    InitJobSystem();
+    u32 failures = TestOcclusionBuffer();
+    ShutdownJobSystem();
+
+    ILOG("Software occlusion test: %u checks failed\n", failures);
+    return (int)failures;
+}
+
+int main(int argc, char** argv)
+{
+    // Engine.exe --test-occlusion exits with the number of failed checks
+    if (argc > 1 && strcmp(argv[1], "--test-occlusion") == 0)
+        return RunOcclusionTest();
+
     App app         = {};
     app.deltaTime   = 1.0f/60.0f;
     app.timeRunning = 0.0f;
@@ -214,6 +221,8 @@ int main()
 
     GlobalFrameArenaMemory = (u8*)malloc(GLOBAL_FRAME_ARENA_SIZE);
 
+    InitJobSystem();
+
     Init(&app);
 
     while (app.isRunning)
@@ -221,6 +230,9 @@ int main()
         // Tell GLFW to call platform callbacks
         glfwPollEvents();
 
+        // GL work queued by jobs that nothing has waited for
+        RunMainThreadJobs();
+
         // ImGui
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
@@ -279,6 +291,8 @@ int main()
         GlobalFrameArenaHead = 0;
     }
 
+    ShutdownJobSystem();
+
     free(GlobalFrameArenaMemory);
 
     ImGui_ImplOpenGL3_Shutdown();
@@ -425,3 +439,239 @@ void LogString(const char* str)
     fprintf(stderr, "%s\n", str);
 #endif
 }
+
+struct Job
+{
+    std::function<void()> function;
+    JobGroup* group;
+};
+
+struct JobQueue
+{
+    std::mutex mutex;
+    std::deque<Job*> jobs; // The owner works on the back, thieves take from the front
+};
+
+struct JobSystem
+{
+    JobQueue* queues; // One per thread, the main thread's first
+    u32 queueCount;
+    std::vector<std::thread> workers;
+    std::thread::id mainThreadId;
+
+    std::atomic<i32> queuedJobs;
+    std::atomic<bool> quit;
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+
+    std::mutex mainThreadMutex;
+    std::vector<std::function<void()>> mainThreadJobs;
+};
+
+JobSystem GlobalJobSystem;
+thread_local u32 ThreadQueueIdx = 0u; // Threads outside the pool push to the main thread's queue
+
+void PushJob(Job* job)
+{
+    JobSystem& system = GlobalJobSystem;
+    ASSERT(system.queueCount > 0u, "Jobs can't run before InitJobSystem");
+
+    // Counted first, so a sleeping worker woken by it may find nothing yet but never misses it
+    ++system.queuedJobs;
+    JobQueue& queue = system.queues[ThreadQueueIdx];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back(job);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(system.sleepMutex);
+    }
+    system.wakeUp.notify_one();
+}
+
+Job* TakeJob()
+{
+    JobSystem& system = GlobalJobSystem;
+    for (u32 i = 0u; i < system.queueCount; ++i)
+    {
+        const bool own = i == 0u;
+        JobQueue& queue = system.queues[(ThreadQueueIdx + i) % system.queueCount];
+
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty())
+            continue;
+
+        Job* job = own ? queue.jobs.back() : queue.jobs.front();
+        if (own)
+            queue.jobs.pop_back();
+        else
+            queue.jobs.pop_front();
+        --system.queuedJobs;
+        return job;
+    }
+    return NULL;
+}
+
+void ExecuteJob(Job* job)
+{
+    job->function();
+    JobGroup& group = *job->group;
+    delete job;
+
+    // Nothing touches the group after unlocking, its waiter may destroy it as soon as pending is zero
+    std::vector<Job*> ready;
+    {
+        std::lock_guard<std::mutex> lock(group.mutex);
+        if (--group.pending == 0u)
+            ready.swap(group.dependents);
+    }
+    for (Job* dependent : ready)
+        PushJob(dependent);
+}
+
+void WorkerLoop(u32 queueIdx)
+{
+    JobSystem& system = GlobalJobSystem;
+    ThreadQueueIdx = queueIdx;
+
+    while (!system.quit)
+    {
+        if (Job* job = TakeJob())
+        {
+            ExecuteJob(job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(system.sleepMutex);
+        system.wakeUp.wait(lock, [&system]() { return system.queuedJobs > 0 || system.quit; });
+    }
+}
+
+void RunJob(JobGroup& group, std::function<void()> function, JobGroup* dependency)
+{
+    ASSERT(dependency != &group, "A job group can't wait for itself");
+
+    Job* job = new Job{ std::move(function), &group };
+    {
+        std::lock_guard<std::mutex> lock(group.mutex);
+        ++group.pending;
+    }
+
+    if (dependency)
+    {
+        std::lock_guard<std::mutex> lock(dependency->mutex);
+        if (dependency->pending > 0u)
+        {
+            dependency->dependents.push_back(job);
+            return;
+        }
+    }
+
+    PushJob(job);
+}
+
+void WaitForJobs(JobGroup& group)
+{
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lock(group.mutex);
+            if (group.pending == 0u)
+                return;
+        }
+
+        if (IsMainThread())
+            RunMainThreadJobs();
+
+        if (Job* job = TakeJob())
+            ExecuteJob(job);
+        else
+            std::this_thread::yield();
+    }
+}
+
+void ParallelFor(u32 count, u32 grainSize, const std::function<void(u32 begin, u32 end)>& body)
+{
+    grainSize = glm::max(grainSize, 1u);
+    if (count <= grainSize || GlobalJobSystem.queueCount <= 1u)
+    {
+        if (count > 0u)
+            body(0u, count);
+        return;
+    }
+
+    // The first range runs here while the others are stolen
+    JobGroup group;
+    for (u32 begin = grainSize; begin < count; begin += grainSize)
+        RunJob(group, [&body, begin, grainSize, count]() { body(begin, glm::min(begin + grainSize, count)); });
+    body(0u, grainSize);
+
+    WaitForJobs(group);
+}
+
+void RunOnMainThread(std::function<void()> work)
+{
+    if (IsMainThread())
+    {
+        work();
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(GlobalJobSystem.mainThreadMutex);
+    GlobalJobSystem.mainThreadJobs.push_back(std::move(work));
+}
+
+void RunMainThreadJobs()
+{
+    ASSERT(IsMainThread(), "Main thread jobs can only run on the main thread");
+
+    std::vector<std::function<void()>> work;
+    {
+        std::lock_guard<std::mutex> lock(GlobalJobSystem.mainThreadMutex);
+        work.swap(GlobalJobSystem.mainThreadJobs);
+    }
+    for (std::function<void()>& function : work)
+        function();
+}
+
+bool IsMainThread()
+{
+    return std::this_thread::get_id() == GlobalJobSystem.mainThreadId;
+}
+
+u32 GetJobThreadCount()
+{
+    return glm::max(GlobalJobSystem.queueCount, 1u);
+}
+
+void InitJobSystem()
+{
+    JobSystem& system = GlobalJobSystem;
+    system.mainThreadId = std::this_thread::get_id();
+    system.queueCount = glm::max(std::thread::hardware_concurrency(), 1u);
+    system.queues = new JobQueue[system.queueCount];
+    system.queuedJobs = 0;
+    system.quit = false;
+
+    for (u32 i = 1u; i < system.queueCount; ++i)
+        system.workers.emplace_back(WorkerLoop, i);
+}
+
+void ShutdownJobSystem()
+{
+    JobSystem& system = GlobalJobSystem;
+    {
+        std::lock_guard<std::mutex> lock(system.sleepMutex);
+        system.quit = true;
+    }
+    system.wakeUp.notify_all();
+
+    for (std::thread& worker : system.workers)
+        worker.join();
+    system.workers.clear();
+
+    delete[] system.queues;
+    system.queues = NULL;
+    system.queueCount = 0u;
+}
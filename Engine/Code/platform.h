@@ -9,11 +9,15 @@
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include <float.h>
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <vector>
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <functional>
 
 #pragma warning(disable : 4267) // conversion from X to Y, possible loss of data
 
@@ -107,3 +111,53 @@ LogString(logBuffer);             \
 #define PI  3.14159265359f
 #define TAU 6.28318530718f
 
+//
+// Job system: a worker thread per extra hardware thread, each with its own queue of jobs. Threads run
+// their newest job first and steal the oldest one of another queue when theirs is empty, so the work
+// split by a job is mostly run by the thread that split it. The frame arena above is not thread safe.
+//
+
+struct Job;
+
+/**
+ * Jobs that can be waited for together, or that other jobs can wait for before starting. Must outlive
+ * its jobs, WaitForJobs ensures it.
+ */
+struct JobGroup
+{
+    std::mutex mutex;
+    u32 pending = 0u; // Jobs run or waiting to run, guarded by mutex
+    std::vector<Job*> dependents; // Jobs waiting for pending to reach zero
+};
+
+/**
+ * Queues a job in group. When dependency is given the job only starts once every job of dependency
+ * has finished.
+ */
+void RunJob(JobGroup& group, std::function<void()> job, JobGroup* dependency = NULL);
+
+/**
+ * Runs other jobs on the calling thread until every job of the group has finished.
+ */
+void WaitForJobs(JobGroup& group);
+
+/**
+ * Calls body over [0, count) split in ranges of about grainSize elements, returning when all are done.
+ * Small counts run on the calling thread.
+ */
+void ParallelFor(u32 count, u32 grainSize, const std::function<void(u32 begin, u32 end)>& body);
+
+/**
+ * OpenGL calls are only valid on the main thread, jobs queue their GL work with RunOnMainThread.
+ * It runs the next time the main thread waits for jobs or calls RunMainThreadJobs, or right away
+ * when called from the main thread.
+ */
+void RunOnMainThread(std::function<void()> work);
+void RunMainThreadJobs();
+bool IsMainThread();
+
+// Threads running jobs, the main thread included
+u32 GetJobThreadCount();
+
+void InitJobSystem();
+void ShutdownJobSystem();
@@ -0,0 +1,181 @@
+//
+// transform.cpp: Batched TRS composition and matrix products with SSE, which every x86 target the
+// project builds for has. Composition keeps one object per lane and transposes to column major only
+// when storing, the scalar tail gives the same results.
+//
+
+#include "transform.h"
+
+#include <xmmintrin.h>
+#include <glm/gtx/euler_angles.hpp>
+
+glm::quat EulerDegreesToQuat(const glm::vec3& rotation)
+{
+    glm::vec3 radians = (rotation / 360.0f) * 2.0f * PI;
+    return glm::angleAxis(radians.x, glm::vec3(1, 0, 0)) * glm::angleAxis(radians.y, glm::vec3(0, 1, 0)) * glm::angleAxis(radians.z, glm::vec3(0, 0, 1));
+}
+
+glm::vec3 QuatToEulerDegrees(const glm::quat& rotation)
+{
+    glm::vec3 radians;
+    glm::extractEulerAngleXYZ(glm::mat4_cast(rotation), radians.x, radians.y, radians.z);
+    return (radians / (2.0f * PI)) * 360.0f;
+}
+
+u32 AddTransform(TransformArrays& transforms, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+{
+    transforms.positionX.push_back(0.0f);
+    transforms.positionY.push_back(0.0f);
+    transforms.positionZ.push_back(0.0f);
+    transforms.rotationX.push_back(0.0f);
+    transforms.rotationY.push_back(0.0f);
+    transforms.rotationZ.push_back(0.0f);
+    transforms.rotationW.push_back(1.0f);
+    transforms.scaleX.push_back(1.0f);
+    transforms.scaleY.push_back(1.0f);
+    transforms.scaleZ.push_back(1.0f);
+
+    u32 idx = transforms.positionX.size() - 1u;
+    SetTransform(transforms, idx, position, rotation, scale);
+    return idx;
+}
+
+void SetTransform(TransformArrays& transforms, u32 idx, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+{
+    ASSERT(idx < transforms.positionX.size(), "Transform index out of range");
+    transforms.positionX[idx] = position.x;
+    transforms.positionY[idx] = position.y;
+    transforms.positionZ[idx] = position.z;
+    transforms.rotationX[idx] = rotation.x;
+    transforms.rotationY[idx] = rotation.y;
+    transforms.rotationZ[idx] = rotation.z;
+    transforms.rotationW[idx] = rotation.w;
+    transforms.scaleX[idx] = scale.x;
+    transforms.scaleY[idx] = scale.y;
+    transforms.scaleZ[idx] = scale.z;
+}
+
+void GetTransform(const TransformArrays& transforms, u32 idx, glm::vec3& position, glm::quat& rotation, glm::vec3& scale)
+{
+    ASSERT(idx < transforms.positionX.size(), "Transform index out of range");
+    position = glm::vec3(transforms.positionX[idx], transforms.positionY[idx], transforms.positionZ[idx]);
+    rotation = glm::quat(transforms.rotationW[idx], transforms.rotationX[idx], transforms.rotationY[idx], transforms.rotationZ[idx]);
+    scale = glm::vec3(transforms.scaleX[idx], transforms.scaleY[idx], transforms.scaleZ[idx]);
+}
+
+void RemoveTransform(TransformArrays& transforms, u32 idx)
+{
+    ASSERT(idx < transforms.positionX.size(), "Transform index out of range");
+    transforms.positionX.erase(transforms.positionX.begin() + idx);
+    transforms.positionY.erase(transforms.positionY.begin() + idx);
+    transforms.positionZ.erase(transforms.positionZ.begin() + idx);
+    transforms.rotationX.erase(transforms.rotationX.begin() + idx);
+    transforms.rotationY.erase(transforms.rotationY.begin() + idx);
+    transforms.rotationZ.erase(transforms.rotationZ.begin() + idx);
+    transforms.rotationW.erase(transforms.rotationW.begin() + idx);
+    transforms.scaleX.erase(transforms.scaleX.begin() + idx);
+    transforms.scaleY.erase(transforms.scaleY.begin() + idx);
+    transforms.scaleZ.erase(transforms.scaleZ.begin() + idx);
+}
+
+void ClearTransforms(TransformArrays& transforms)
+{
+    transforms = TransformArrays();
+}
+
+void ComposeTransform(const TransformArrays& transforms, u32 i, glm::mat4& world)
+{
+    f32 x = transforms.rotationX[i], y = transforms.rotationY[i], z = transforms.rotationZ[i], w = transforms.rotationW[i];
+    f32 sx = transforms.scaleX[i], sy = transforms.scaleY[i], sz = transforms.scaleZ[i];
+
+    // Rows of the rotation scaled, as the scale is applied after it
+    world[0] = glm::vec4(sx * (1.0f - 2.0f * (y * y + z * z)), sy * 2.0f * (x * y + w * z), sz * 2.0f * (x * z - w * y), 0.0f);
+    world[1] = glm::vec4(sx * 2.0f * (x * y - w * z), sy * (1.0f - 2.0f * (x * x + z * z)), sz * 2.0f * (y * z + w * x), 0.0f);
+    world[2] = glm::vec4(sx * 2.0f * (x * z + w * y), sy * 2.0f * (y * z - w * x), sz * (1.0f - 2.0f * (x * x + y * y)), 0.0f);
+    world[3] = glm::vec4(transforms.positionX[i], transforms.positionY[i], transforms.positionZ[i], 1.0f);
+}
+
+// Stores one column of 4 matrices whose elements are given one object per lane
+void StoreTransposedColumn(glm::mat4* world, u32 column, __m128 row0, __m128 row1, __m128 row2, __m128 row3)
+{
+    _MM_TRANSPOSE4_PS(row0, row1, row2, row3);
+    _mm_storeu_ps(&world[0][column][0], row0);
+    _mm_storeu_ps(&world[1][column][0], row1);
+    _mm_storeu_ps(&world[2][column][0], row2);
+    _mm_storeu_ps(&world[3][column][0], row3);
+}
+
+void ComposeTransforms(const TransformArrays& transforms, u32 begin, u32 end, glm::mat4* world)
+{
+    ASSERT(begin <= end && end <= transforms.positionX.size(), "Transform range out of bounds");
+    u32 i = begin;
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+
+    for (; i + 4u <= end; i += 4u)
+    {
+        __m128 x = _mm_loadu_ps(&transforms.rotationX[i]);
+        __m128 y = _mm_loadu_ps(&transforms.rotationY[i]);
+        __m128 z = _mm_loadu_ps(&transforms.rotationZ[i]);
+        __m128 w = _mm_loadu_ps(&transforms.rotationW[i]);
+        __m128 sx = _mm_loadu_ps(&transforms.scaleX[i]);
+        __m128 sy = _mm_loadu_ps(&transforms.scaleY[i]);
+        __m128 sz = _mm_loadu_ps(&transforms.scaleZ[i]);
+
+        __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+        __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+        __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+        // Rows of the rotation scaled, as the scale is applied after it
+        glm::mat4* out = world + (i - begin);
+        StoreTransposedColumn(out, 0,
+            _mm_mul_ps(sx, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz)))),
+            _mm_mul_ps(sy, _mm_mul_ps(two, _mm_add_ps(xy, wz))),
+            _mm_mul_ps(sz, _mm_mul_ps(two, _mm_sub_ps(xz, wy))),
+            zero);
+        StoreTransposedColumn(out, 1,
+            _mm_mul_ps(sx, _mm_mul_ps(two, _mm_sub_ps(xy, wz))),
+            _mm_mul_ps(sy, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz)))),
+            _mm_mul_ps(sz, _mm_mul_ps(two, _mm_add_ps(yz, wx))),
+            zero);
+        StoreTransposedColumn(out, 2,
+            _mm_mul_ps(sx, _mm_mul_ps(two, _mm_add_ps(xz, wy))),
+            _mm_mul_ps(sy, _mm_mul_ps(two, _mm_sub_ps(yz, wx))),
+            _mm_mul_ps(sz, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy)))),
+            zero);
+        StoreTransposedColumn(out, 3,
+            _mm_loadu_ps(&transforms.positionX[i]),
+            _mm_loadu_ps(&transforms.positionY[i]),
+            _mm_loadu_ps(&transforms.positionZ[i]),
+            one);
+    }
+
+    for (; i < end; ++i)
+        ComposeTransform(transforms, i, world[i - begin]);
+}
+
+void MultiplyTransforms(const glm::mat4& viewProjection, const glm::mat4* world, u32 count, glm::mat4* mvp)
+{
+    __m128 vp[4];
+    for (u32 k = 0; k < 4; ++k)
+        vp[k] = _mm_loadu_ps(&viewProjection[k][0]);
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        // All the columns are loaded before any is stored, so world and mvp can alias
+        __m128 columns[4];
+        for (u32 c = 0; c < 4; ++c)
+            columns[c] = _mm_loadu_ps(&world[i][c][0]);
+
+        for (u32 c = 0; c < 4; ++c)
+        {
+            __m128 result = _mm_mul_ps(vp[0], _mm_shuffle_ps(columns[c], columns[c], _MM_SHUFFLE(0, 0, 0, 0)));
+            result = _mm_add_ps(result, _mm_mul_ps(vp[1], _mm_shuffle_ps(columns[c], columns[c], _MM_SHUFFLE(1, 1, 1, 1))));
+            result = _mm_add_ps(result, _mm_mul_ps(vp[2], _mm_shuffle_ps(columns[c], columns[c], _MM_SHUFFLE(2, 2, 2, 2))));
+            result = _mm_add_ps(result, _mm_mul_ps(vp[3], _mm_shuffle_ps(columns[c], columns[c], _MM_SHUFFLE(3, 3, 3, 3))));
+            _mm_storeu_ps(&mvp[i][c][0], result);
+        }
+    }
+}
@@ -0,0 +1,47 @@
+//
+// transform.h: Entity transforms stored as structure of arrays and composed into matrices in batches,
+// 4 at a time with SSE.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glm/gtc/quaternion.hpp>
+
+// Position, rotation and scale of every transform, one array per component
+struct TransformArrays
+{
+    std::vector<f32> positionX;
+    std::vector<f32> positionY;
+    std::vector<f32> positionZ;
+    std::vector<f32> rotationX;
+    std::vector<f32> rotationY;
+    std::vector<f32> rotationZ;
+    std::vector<f32> rotationW;
+    std::vector<f32> scaleX;
+    std::vector<f32> scaleY;
+    std::vector<f32> scaleZ;
+};
+
+/**
+ * Quaternion of the rotation built by Rotate, the x axis applied last, from angles in degrees.
+ */
+glm::quat EulerDegreesToQuat(const glm::vec3& rotation);
+glm::vec3 QuatToEulerDegrees(const glm::quat& rotation);
+
+u32 AddTransform(TransformArrays& transforms, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale);
+void SetTransform(TransformArrays& transforms, u32 idx, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale);
+void GetTransform(const TransformArrays& transforms, u32 idx, glm::vec3& position, glm::quat& rotation, glm::vec3& scale);
+void RemoveTransform(TransformArrays& transforms, u32 idx);
+void ClearTransforms(TransformArrays& transforms);
+
+/**
+ * Writes the matrices of the transforms in [begin, end) to world, starting at world[0]. Same result as
+ * Rotate(Scale(Translate(IDENTITY4, position), scale), rotation), so the scale is along the world axes.
+ */
+void ComposeTransforms(const TransformArrays& transforms, u32 begin, u32 end, glm::mat4* world);
+
+/**
+ * Writes viewProjection * world[i] to mvp[i] for count matrices, world and mvp can be the same array.
+ */
+void MultiplyTransforms(const glm::mat4& viewProjection, const glm::mat4* world, u32 count, glm::mat4* mvp);
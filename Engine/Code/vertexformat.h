@@ -0,0 +1,174 @@
+//
+// vertexformat.h: Vertex layouts declared as types, so their offsets, strides and attribute formats
+// are known at compile time and checked against the inputs of the programs that read them.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+
+struct VertexBufferAttribute
+{
+    u8 location;
+    u8 componentCount;
+    u8 offset;
+    GLenum type = GL_FLOAT;
+    bool normalized = false; // Integer types are read as [0, 1] or [-1, 1]
+};
+
+struct VertexBufferLayout
+{
+    std::vector<VertexBufferAttribute> attributes;
+    u8 stride;
+};
+
+/**
+ * One attribute stored as ComponentCount values of Type in Size bytes, read by the shader input at Location.
+ * Size may exceed the components to keep the next attribute aligned.
+ */
+template <u8 Location, u8 ComponentCount, GLenum Type, bool Normalized, u8 Size>
+struct VertexAttributeFormat
+{
+    static_assert(Location < 32, "Vertex layouts track their locations in a 32-bit mask");
+    static_assert(ComponentCount >= 1 && ComponentCount <= 4, "Vertex attributes have 1 to 4 components");
+    static_assert(Size % 4 == 0, "Vertex attributes must keep the next one 4-byte aligned");
+    static_assert(Type != GL_INT_2_10_10_10_REV || (ComponentCount == 4 && Size == 4), "Packed 2_10_10_10 attributes are 4 components in 4 bytes");
+    static_assert(Type != GL_FLOAT || Size == ComponentCount * 4, "Float attributes are never padded");
+
+    static constexpr u8 location = Location;
+    static constexpr u8 componentCount = ComponentCount;
+    static constexpr GLenum type = Type;
+    static constexpr bool normalized = Normalized;
+    static constexpr u8 size = Size;
+};
+
+template <u8 Location, u8 ComponentCount>
+using FloatAttribute = VertexAttributeFormat<Location, ComponentCount, GL_FLOAT, false, ComponentCount * 4>;
+
+/**
+ * Attributes interleaved in the given order. Repeating a location or overflowing the 8-bit stride of
+ * VertexBufferLayout fails to compile.
+ */
+template <typename... Attributes>
+struct VertexLayoutFormat;
+
+template <>
+struct VertexLayoutFormat<>
+{
+    static constexpr u32 stride = 0;
+    static constexpr u32 locationMask = 0;
+
+    static void AppendAttributes(VertexBufferLayout&, u32) {}
+    static void SetupAttributes(GLuint, u32) {}
+};
+
+template <typename First, typename... Rest>
+struct VertexLayoutFormat<First, Rest...>
+{
+    typedef VertexLayoutFormat<Rest...> Tail;
+
+    static_assert((Tail::locationMask & (1u << First::location)) == 0, "Vertex layouts can't repeat a location");
+    static_assert(First::size + Tail::stride <= 255, "Vertex layout strides must fit in 8 bits");
+
+    static constexpr u32 stride = First::size + Tail::stride;
+    static constexpr u32 locationMask = (1u << First::location) | Tail::locationMask;
+
+    // Runtime description for the code that walks the vertices on the CPU
+    static VertexBufferLayout MakeBufferLayout()
+    {
+        VertexBufferLayout layout = {};
+        layout.stride = stride;
+        AppendAttributes(layout, 0);
+        return layout;
+    }
+
+    static void AppendAttributes(VertexBufferLayout& layout, u32 offset)
+    {
+        VertexBufferAttribute attribute = { First::location, First::componentCount, (u8)offset, First::type, First::normalized };
+        layout.attributes.push_back(attribute);
+        Tail::AppendAttributes(layout, offset + First::size);
+    }
+
+    // Attribute formats of the bound VAO, sourced from the vertex buffer at bindingIndex
+    static void SetupAttributes(GLuint bindingIndex, u32 relativeOffset)
+    {
+        glEnableVertexAttribArray(First::location);
+        glVertexAttribFormat(First::location, First::componentCount, First::type, First::normalized ? GL_TRUE : GL_FALSE, relativeOffset);
+        glVertexAttribBinding(First::location, bindingIndex);
+        Tail::SetupAttributes(bindingIndex, relativeOffset + First::size);
+    }
+};
+
+// Locations a vertex shader reads, declared next to the layouts that feed it
+template <u8... Locations>
+struct ShaderInputFormat;
+
+template <>
+struct ShaderInputFormat<>
+{
+    static constexpr u32 locationMask = 0;
+};
+
+template <u8 First, u8... Rest>
+struct ShaderInputFormat<First, Rest...>
+{
+    static constexpr u32 locationMask = (1u << First) | ShaderInputFormat<Rest...>::locationMask;
+};
+
+template <typename Layout, typename Inputs>
+constexpr bool VertexLayoutFeeds()
+{
+    return (Inputs::locationMask & ~Layout::locationMask) == 0;
+}
+
+// Authored vertices, as the loader and the mesh builders fill them
+typedef VertexLayoutFormat<FloatAttribute<0, 3>, FloatAttribute<1, 2>> ScreenSourceVertex;
+typedef VertexLayoutFormat<FloatAttribute<0, 3>> PositionSourceVertex;
+typedef VertexLayoutFormat<
+    FloatAttribute<0, 3>, // Position
+    FloatAttribute<1, 3>, // Normal
+    FloatAttribute<2, 2>, // Texture coordinates
+    FloatAttribute<3, 3>, // Tangent
+    FloatAttribute<4, 3>> // Bitangent
+    SurfaceSourceVertex;
+
+// Uploaded surface vertices, see VertexFormat
+typedef VertexLayoutFormat<
+    FloatAttribute<0, 3>,
+    FloatAttribute<1, 2>, // Octahedral normal
+    FloatAttribute<2, 2>,
+    FloatAttribute<3, 4>> // Tangent, w is the bitangent handedness
+    FloatSurfaceVertex;
+typedef VertexLayoutFormat<
+    VertexAttributeFormat<0, 3, GL_UNSIGNED_SHORT, true, 8>, // Padded to 8 bytes
+    VertexAttributeFormat<1, 2, GL_SHORT, true, 4>,
+    VertexAttributeFormat<2, 2, GL_HALF_FLOAT, false, 4>,
+    VertexAttributeFormat<3, 4, GL_INT_2_10_10_10_REV, true, 4>>
+    PackedSurfaceVertex;
+
+// Position streams stored after the surface vertices
+typedef VertexLayoutFormat<FloatAttribute<0, 3>> FloatPositionVertex;
+typedef VertexLayoutFormat<VertexAttributeFormat<0, 3, GL_UNSIGNED_SHORT, true, 8>> PackedPositionVertex;
+
+typedef ShaderInputFormat<0, 1, 2, 3> SurfaceShaderInputs; // TEXTURED_MESH, IMPOSTOR_BAKE
+typedef ShaderInputFormat<0> PositionShaderInputs; // DEPTH_PREPASS, POINT_LIGHT, LIGHT_STENCIL
+typedef ShaderInputFormat<0, 1> ScreenShaderInputs; // The full screen passes and IMPOSTOR
+
+static_assert(VertexLayoutFeeds<FloatSurfaceVertex, SurfaceShaderInputs>(), "The float surface vertices must feed the mesh programs");
+static_assert(VertexLayoutFeeds<PackedSurfaceVertex, SurfaceShaderInputs>(), "The packed surface vertices must feed the mesh programs");
+static_assert(VertexLayoutFeeds<FloatPositionVertex, PositionShaderInputs>(), "The float position stream must feed the depth only programs");
+static_assert(VertexLayoutFeeds<PackedPositionVertex, PositionShaderInputs>(), "The packed position stream must feed the depth only programs");
+static_assert(VertexLayoutFeeds<ScreenSourceVertex, ScreenShaderInputs>(), "The screen vertices must feed the full screen programs");
+static_assert(SurfaceSourceVertex::stride == 14 * sizeof(float), "InsertVectexData writes 14 floats per vertex");
+
+// Every layout a vertex buffer range can hold, each drawn through a single VAO
+enum class VertexLayoutId : u8
+{
+    SCREEN,
+    FLOAT_POSITION, // Also the raw positions of the icosphere
+    PACKED_POSITION,
+    FLOAT_SURFACE,
+    PACKED_SURFACE,
+    COUNT
+};
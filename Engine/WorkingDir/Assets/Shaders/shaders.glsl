@@ -2,7 +2,11 @@
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
 
-#ifdef TEXTURED_MESH
+// Shared by several programs. The program name is defined before this
+// section, so every declaration below only reaches the programs listed
+// in its #if, the functions are compiled into all of them.
+
+#if !defined(IMPOSTOR_BAKE) && !defined(TO_SCREEN) && !defined(HIZ_DOWNSAMPLE)
 
 layout(binding = 0, std140) uniform GlobalParams
 {
@@ -10,24 +14,153 @@ layout(binding = 0, std140) uniform GlobalParams
 	vec3 uResolution;
 	float znear;
 	float zfar;
+	mat4 uViewProjection;
+	mat4 uInverseViewProjection;
+};
+
+// World position from the hardware depth of the G-Buffer
+vec3 ReconstructPosition(vec2 texCoord, float depth)
+{
+	vec4 position = uInverseViewProjection * vec4(vec3(texCoord, depth) * 2.0 - 1.0, 1.0);
+	return position.xyz / position.w;
+}
+
+#endif
+
+#if defined(GPU_CULL) || (defined(INDIRECT) && (defined(TEXTURED_MESH) || defined(DEPTH_PREPASS)))
+
+// Every entity of the scene, the instanced aObjectIdx selects the one being drawn
+struct ObjectData
+{
+	mat4 world;
+	vec4 aabbMin;
+	vec4 aabbMax;
+	uint firstBatch;
+	uint batchCount;
+	uint hasNormalMapping;
+	uint hasReliefMapping;
+};
+
+layout(binding = 0, std430) readonly buffer Objects
+{
+	ObjectData objects[];
+};
+
+#elif defined(TEXTURED_MESH) || defined(DEPTH_PREPASS)
+
+// Every entity of the scene, uEntityIdx selects the one being drawn
+struct EntityData
+{
+	mat4 world; // The view projection is applied here, so camera moves leave the array untouched
+	uint hasNormalMapping;
+	uint hasReliefMapping;
 };
 
-layout(binding = 1, std140) uniform LocalParams
+layout(binding = 5, std430) readonly buffer Entities
 {
-	mat4 uWorldMatrix;
-	mat4 uWorldViewProjectionMatrix;
+	EntityData entities[];
+};
+
+uniform uint uEntityIdx;
+
+#endif
+
+#if defined(DIRECTIONAL_LIGHT) || defined(LIGHT_STENCIL) || (defined(POINT_LIGHT) && !defined(INSTANCED))
 
-	unsigned int hasNormalMapping;
-	unsigned int hasReliefMapping;
+// Every light of the scene, uLightIdx selects the one being drawn
+struct LightData
+{
+	vec4 color;
+	vec4 vector; // Direction of the directional lights, center and range of the point lights
+	mat4 world; // Point light volume
+};
+
+layout(binding = 6, std430) readonly buffer SceneLights
+{
+	LightData sceneLights[];
 };
 
+uniform uint uLightIdx;
+
+#endif
+
+// Octahedral normal encoding, stored remapped to [0, 1] in the RG16 targets
+vec2 OctWrap(vec2 v)
+{
+	return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 OctEncode(vec3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	n.xy = n.z >= 0.0 ? n.xy : OctWrap(n.xy);
+	return n.xy * 0.5 + 0.5;
+}
+
+// Vertex normals arrive octahedral encoded in [-1, 1]
+vec3 OctDecodeSigned(vec2 f)
+{
+	vec3 n = vec3(f.x, f.y, 1.0 - abs(f.x) - abs(f.y));
+	float t = max(-n.z, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+}
+
+vec3 OctDecode(vec2 f)
+{
+	return OctDecodeSigned(f * 2.0 - 1.0);
+}
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
+#ifdef TEXTURED_MESH
+
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
+#ifdef VERTEX_PULLING
+// Vertex buffer of the mesh in 32-bit words, decoded with the format of the draw instead of a VAO
+layout(binding = 4, std430) readonly buffer Vertices
+{
+	uint vertexWords[];
+};
+
+uniform uvec4 uVertexLayout; // x: first word of the submesh, y: words per vertex, z: 1 when packed
+uniform uvec4 uAttributeOffsets; // Words into the vertex of the position, normal, uv and tangent, ~0 when missing
+
+vec3 PullPosition(uint word)
+{
+	if (uVertexLayout.z != 0u)
+		return vec3(unpackUnorm2x16(vertexWords[word]), unpackUnorm2x16(vertexWords[word + 1u]).x);
+	return uintBitsToFloat(uvec3(vertexWords[word], vertexWords[word + 1u], vertexWords[word + 2u]));
+}
+
+vec2 PullVec2(uint word, bool packedAsHalf)
+{
+	if (uVertexLayout.z != 0u)
+		return packedAsHalf ? unpackHalf2x16(vertexWords[word]) : unpackSnorm2x16(vertexWords[word]);
+	return uintBitsToFloat(uvec2(vertexWords[word], vertexWords[word + 1u]));
+}
+
+vec4 PullTangent(uint word)
+{
+	if (uVertexLayout.z != 0u)
+	{
+		// Signed 10-10-10-2, x in the lowest bits
+		int bits = int(vertexWords[word]);
+		vec4 v = vec4(bitfieldExtract(bits, 0, 10), bitfieldExtract(bits, 10, 10), bitfieldExtract(bits, 20, 10), bitfieldExtract(bits, 30, 2));
+		return max(v / vec4(511.0, 511.0, 511.0, 1.0), -1.0);
+	}
+	return uintBitsToFloat(uvec4(vertexWords[word], vertexWords[word + 1u], vertexWords[word + 2u], vertexWords[word + 3u]));
+}
+#else
 layout(location = 0) in vec3 aPosition;
-layout(location = 1) in vec3 aNormal;
+layout(location = 1) in vec2 aNormal;
 layout(location = 2) in vec2 aTexCoord;
-layout(location = 3) in vec3 aTangent;
-layout(location = 4) in vec3 aBitangent;
+layout(location = 3) in vec4 aTangent; // w: bitangent handedness
+#endif
 
 out vec2 vTexCoord;
 out vec3 vPosition;
@@ -37,16 +170,44 @@ out mat3 vTBN;
 out vec3 vTanViewPos;
 out vec3 vTanFragPos;
 
+#ifdef INDIRECT
+// Divisor 1, read from the ranges GPU_CULL wrote at each command baseInstance
+layout(location = 5) in uint aObjectIdx;
+
+flat out uint vObjectIdx;
+#endif
+
+// Must match the depth written by DEPTH_PREPASS bit for bit
+invariant gl_Position;
+
 void main()
 {
+	// Same names in every variant so the code below is shared
+#ifdef INDIRECT
+	mat4 uWorldMatrix = objects[aObjectIdx].world;
+	vObjectIdx = aObjectIdx;
+#else
+	mat4 uWorldMatrix = entities[uEntityIdx].world;
+#endif
+	mat4 uWorldViewProjectionMatrix = uViewProjection * uWorldMatrix;
+
+#ifdef VERTEX_PULLING
+	// Same names as the attributes so the code below is shared
+	uint vertexWord = uVertexLayout.x + uint(gl_VertexID) * uVertexLayout.y;
+	vec3 aPosition = PullPosition(vertexWord + uAttributeOffsets.x);
+	vec2 aNormal = uAttributeOffsets.y != ~0u ? PullVec2(vertexWord + uAttributeOffsets.y, false) : vec2(0.0);
+	vec2 aTexCoord = uAttributeOffsets.z != ~0u ? PullVec2(vertexWord + uAttributeOffsets.z, true) : vec2(0.0);
+	vec4 aTangent = uAttributeOffsets.w != ~0u ? PullTangent(vertexWord + uAttributeOffsets.w) : vec4(1.0, 0.0, 0.0, 1.0);
+#endif
+
 	vTexCoord = aTexCoord;
 
 	vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0));
-	vNormal = normalize(vec3(uWorldMatrix * vec4(aNormal, 0.0)));
+	vNormal = normalize(vec3(uWorldMatrix * vec4(OctDecodeSigned(aNormal), 0.0)));
 	vViewDir = normalize(uCameraPosition - vPosition);
 
-	vec3 T = normalize(vec3(uWorldMatrix * vec4(aTangent, 0.0)));
-	vec3 B = normalize(vec3(uWorldMatrix * vec4(aBitangent, 0.0)));
+	vec3 T = normalize(vec3(uWorldMatrix * vec4(aTangent.xyz, 0.0)));
+	vec3 B = cross(vNormal, T) * aTangent.w;
 
 	vTBN = mat3(T, B, vNormal);
 
@@ -66,31 +227,89 @@ in mat3 vTBN;
 in vec3 vTanViewPos;
 in vec3 vTanFragPos;
 
+#ifdef INDIRECT
+flat in uint vObjectIdx;
+#endif
+
 uniform sampler2D uAlbedo;
 uniform sampler2D uNormal;
 uniform sampler2D uRelief;
 
+#ifdef CONE_STEP_MAPPING
+uniform sampler2D uCone; // R: depth, G: square root of the relaxed cone ratio
+
+// Relief fades into plain normal mapping between these distances
+const float reliefFadeStart = 15.0;
+const float reliefFadeEnd = 25.0;
+#endif
+
+#ifdef EARLY_Z
+// Depth was resolved by the prepass, so test it before shading
+layout(early_fragment_tests) in;
+#else
+// Relief mapping can only push the surface away from the camera
+layout(depth_greater) out float gl_FragDepth;
+#endif
+
 layout(location = 0) out vec4 oAlbedo;
-layout(location = 1) out vec4 oNormal;
-layout(location = 2) out vec4 oPosition;
-layout(location = 3) out vec4 oDepth;
-  
-float LinearizeDepth(float depth) 
-{
-    float z = depth * 2.0 - 1.0; // back to NDC 
-    return (2.0 * znear * zfar) / (zfar + znear - z * (zfar - znear)) / zfar;
-}    
+layout(location = 1) out vec2 oNormal;
 
 void main()
 {	
+#ifdef INDIRECT
+	uint hasNormalMapping = objects[vObjectIdx].hasNormalMapping;
+	uint hasReliefMapping = objects[vObjectIdx].hasReliefMapping;
+#else
+	uint hasNormalMapping = entities[uEntityIdx].hasNormalMapping;
+	uint hasReliefMapping = entities[uEntityIdx].hasReliefMapping;
+#endif
+
 	vec3 normal = vNormal;
 	vec2 UVs = vTexCoord;
 	float depth = gl_FragCoord.z;
 
+#ifndef EARLY_Z
+#ifdef CONE_STEP_MAPPING
+	float reliefFade = 1.0 - smoothstep(reliefFadeStart, reliefFadeEnd, distance(uCameraPosition, vPosition));
+	if (hasReliefMapping > 0 && reliefFade > 0.0)
+#else
 	if (hasReliefMapping > 0)
+#endif
 	{
 		vec3 tanViewDir = normalize(vTanFragPos - vTanViewPos);
 		float heightScale = 0.05;
+#ifdef CONE_STEP_MAPPING
+		heightScale *= reliefFade;
+
+		// UV offset per unit of depth
+		vec3 rayDir = vec3(-vec2(tanViewDir.x, tanViewDir.y) / tanViewDir.z * heightScale, 1.0);
+		float rayRatio = length(rayDir.xy);
+
+		vec3 rayPos = vec3(UVs, 0.0);
+		float coneStep = 0.0;
+		for (int i = 0; i < 12; ++i)
+		{
+			vec2 cone = texture(uCone, rayPos.xy).rg;
+			float coneRatio = cone.g * cone.g;
+			float height = clamp(cone.r - rayPos.z, 0.0, 1.0);
+			coneStep = coneRatio * height / max(rayRatio + coneRatio, 1e-5);
+			rayPos += rayDir * coneStep;
+		}
+
+		// Relaxed cones can cross the surface once, so the hit is inside the last step
+		vec3 range = 0.5 * rayDir * coneStep;
+		rayPos -= range;
+		for (int i = 0; i < 6; ++i)
+		{
+			range *= 0.5;
+			if (rayPos.z < texture(uCone, rayPos.xy).r)
+				rayPos += range;
+			else
+				rayPos -= range;
+		}
+
+		UVs = rayPos.xy;
+#else
 		const float minLayers = 8.0 * 5.0;
 		const float maxLayers = 64.0 * 5.0;
 		float numLayers = mix(maxLayers, minLayers, abs(dot(vec3(0,0,1), tanViewDir)));
@@ -114,6 +333,7 @@ void main()
 		float weight = afterDepth / (afterDepth - beforeDepth);
 		
 		UVs = prevTexCoords * weight + UVs * (1.0f - weight);
+#endif
 
 		// NO DEPTH
 		// IDEA -> USE texture(uRelief, UVs) AND heightScale TO UPDATE THE DEPTH VALUE
@@ -122,6 +342,7 @@ void main()
 		if(UVs.x > 1.0 || UVs.y > 1.0 || UVs.x < 0.0 || UVs.y < 0.0)
 			discard;
 	}
+#endif
 
 	if (hasNormalMapping > 0)
 	{
@@ -134,11 +355,11 @@ void main()
 	}
 
 	oAlbedo = texture(uAlbedo, UVs);
-	oNormal = vec4(normal, 1.0);
-	oPosition = vec4(vPosition, 1.0);
+	oNormal = OctEncode(normal);
 
+#ifndef EARLY_Z
 	gl_FragDepth = depth;
-	oDepth = vec4(vec3(LinearizeDepth(depth)), 1.0);
+#endif
 }
 
 #endif
@@ -148,16 +369,205 @@ void main()
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
 
-#ifdef DIRECTIONAL_LIGHT
+#ifdef DEPTH_PREPASS
 
-layout(binding = 0, std140) uniform GlobalParams
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+#ifdef VERTEX_PULLING
+// Vertex buffer of the mesh in 32-bit words, decoded with the format of the draw instead of a VAO
+layout(binding = 4, std430) readonly buffer Vertices
 {
-	vec3 uCameraPosition;
-	vec3 uResolution;
-	float znear;
-	float zfar;
+	uint vertexWords[];
+};
+
+uniform uvec4 uVertexLayout; // x: first word of the position stream, y: words per vertex, z: 1 when packed
+
+vec3 PullPosition(uint word)
+{
+	if (uVertexLayout.z != 0u)
+		return vec3(unpackUnorm2x16(vertexWords[word]), unpackUnorm2x16(vertexWords[word + 1u]).x);
+	return uintBitsToFloat(uvec3(vertexWords[word], vertexWords[word + 1u], vertexWords[word + 2u]));
+}
+#else
+layout(location = 0) in vec3 aPosition;
+#endif
+
+#ifdef INDIRECT
+layout(location = 5) in uint aObjectIdx;
+#endif
+
+// Must match the depth of the TEXTURED_MESH pass bit for bit
+invariant gl_Position;
+
+void main()
+{
+#ifdef INDIRECT
+	mat4 uWorldMatrix = objects[aObjectIdx].world;
+#else
+	mat4 uWorldMatrix = entities[uEntityIdx].world;
+#endif
+	mat4 uWorldViewProjectionMatrix = uViewProjection * uWorldMatrix;
+
+#ifdef VERTEX_PULLING
+	vec3 aPosition = PullPosition(uVertexLayout.x + uint(gl_VertexID) * uVertexLayout.y);
+#endif
+
+	gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+// Only the depth buffer is written
+void main()
+{
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
+#ifdef IMPOSTOR_BAKE
+
+// Renders a model in mesh space into one frame of the impostor atlases
+uniform mat4 uBakeViewProjection;
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 1) in vec2 aNormal;
+layout(location = 2) in vec2 aTexCoord;
+
+out vec2 vTexCoord;
+out vec3 vNormal;
+
+void main()
+{
+	vTexCoord = aTexCoord;
+	vNormal = OctDecodeSigned(aNormal);
+	gl_Position = uBakeViewProjection * vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec2 vTexCoord;
+in vec3 vNormal;
+
+uniform sampler2D uAlbedo;
+
+layout(location = 0) out vec4 oAlbedo;
+layout(location = 1) out vec4 oNormalDepth;
+
+void main()
+{
+	// Alpha is the coverage, the cleared texels around the model are discarded when drawn
+	oAlbedo = vec4(texture(uAlbedo, vTexCoord).rgb, 1.0);
+	// 16-bit depth split in two bytes, 8 bits are too coarse to rebuild the surface from
+	float depth = floor(gl_FragCoord.z * 65535.0 + 0.5);
+	float depthHigh = floor(depth / 256.0);
+	oNormalDepth = vec4(OctEncode(normalize(vNormal)), depthHigh / 255.0, (depth - depthHigh * 256.0) / 255.0);
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
+#ifdef IMPOSTOR
+
+// World matrices of the entities drawn with the current impostor
+layout(binding = 0, std430) readonly buffer ImpostorInstances
+{
+	mat4 instances[];
 };
 
+uniform uint uInstanceOffset;
+uniform vec4 uSphere; // Mesh space bounding sphere the frames were baked around
+uniform uint uFrames; // Frames per side of the octahedral atlas
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 1) in vec2 aTexCoord;
+
+out vec2 vAtlasCoord;
+out vec3 vMeshPosition;
+flat out vec3 vFrameDirection;
+flat out mat4 vWorldMatrix;
+
+void main()
+{
+	mat4 world = instances[uInstanceOffset + gl_InstanceID];
+	vec3 center = vec3(world * vec4(uSphere.xyz, 1.0));
+
+	// Frame baked from the direction closest to the camera, in mesh space
+	vec3 viewDirection = normalize(inverse(mat3(world)) * (uCameraPosition - center));
+	vec2 frame = min(floor(OctEncode(viewDirection) * float(uFrames)), float(uFrames - 1u));
+	vec3 frameDirection = OctDecode((frame + 0.5) / float(uFrames));
+
+	// Same basis glm::lookAt built for the bake, so the quad matches the frame
+	vec3 up = abs(frameDirection.y) > 0.99 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+	vec3 right = normalize(cross(-frameDirection, up));
+	up = cross(right, -frameDirection);
+
+	vAtlasCoord = (frame + aTexCoord) / float(uFrames);
+	vMeshPosition = uSphere.xyz + (right * aPosition.x + up * aPosition.y) * uSphere.w;
+	vFrameDirection = frameDirection;
+	vWorldMatrix = world;
+
+	gl_Position = uViewProjection * world * vec4(vMeshPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec2 vAtlasCoord;
+in vec3 vMeshPosition;
+flat in vec3 vFrameDirection;
+flat in mat4 vWorldMatrix;
+
+uniform sampler2D uAlbedo;
+uniform sampler2D uNormalDepth;
+
+layout(location = 0) out vec4 oAlbedo;
+layout(location = 1) out vec2 oNormal;
+
+void main()
+{
+	vec4 albedo = texture(uAlbedo, vAtlasCoord);
+	if (albedo.a < 0.5)
+		discard;
+
+	vec4 normalDepth = texture(uNormalDepth, vAtlasCoord);
+	vec3 normal = normalize(transpose(inverse(mat3(vWorldMatrix))) * OctDecode(normalDepth.rg));
+
+	// The depth bytes can't be filtered separately, they are read from the nearest texel
+	ivec2 atlasSize = textureSize(uNormalDepth, 0);
+	ivec2 texel = min(ivec2(vAtlasCoord * vec2(atlasSize)), atlasSize - 1);
+	vec2 depthBytes = round(texelFetch(uNormalDepth, texel, 0).ba * 255.0);
+	float depth = (depthBytes.x * 256.0 + depthBytes.y) / 65535.0;
+
+	// The bake depth spans the bounding sphere, from its front (0) to its back (1)
+	vec3 meshPosition = vMeshPosition + vFrameDirection * uSphere.w * (1.0 - 2.0 * depth);
+	vec4 clip = uViewProjection * vWorldMatrix * vec4(meshPosition, 1.0);
+
+	oAlbedo = vec4(albedo.rgb, 1.0);
+	oNormal = OctEncode(normal);
+	gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
+#ifdef DIRECTIONAL_LIGHT
+
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
 layout(location = 0) in vec3 aPosition;
@@ -174,26 +584,22 @@ void main()
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
-layout(binding = 1, std140) uniform LocalParams
-{
-	vec3 uColor;
-	vec3 uDirection;
-};
-
 in vec2 vTexCoord;
 
 uniform sampler2D uAlbedo;
 uniform sampler2D uNormals;
-uniform sampler2D uPosition;
 uniform sampler2D uDepth;
 
 layout(location = 0) out vec4 oColor;
 
 void main()
 {
+	vec3 uColor = sceneLights[uLightIdx].color.rgb;
+	vec3 uDirection = sceneLights[uLightIdx].vector.xyz;
+
 	vec3 albedo = texture(uAlbedo, vTexCoord).xyz;
-	vec3 normal = texture(uNormals, vTexCoord).xyz;
-	vec3 position = texture(uPosition, vTexCoord).xyz;
+	vec3 normal = OctDecode(texture(uNormals, vTexCoord).xy);
+	vec3 position = ReconstructPosition(vTexCoord, texture(uDepth, vTexCoord).x);
 	vec3 viewDir = normalize(uCameraPosition - position);
 
 	vec3 diffuse = uColor * mix(vec3(0), albedo, dot(normal, uDirection)) * 0.7;
@@ -218,66 +624,84 @@ void main()
 
 #ifdef POINT_LIGHT
 
-layout(binding = 0, std140) uniform GlobalParams
+#ifdef INSTANCED
+
+// Every instance is one light, uLightOffset selects the group drawn with the current proxy
+struct PointLight
 {
-	vec3 uCameraPosition;
-	vec3 uResolution;
-	float znear;
-	float zfar;
+	vec4 color;
+	vec4 centerRange;
 };
 
-layout(binding = 1, std140) uniform LocalParams
+layout(binding = 0, std430) readonly buffer PointLights
 {
-	vec3 uColor;
-	vec3 uCenter;
-	float uRange;
-
-	mat4 uWorldMatrix;
-	mat4 uWorldViewProjectionMatrix;
+	PointLight lights[];
 };
 
+uniform uint uLightOffset;
+
+#endif
+
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
 layout(location = 0) in vec3 aPosition;
-layout(location = 1) in vec3 aNormal;
-layout(location = 2) in vec2 aTexCoord;
-layout(location = 3) in vec3 aTangent;
-layout(location = 4) in vec3 aBitangent;
 
 out vec3 vPosition;
 
+#ifdef INSTANCED
+flat out vec3 vLightColor;
+flat out vec4 vLightCenterRange;
+#endif
+
 void main()
 {
-	vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0));
-	gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+#ifdef INSTANCED
+	PointLight light = lights[uLightOffset + gl_InstanceID];
+	vLightColor = light.color.rgb;
+	vLightCenterRange = light.centerRange;
+
+	vPosition = light.centerRange.xyz + aPosition * light.centerRange.w;
+	gl_Position = uViewProjection * vec4(vPosition, 1.0);
+#else
+	vPosition = vec3(sceneLights[uLightIdx].world * vec4(aPosition, 1.0));
+	gl_Position = uViewProjection * vec4(vPosition, 1.0);
+#endif
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
 uniform sampler2D uAlbedo;
 uniform sampler2D uNormals;
-uniform sampler2D uPosition;
 uniform sampler2D uDepth;
 
 layout(location = 0) out vec4 oColor;
 
 in vec3 vPosition;
-  
-float LinearizeDepth(float depth) 
-{
-    float z = depth * 2.0 - 1.0; // back to NDC 
-    return (2.0 * znear * zfar) / (zfar + znear - z * (zfar - znear));	
-}  
+
+#ifdef INSTANCED
+flat in vec3 vLightColor;
+flat in vec4 vLightCenterRange;
+#endif
 
 void main()
 {
+	// Same names in both variants so the code below is shared
+#ifdef INSTANCED
+	vec3 uColor = vLightColor;
+	vec3 uCenter = vLightCenterRange.xyz;
+	float uRange = vLightCenterRange.w;
+#else
+	vec3 uColor = sceneLights[uLightIdx].color.rgb;
+	vec3 uCenter = sceneLights[uLightIdx].vector.xyz;
+	float uRange = sceneLights[uLightIdx].vector.w;
+#endif
+
+	// The stencil volume (or the depth test against the back faces when instanced)
+	// already rejected most of the pixels whose geometry is outside the sphere
 	vec2 texcoord = vec2(gl_FragCoord.x / uResolution.x, gl_FragCoord.y / uResolution.y);
 	vec3 albedo = texture(uAlbedo, texcoord).xyz;
-	vec3 normal = texture(uNormals, texcoord).xyz;
-	vec3 position = texture(uPosition, texcoord).xyz;
-
-	float depth = texture(uDepth, texcoord).x;
-	float vDepth = LinearizeDepth(gl_FragCoord.z) / zfar;
+	vec3 normal = OctDecode(texture(uNormals, texcoord).xy);
+	vec3 position = ReconstructPosition(texcoord, texture(uDepth, texcoord).x);
 
 	vec3 viewDir = normalize(uCameraPosition - position);
 
@@ -285,7 +709,7 @@ void main()
 	float dist = length(direction);
 	direction = normalize(direction);
 
-	if (vDepth > depth && dist < uRange && depth > 0.0)
+	if (dist < uRange)
 	{
 		vec3 diffuse = uColor * (mix(vec3(0), albedo, dot(normal, direction)) * 0.7);
 
@@ -310,6 +734,151 @@ void main()
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
 
+#ifdef LIGHT_STENCIL
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+
+// Same transform as the POINT_LIGHT volume, so the stencil marks exactly its pixels
+void main()
+{
+	vec3 position = vec3(sceneLights[uLightIdx].world * vec4(aPosition, 1.0));
+	gl_Position = uViewProjection * vec4(position, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+// Only the stencil buffer is written
+void main()
+{
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
+#ifdef CLUSTERED_LIGHT
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 1) in vec2 aTexCoord;
+
+out vec2 vTexCoord;
+
+void main()
+{
+	vTexCoord = aTexCoord;
+
+	gl_Position = vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+struct PointLight
+{
+	vec4 color;
+	vec4 centerRange;
+};
+
+layout(binding = 0, std430) readonly buffer ClusterLights
+{
+	PointLight lights[];
+};
+
+layout(binding = 1, std430) readonly buffer ClusterRanges
+{
+	uvec2 clusterRanges[]; // offset and count inside clusterIndices
+};
+
+layout(binding = 2, std430) readonly buffer ClusterIndices
+{
+	uint clusterIndices[];
+};
+
+uniform uvec3 uClusterGrid;
+
+uniform sampler2D uAlbedo;
+uniform sampler2D uNormals;
+uniform sampler2D uDepth;
+
+in vec2 vTexCoord;
+
+layout(location = 0) out vec4 oColor;
+
+float LinearizeDepth(float depth)
+{
+	float z = depth * 2.0 - 1.0; // back to NDC
+	return (2.0 * znear * zfar) / (zfar + znear - z * (zfar - znear));
+}
+
+uint GetClusterIndex(float viewDepth)
+{
+	uvec2 tile = uvec2(gl_FragCoord.xy / (uResolution.xy / vec2(uClusterGrid.xy)));
+	tile = min(tile, uClusterGrid.xy - 1u);
+
+	// Same exponential slicing used to assign the lights on the CPU
+	float slice = log(max(viewDepth, znear) / znear) / log(zfar / znear) * float(uClusterGrid.z);
+	uint z = min(uint(slice), uClusterGrid.z - 1u);
+
+	return tile.x + tile.y * uClusterGrid.x + z * uClusterGrid.x * uClusterGrid.y;
+}
+
+void main()
+{
+	float depth = texture(uDepth, vTexCoord).x;
+	if (depth >= 1.0)
+	{
+		oColor = vec4(0,0,0,0);
+		return;
+	}
+
+	vec3 albedo = texture(uAlbedo, vTexCoord).xyz;
+	vec3 normal = OctDecode(texture(uNormals, vTexCoord).xy);
+	vec3 position = ReconstructPosition(vTexCoord, depth);
+	vec3 viewDir = normalize(uCameraPosition - position);
+
+	uvec2 range = clusterRanges[GetClusterIndex(LinearizeDepth(depth))];
+
+	vec3 color = vec3(0);
+	for (uint i = 0; i < range.y; ++i)
+	{
+		PointLight light = lights[clusterIndices[range.x + i]];
+
+		vec3 direction = light.centerRange.xyz - position;
+		float dist = length(direction);
+		direction = normalize(direction);
+
+		if (dist < light.centerRange.w)
+		{
+			vec3 diffuse = light.color.rgb * (mix(vec3(0), albedo, dot(normal, direction)) * 0.7);
+
+			vec3 ambiental = light.color.rgb * 0.1;
+
+			vec3 specVec = normalize(reflect(direction, normal));
+			float spec = -dot(specVec, viewDir);
+			spec = clamp(spec, 0.0, 1.0);
+			spec = pow(spec, 64.0);
+			vec3 specular = light.color.rgb * spec;
+
+			color += (diffuse + ambiental + specular) * (1 - dist / light.centerRange.w);
+		}
+	}
+
+	oColor = vec4(color, 1.0);
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
 #ifdef TO_SCREEN
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
@@ -342,6 +911,320 @@ void main()
 #endif
 #endif
 
+#ifdef GBUFFER_DEBUG
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 1) in vec2 aTexCoord;
+
+out vec2 vTexCoord;
+
+void main()
+{
+	vTexCoord = aTexCoord;
+
+	gl_Position = vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec2 vTexCoord;
+
+uniform int uMode; // Matches the Mode enum of the engine
+
+uniform sampler2D uAlbedo;
+uniform sampler2D uNormals;
+uniform sampler2D uDepth;
+
+float LinearizeDepth(float depth)
+{
+	float z = depth * 2.0 - 1.0; // back to NDC
+	return (2.0 * znear * zfar) / (zfar + znear - z * (zfar - znear)) / zfar;
+}
+
+layout(location = 0) out vec4 oColor;
+
+void main()
+{
+	float depth = texture(uDepth, vTexCoord).x;
+
+	if (uMode == 1)
+		oColor = texture(uAlbedo, vTexCoord);
+	else if (depth >= 1.0)
+		oColor = vec4(0,0,0,1);
+	else if (uMode == 2)
+		oColor = vec4(OctDecode(texture(uNormals, vTexCoord).xy), 1.0);
+	else if (uMode == 3)
+		oColor = vec4(ReconstructPosition(vTexCoord, depth), 1.0);
+	else
+		oColor = vec4(vec3(LinearizeDepth(depth)), 1.0);
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
+#ifdef HIZ_DOWNSAMPLE
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(binding = 0) uniform sampler2D uSource; // G-Buffer depth or the previous level
+layout(binding = 0, r32f) uniform writeonly image2D uDestination;
+
+uniform int uSourceLevel;
+uniform ivec2 uSourceSize;
+
+void main()
+{
+	ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 size = imageSize(uDestination);
+	if (texel.x >= size.x || texel.y >= size.y)
+		return;
+
+	// Source texels touched by this one, more than 2x2 when the source size is not a power of two
+	ivec2 first = texel * uSourceSize / size;
+	ivec2 last = min(((texel + 1) * uSourceSize + size - 1) / size, uSourceSize) - 1;
+
+	float depth = 0.0;
+	for (int y = first.y; y <= last.y; ++y)
+		for (int x = first.x; x <= last.x; ++x)
+			depth = max(depth, texelFetch(uSource, ivec2(x, y), uSourceLevel).r);
+
+	imageStore(uDestination, texel, vec4(depth));
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
+#ifdef HIZ_CULL
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+layout(local_size_x = 64) in;
+
+struct Bounds
+{
+	vec4 minimum;
+	vec4 maximum;
+};
+
+layout(binding = 0, std430) readonly buffer CullBounds
+{
+	Bounds bounds[];
+};
+
+layout(binding = 1, std430) writeonly buffer CullVisibility
+{
+	uint visibility[];
+};
+
+layout(binding = 0) uniform sampler2D uHiZ;
+
+uniform uint uObjectCount;
+
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= uObjectCount)
+		return;
+
+	vec3 ndcMin = vec3(1.0);
+	vec3 ndcMax = vec3(-1.0);
+	for (int i = 0; i < 8; ++i)
+	{
+		vec3 corner = mix(bounds[index].minimum.xyz, bounds[index].maximum.xyz, vec3(i & 1, (i >> 1) & 1, (i >> 2) & 1));
+		vec4 clip = uViewProjection * vec4(corner, 1.0);
+
+		// Boxes crossing the camera plane can't be projected
+		if (clip.w <= 0.0)
+		{
+			visibility[index] = 1u;
+			return;
+		}
+
+		vec3 ndc = clip.xyz / clip.w;
+		ndcMin = min(ndcMin, ndc);
+		ndcMax = max(ndcMax, ndc);
+	}
+
+	// Frustum
+	if (any(lessThan(ndcMax, vec3(-1.0))) || any(greaterThan(ndcMin.xy, vec2(1.0))) || ndcMin.z > 1.0)
+	{
+		visibility[index] = 0u;
+		return;
+	}
+
+	vec2 uvMin = clamp(ndcMin.xy * 0.5 + 0.5, 0.0, 1.0);
+	vec2 uvMax = clamp(ndcMax.xy * 0.5 + 0.5, 0.0, 1.0);
+	float nearestDepth = ndcMin.z * 0.5 + 0.5;
+
+	// Level where the rectangle spans at most 2x2 texels
+	vec2 rectSize = (uvMax - uvMin) * vec2(textureSize(uHiZ, 0));
+	int levelCount = textureQueryLevels(uHiZ);
+	int level = clamp(int(ceil(log2(max(max(rectSize.x, rectSize.y), 1.0)))), 0, levelCount - 1);
+
+	ivec2 levelSize = textureSize(uHiZ, level);
+	ivec2 texelMin = min(ivec2(uvMin * vec2(levelSize)), levelSize - 1);
+	ivec2 texelMax = min(ivec2(uvMax * vec2(levelSize)), levelSize - 1);
+
+	float farthestDepth = max(
+		max(texelFetch(uHiZ, texelMin, level).r, texelFetch(uHiZ, ivec2(texelMax.x, texelMin.y), level).r),
+		max(texelFetch(uHiZ, ivec2(texelMin.x, texelMax.y), level).r, texelFetch(uHiZ, texelMax, level).r));
+
+	// Hidden when everything already drawn over the rectangle is in front of the box
+	visibility[index] = nearestDepth <= farthestDepth ? 1u : 0u;
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
+#ifdef GPU_CULL
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+layout(local_size_x = 64) in;
+
+// Same layout as the commands read by glDrawElementsIndirect, one per model submesh
+struct DrawCommand
+{
+	uint count;
+	uint instanceCount;
+	uint firstIndex;
+	int baseVertex;
+	uint baseInstance;
+};
+
+layout(binding = 1, std430) buffer DrawCommands
+{
+	DrawCommand commands[];
+};
+
+layout(binding = 2, std430) writeonly buffer DrawInstances
+{
+	uint instances[];
+};
+
+// Kept on the GPU between frames, what the first phase draws
+layout(binding = 3, std430) buffer ObjectVisibility
+{
+	uint visibility[];
+};
+
+layout(binding = 0) uniform sampler2D uHiZ;
+
+uniform uint uObjectCount;
+uniform uint uCullPhase;
+
+const uint CULL_FRUSTUM = 0u; // Single pass, no occlusion
+const uint CULL_FIRST_PHASE = 1u; // Visible last frame, before the Hi-Z pyramid is built
+const uint CULL_SECOND_PHASE = 2u; // Against the new pyramid, only what the first phase missed
+
+bool IsBoxVisible(vec3 boxMin, vec3 boxMax, bool testHiZ)
+{
+	vec3 ndcMin = vec3(1.0);
+	vec3 ndcMax = vec3(-1.0);
+	for (int i = 0; i < 8; ++i)
+	{
+		vec3 corner = mix(boxMin, boxMax, vec3(i & 1, (i >> 1) & 1, (i >> 2) & 1));
+		vec4 clip = uViewProjection * vec4(corner, 1.0);
+
+		// Boxes crossing the camera plane can't be projected
+		if (clip.w <= 0.0)
+			return true;
+
+		vec3 ndc = clip.xyz / clip.w;
+		ndcMin = min(ndcMin, ndc);
+		ndcMax = max(ndcMax, ndc);
+	}
+
+	// Frustum
+	if (any(lessThan(ndcMax, vec3(-1.0))) || any(greaterThan(ndcMin.xy, vec2(1.0))) || ndcMin.z > 1.0)
+		return false;
+
+	if (!testHiZ)
+		return true;
+
+	vec2 uvMin = clamp(ndcMin.xy * 0.5 + 0.5, 0.0, 1.0);
+	vec2 uvMax = clamp(ndcMax.xy * 0.5 + 0.5, 0.0, 1.0);
+	float nearestDepth = ndcMin.z * 0.5 + 0.5;
+
+	// Level where the rectangle spans at most 2x2 texels
+	vec2 rectSize = (uvMax - uvMin) * vec2(textureSize(uHiZ, 0));
+	int levelCount = textureQueryLevels(uHiZ);
+	int level = clamp(int(ceil(log2(max(max(rectSize.x, rectSize.y), 1.0)))), 0, levelCount - 1);
+
+	ivec2 levelSize = textureSize(uHiZ, level);
+	ivec2 texelMin = min(ivec2(uvMin * vec2(levelSize)), levelSize - 1);
+	ivec2 texelMax = min(ivec2(uvMax * vec2(levelSize)), levelSize - 1);
+
+	float farthestDepth = max(
+		max(texelFetch(uHiZ, texelMin, level).r, texelFetch(uHiZ, ivec2(texelMax.x, texelMin.y), level).r),
+		max(texelFetch(uHiZ, ivec2(texelMin.x, texelMax.y), level).r, texelFetch(uHiZ, texelMax, level).r));
+
+	return nearestDepth <= farthestDepth;
+}
+
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= uObjectCount)
+		return;
+
+	ObjectData object = objects[index];
+
+	// World box of the transformed local box
+	vec3 center = vec3(object.world * vec4((object.aabbMin.xyz + object.aabbMax.xyz) * 0.5, 1.0));
+	vec3 extents = (object.aabbMax.xyz - object.aabbMin.xyz) * 0.5;
+	mat3 absolute = mat3(abs(object.world[0].xyz), abs(object.world[1].xyz), abs(object.world[2].xyz));
+	vec3 worldExtents = absolute * extents;
+
+	bool wasVisible = visibility[index] != 0u;
+	bool visible;
+	bool draw;
+	if (uCullPhase == CULL_FIRST_PHASE)
+	{
+		visible = wasVisible && IsBoxVisible(center - worldExtents, center + worldExtents, false);
+		draw = visible;
+	}
+	else
+	{
+		visible = IsBoxVisible(center - worldExtents, center + worldExtents, uCullPhase == CULL_SECOND_PHASE);
+		draw = visible && (uCullPhase == CULL_FRUSTUM || !wasVisible);
+		visibility[index] = visible ? 1u : 0u;
+	}
+
+	if (!draw)
+		return;
+
+	// Compaction, every submesh command gets the object appended to its instance range
+	for (uint b = object.firstBatch; b < object.firstBatch + object.batchCount; ++b)
+	{
+		uint slot = atomicAdd(commands[b].instanceCount, 1u);
+		instances[commands[b].baseInstance + slot] = index;
+	}
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
 // NOTE: You can write several shaders in the same file if you want as
 // long as you embrace them within an #ifdef block (as you can see above).
 // The third parameter of the LoadProgram function in engine.cpp allows